@@ -68,4 +68,33 @@ int OS_MQueueGet(OS_MQueue_t *mQueue, void *message, int ticks)
 void OS_Job(void (*funcPtr)(), void *arg0, void *arg1, void *arg2)
 {funcPtr(arg0, arg1, arg2);}
 
+struct OS_Pool_s {
+   uint32 blockSize;
+   int freeCount;
+};
+
+OS_Pool_t *OS_PoolCreate(const char *name, uint32 blockSize, uint32 count)
+{
+   OS_Pool_t *pool = (OS_Pool_t*)malloc(sizeof(OS_Pool_t));
+   (void)name;
+   pool->blockSize = blockSize;
+   pool->freeCount = count;
+   return pool;
+}
+
+void OS_PoolDelete(OS_Pool_t *pool)          {free(pool);}
+
+void *OS_PoolAlloc(OS_Pool_t *pool)
+{
+   if(pool->freeCount == 0)
+      return NULL;
+   --pool->freeCount;
+   return calloc(1, pool->blockSize);
+}
+
+void OS_PoolFree(OS_Pool_t *pool, void *block)
+{++pool->freeCount; free(block);}
+
+int OS_PoolFreeCount(OS_Pool_t *pool)        {return pool->freeCount;}
+
 
@@ -22,6 +22,22 @@
 #define SEM_RESERVED_COUNT 2
 #define INFO_COUNT 4
 #define HEAP_COUNT 8
+#define SLAB_COUNT 5          //Size classes of 16, 32, 64, 128, and 256 bytes
+#define SLAB_SIZE_MIN 16
+#define SLAB_SIZE_MAX (SLAB_SIZE_MIN << (SLAB_COUNT - 1))
+#define SLAB_BYTES 1024       //Taken from the heap when a size class is empty
+#define SLAB_UNITS(index) ((SLAB_SIZE_MIN << (index)) / sizeof(HeapNode_t) + 1)
+#define SLAB_HEADER ((sizeof(HeapSlab_t) + sizeof(HeapNode_t) - 1) / sizeof(HeapNode_t))
+#define TLSF_SL_BITS 4        //16 second level free lists per power of two
+#define TLSF_SL_COUNT (1 << TLSF_SL_BITS)
+#define TLSF_FL_SHIFT 6       //Blocks under 64 bytes share first level 0
+#define TLSF_FL_COUNT 24      //Blocks under 512MB
+#define TLSF_ALIGN 4
+#define TLSF_FREE 1           //Flag in the block size
+#define PRIORITY_COUNT (THREAD_PRIORITY_MAX + 1)
+#define WHEEL_BITS 6
+#define WHEEL_SIZE (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 4
 
 
 /*************** Structures ***************/
@@ -48,6 +64,12 @@ typedef struct HeapNode_s {
    int size;
 } HeapNode_t;
 
+typedef struct HeapSlab_s {
+   struct HeapSlab_s *next, *prev;  //Slabs of a size class with free blocks
+   HeapNode_t *free;                //Free blocks in this slab
+   int freeCount, count;
+} HeapSlab_t;
+
 struct OS_Heap_s {
    uint32 magic;
    const char *name;
@@ -55,12 +77,44 @@ struct OS_Heap_s {
    HeapNode_t *available;
    HeapNode_t base;
    struct OS_Heap_s *alternate;
+   HeapSlab_t *slab[SLAB_COUNT];  //Slabs with free blocks of each size class
+   int slabFree[SLAB_COUNT];      //Free blocks in slab[]
+   struct Tlsf_s *tlsf;           //NULL for the K&R free list
+   uint32 size, used, highWater;  //Bytes including headers
 };
 //typedef struct OS_Heap_s OS_Heap_t;
 
+typedef struct TlsfBlock_s {
+   struct TlsfBlock_s *prevPhys;  //Block before this one in memory
+   HeapNode_t node;               //node.next = heap, node.size = bytes | TLSF_FREE
+   struct TlsfBlock_s *nextFree;  //Free list links in the first payload bytes
+   struct TlsfBlock_s *prevFree;
+} TlsfBlock_t;
+
+#define TLSF_HEADER (sizeof(TlsfBlock_t*) + sizeof(HeapNode_t))
+#define TLSF_SIZE(B) ((uint32)(B)->node.size & ~(TLSF_ALIGN - 1))
+
+typedef struct Tlsf_s {
+   uint32 flMap;                  //Bit set if slMap[] not zero
+   uint32 slMap[TLSF_FL_COUNT];   //Bit set if free[][] list used
+   TlsfBlock_t *free[TLSF_FL_COUNT][TLSF_SL_COUNT];
+} Tlsf_t;
+
+typedef struct OS_Timeout_s {
+   struct OS_Timeout_s *next;   //Next in a wheel slot or expired list
+   struct OS_Timeout_s **pprev; //Link pointing to this node or NULL
+   uint32 ticks;                //Tick value when it times out
+   void *owner;                 //Thread or timer
+} OS_Timeout_t;
+
+typedef struct {
+   uint32 time;                 //Last tick processed
+   OS_Timeout_t *slot[WHEEL_LEVELS][WHEEL_SIZE];
+} OS_Wheel_t;
+
 typedef enum {
    THREAD_PEND    = 0,       //Thread in semaphore's linked list
-   THREAD_READY   = 1,       //Thread in ThreadHead linked list
+   THREAD_READY   = 1,       //Thread in a ThreadReady linked list
    THREAD_RUNNING = 2        //Thread == ThreadCurrent[cpu]
 } OS_ThreadState_e;
 
@@ -73,7 +127,7 @@ struct OS_Thread_s {
    OS_FuncPtr_t funcPtr;     //First function called
    void *arg;                //Argument to first function called
    uint32 priority;          //Priority of thread (0=low, 255=high)
-   uint32 ticksTimeout;      //Tick value when semaphore pend times out
+   OS_Timeout_t timeout;     //Semaphore pend timeout
    void *info[INFO_COUNT];   //User storage
    OS_Semaphore_t *semaphorePending;  //Semaphore thread is blocked on
    int returnCode;           //Return value from semaphore pend
@@ -81,8 +135,6 @@ struct OS_Thread_s {
    OS_Heap_t *heap;          //Heap used if no heap specified
    struct OS_Thread_s *next; //Linked list of threads by priority
    struct OS_Thread_s *prev;  
-   struct OS_Thread_s *nextTimeout; //Linked list of threads by timeout
-   struct OS_Thread_s *prevTimeout; 
    uint32 magic[1];          //Bottom of stack to detect stack overflow
 };
 //typedef struct OS_Thread_s OS_Thread_t;
@@ -108,12 +160,19 @@ struct OS_MQueue_s {
 };
 //typedef struct OS_MQueue_s OS_MQueue_t;
 
+struct OS_Pool_s {
+   const char *name;
+   void *freeHead;        //Free blocks linked by their first word
+   int freeCount;
+   int count;
+   uint32 blockSize;
+};
+//typedef struct OS_Pool_s OS_Pool_t;
+
 struct OS_Timer_s {
    const char *name;
-   struct OS_Timer_s *next, *prev;
-   uint32 ticksTimeout;
+   OS_Timeout_t timeout;
    uint32 ticksRestart;
-   int active;
    OS_TimerFuncPtr_t callback;
    OS_MQueue_t *mqueue;
    uint32 info;
@@ -126,8 +185,10 @@ static OS_Heap_t *HeapArray[HEAP_COUNT];
 static int InterruptInside[OS_CPU_COUNT];
 static int ThreadNeedReschedule[OS_CPU_COUNT];
 static OS_Thread_t *ThreadCurrent[OS_CPU_COUNT];  //Currently running thread(s)
-static OS_Thread_t *ThreadHead;   //Linked list of threads sorted by priority
-static OS_Thread_t *TimeoutHead;  //Linked list of threads sorted by timeout
+static OS_Thread_t *ThreadReady[PRIORITY_COUNT]; //FIFO of ready threads per priority
+static uint32 ThreadReadyMap[PRIORITY_COUNT / 32];  //Bit set if ThreadReady[] used
+static uint32 ThreadReadyGroup;   //Bit set if ThreadReadyMap[] not zero
+static OS_Wheel_t ThreadWheel;    //Threads pending with a timeout
 static int ThreadSwapEnabled;
 static uint32 ThreadTime;
 static void *NeedToFree;
@@ -136,9 +197,12 @@ static OS_Semaphore_t *SemaphoreSleep;
 static OS_Semaphore_t *SemaphoreRelease;
 static OS_Semaphore_t *SemaphoreLock;
 static OS_Semaphore_t *SemaphoreTimer;
-static OS_Timer_t *TimerHead;     //Linked list of timers sorted by timeout
+static OS_Wheel_t TimerWheel;     //Running timers
+static OS_Timeout_t *TimerExpired; //Timers for OS_TimerThread to send
 static OS_FuncPtr_t Isr[32];
 
+static int OS_BitHighest(uint32 value);
+
 
 /***************** Heap *******************/
 /******************************************/
@@ -156,6 +220,198 @@ OS_Heap_t *OS_HeapCreate(const char *name, void *memory, uint32 size)
    heap->available->size = (size - sizeof(OS_Heap_t)) / sizeof(HeapNode_t);
    heap->base.next = heap->available;
    heap->base.size = 0;
+   heap->alternate = NULL;
+   memset(heap->slab, 0, sizeof(heap->slab));
+   memset(heap->slabFree, 0, sizeof(heap->slabFree));
+   heap->tlsf = NULL;
+   heap->size = heap->available->size * sizeof(HeapNode_t);
+   heap->used = 0;
+   heap->highWater = 0;
+   return heap;
+}
+
+
+/******************************************/
+//Two-Level Segregated Fit: a free list for each of 16 sizes within each
+//power of two with bitmaps of the non-empty lists.  Malloc and free are
+//constant time, so they run with interrupts disabled instead of pending
+//on the heap semaphore.  Blocks are 12 bytes of header and a payload.
+//Must be called with interrupts disabled
+static void OS_TlsfMapping(uint32 size, int *fl, int *sl)
+{
+   int bit;
+
+   if(size < (1 << TLSF_FL_SHIFT))
+   {
+      *fl = 0;
+      *sl = size >> (TLSF_FL_SHIFT - TLSF_SL_BITS);
+   }
+   else
+   {
+      bit = OS_BitHighest(size);
+      *fl = bit - TLSF_FL_SHIFT + 1;
+      *sl = (size >> (bit - TLSF_SL_BITS)) ^ TLSF_SL_COUNT;
+   }
+}
+
+
+/******************************************/
+//Must be called with interrupts disabled
+static void OS_TlsfInsert(Tlsf_t *tlsf, TlsfBlock_t *block)
+{
+   int fl, sl;
+
+   OS_TlsfMapping(TLSF_SIZE(block), &fl, &sl);
+   block->node.size |= TLSF_FREE;
+   block->prevFree = NULL;
+   block->nextFree = tlsf->free[fl][sl];
+   if(block->nextFree)
+      block->nextFree->prevFree = block;
+   tlsf->free[fl][sl] = block;
+   tlsf->slMap[fl] |= 1 << sl;
+   tlsf->flMap |= 1 << fl;
+}
+
+
+/******************************************/
+//Must be called with interrupts disabled
+static void OS_TlsfRemove(Tlsf_t *tlsf, TlsfBlock_t *block)
+{
+   int fl, sl;
+
+   OS_TlsfMapping(TLSF_SIZE(block), &fl, &sl);
+   block->node.size &= ~TLSF_FREE;
+   if(block->nextFree)
+      block->nextFree->prevFree = block->prevFree;
+   if(block->prevFree)
+      block->prevFree->nextFree = block->nextFree;
+   else
+   {
+      tlsf->free[fl][sl] = block->nextFree;
+      if(block->nextFree == NULL)
+      {
+         tlsf->slMap[fl] &= ~(1 << sl);
+         if(tlsf->slMap[fl] == 0)
+            tlsf->flMap &= ~(1 << fl);
+      }
+   }
+}
+
+
+/******************************************/
+static void *OS_TlsfMalloc(OS_Heap_t *heap, int bytes)
+{
+   Tlsf_t *tlsf = heap->tlsf;
+   TlsfBlock_t *block, *rest;
+   uint32 size, search, map, state;
+   int fl, sl;
+
+   if(bytes < 0 || bytes >= (1 << (TLSF_FL_COUNT + TLSF_FL_SHIFT - 2)))
+      return NULL;
+   size = (TLSF_HEADER + bytes + TLSF_ALIGN - 1) & ~(TLSF_ALIGN - 1);
+   if(size < sizeof(TlsfBlock_t))
+      size = sizeof(TlsfBlock_t);
+   //Round up to the next list so any block in the list found is big enough
+   search = size;
+   if(search >= (1 << TLSF_FL_SHIFT))
+      search += (1 << (OS_BitHighest(search) - TLSF_SL_BITS)) - 1;
+   OS_TlsfMapping(search, &fl, &sl);
+
+   state = OS_CriticalBegin();
+   map = tlsf->slMap[fl] & (0xffffffff << sl);
+   if(map == 0)
+   {
+      map = tlsf->flMap & (0xffffffff << (fl + 1));
+      if(map == 0)
+      {
+         OS_CriticalEnd(state);
+         return NULL;
+      }
+      fl = OS_BitHighest(map & -map);
+      map = tlsf->slMap[fl];
+   }
+   sl = OS_BitHighest(map & -map);
+   block = tlsf->free[fl][sl];
+   OS_TlsfRemove(tlsf, block);
+
+   if(TLSF_SIZE(block) - size >= sizeof(TlsfBlock_t))
+   {
+      //Return the tail to a free list
+      rest = (TlsfBlock_t*)((uint8*)block + size);
+      rest->prevPhys = block;
+      rest->node.next = (HeapNode_t*)heap;
+      rest->node.size = TLSF_SIZE(block) - size;
+      ((TlsfBlock_t*)((uint8*)rest + TLSF_SIZE(rest)))->prevPhys = rest;
+      block->node.size = size;
+      OS_TlsfInsert(tlsf, rest);
+   }
+   heap->used += TLSF_SIZE(block);
+   if(heap->used > heap->highWater)
+      heap->highWater = heap->used;
+   OS_CriticalEnd(state);
+   return (void*)&block->nextFree;
+}
+
+
+/******************************************/
+static void OS_TlsfFree(OS_Heap_t *heap, HeapNode_t *bp)
+{
+   TlsfBlock_t *block, *next, *prev;
+   uint32 state;
+
+   block = (TlsfBlock_t*)((uint8*)bp - sizeof(TlsfBlock_t*));
+   state = OS_CriticalBegin();
+   heap->used -= TLSF_SIZE(block);
+   next = (TlsfBlock_t*)((uint8*)block + TLSF_SIZE(block));
+   if(next->node.size & TLSF_FREE)
+   {
+      OS_TlsfRemove(heap->tlsf, next);
+      block->node.size += TLSF_SIZE(next);
+      next = (TlsfBlock_t*)((uint8*)block + TLSF_SIZE(block));
+      next->prevPhys = block;
+   }
+   prev = block->prevPhys;
+   if(prev && (prev->node.size & TLSF_FREE))
+   {
+      OS_TlsfRemove(heap->tlsf, prev);
+      prev->node.size += TLSF_SIZE(block);
+      next->prevPhys = prev;
+      block = prev;
+   }
+   OS_TlsfInsert(heap->tlsf, block);
+   OS_CriticalEnd(state);
+}
+
+
+/******************************************/
+//Same calls as an OS_HeapCreate() heap but with bounded malloc and free
+OS_Heap_t *OS_HeapCreateTlsf(const char *name, void *memory, uint32 size)
+{
+   OS_Heap_t *heap;
+   TlsfBlock_t *block, *last;
+
+   //Room for the headers, one free block and the end marker
+   if(size < sizeof(OS_Heap_t) + sizeof(Tlsf_t) + TLSF_HEADER + 
+      sizeof(TlsfBlock_t) + TLSF_ALIGN)
+      return NULL;
+   heap = OS_HeapCreate(name, memory, size);
+   heap->tlsf = (Tlsf_t*)(heap + 1);
+   memset(heap->tlsf, 0, sizeof(Tlsf_t));
+   block = (TlsfBlock_t*)(heap->tlsf + 1);
+   size -= sizeof(OS_Heap_t) + sizeof(Tlsf_t) + TLSF_HEADER;
+   if(size >= (1 << (TLSF_FL_COUNT + TLSF_FL_SHIFT - 1)))
+      size = (1 << (TLSF_FL_COUNT + TLSF_FL_SHIFT - 1)) - 1;
+   size &= ~(TLSF_ALIGN - 1);
+   block->prevPhys = NULL;
+   block->node.next = (HeapNode_t*)heap;
+   block->node.size = size;
+   //A used block of size 0 at the end stops merging past the heap
+   last = (TlsfBlock_t*)((uint8*)block + size);
+   last->prevPhys = block;
+   last->node.next = (HeapNode_t*)heap;
+   last->node.size = 0;
+   OS_TlsfInsert(heap->tlsf, block);
+   heap->size = size;
    return heap;
 }
 
@@ -169,15 +425,13 @@ void OS_HeapDestroy(OS_Heap_t *heap)
 
 /******************************************/
 //Modified from K&R
-void *OS_HeapMalloc(OS_Heap_t *heap, int bytes)
+static void *OS_HeapFit(OS_Heap_t *heap, int bytes)
 {
    HeapNode_t *node, *prevp;
    int nunits;
 
-   if(heap == NULL && OS_ThreadSelf())
-      heap = OS_ThreadSelf()->heap;
-   if((uint32)heap < HEAP_COUNT)
-      heap = HeapArray[(int)heap];
+   if(heap->tlsf)
+      return OS_TlsfMalloc(heap, bytes);
    nunits = (bytes + sizeof(HeapNode_t) - 1) / sizeof(HeapNode_t) + 1;
    OS_SemaphorePend(heap->semaphore, OS_WAIT_FOREVER);
    prevp = heap->available;
@@ -195,26 +449,134 @@ void *OS_HeapMalloc(OS_Heap_t *heap, int bytes)
          }
          heap->available = prevp;
          node->next = (HeapNode_t*)heap;
+         heap->used += nunits * sizeof(HeapNode_t);
+         if(heap->used > heap->highWater)
+            heap->highWater = heap->used;
          OS_SemaphorePost(heap->semaphore);
          return (void*)(node + 1);
       }
       if(node == heap->available)   //Wrapped around free list
       {
          OS_SemaphorePost(heap->semaphore);
-         if(heap->alternate)
-            return OS_HeapMalloc(heap->alternate, bytes);
          return NULL;
       }
    }
 }
 
 
+/******************************************/
+//Must be called with interrupts disabled
+static void OS_HeapSlabInsert(OS_Heap_t *heap, int index, HeapSlab_t *slab)
+{
+   slab->prev = NULL;
+   slab->next = heap->slab[index];
+   if(slab->next)
+      slab->next->prev = slab;
+   heap->slab[index] = slab;
+}
+
+
+/******************************************/
+//Must be called with interrupts disabled
+static void OS_HeapSlabRemove(OS_Heap_t *heap, int index, HeapSlab_t *slab)
+{
+   if(slab->prev)
+      slab->prev->next = slab->next;
+   else
+      heap->slab[index] = slab->next;
+   if(slab->next)
+      slab->next->prev = slab->prev;
+}
+
+
+/******************************************/
+//Blocks of up to SLAB_SIZE_MAX bytes come from slabs of one size class,
+//so common objects don't fragment the K&R free list.  TLSF heaps don't
+//use slabs since TLSF bounds fragmentation itself.  A slab is about
+//SLAB_BYTES carved from the heap: a HeapSlab_t then the blocks.  Slab
+//blocks keep the heap header with size = -(slot << 4 | (class + 1)) so
+//OS_HeapFree() can find the slab.
+static void *OS_HeapSlabMalloc(OS_Heap_t *heap, int bytes)
+{
+   HeapSlab_t *slab;
+   HeapNode_t *node=NULL, *first;
+   int index, nunits, count, i;
+   uint32 state;
+
+   for(index = 0; (SLAB_SIZE_MIN << index) < bytes; ++index)
+      ;
+   state = OS_CriticalBegin();
+   slab = heap->slab[index];
+   if(slab)
+   {
+      node = slab->free;
+      slab->free = node->next;
+      --heap->slabFree[index];
+      if(--slab->freeCount == 0)
+         OS_HeapSlabRemove(heap, index, slab);
+   }
+   OS_CriticalEnd(state);
+
+   if(node == NULL)
+   {
+      nunits = SLAB_UNITS(index);
+      count = (SLAB_BYTES / sizeof(HeapNode_t) - SLAB_HEADER) / nunits;
+      if(count < 2)
+         count = 2;
+      slab = (HeapSlab_t*)OS_HeapFit(heap, 
+         (SLAB_HEADER + count * nunits) * sizeof(HeapNode_t));
+      if(slab == NULL)
+         return NULL;
+      first = (HeapNode_t*)slab + SLAB_HEADER;
+      slab->free = NULL;
+      for(i = count - 1; i >= 0; --i)
+      {
+         first[i * nunits].size = -(i << 4 | (index + 1));
+         first[i * nunits].next = slab->free;
+         slab->free = &first[i * nunits];
+      }
+      node = slab->free;
+      slab->free = node->next;
+      slab->count = count;
+      slab->freeCount = count - 1;
+      state = OS_CriticalBegin();
+      heap->slabFree[index] += count - 1;
+      OS_HeapSlabInsert(heap, index, slab);
+      OS_CriticalEnd(state);
+   }
+   node->next = (HeapNode_t*)heap;
+   return (void*)(node + 1);
+}
+
+
+/******************************************/
+void *OS_HeapMalloc(OS_Heap_t *heap, int bytes)
+{
+   void *block;
+
+   if(heap == NULL && OS_ThreadSelf())
+      heap = OS_ThreadSelf()->heap;
+   if((uint32)heap < HEAP_COUNT)
+      heap = HeapArray[(int)heap];
+   if(bytes <= SLAB_SIZE_MAX && heap->tlsf == NULL)
+      block = OS_HeapSlabMalloc(heap, bytes);
+   else
+      block = OS_HeapFit(heap, bytes);
+   if(block == NULL && heap->alternate)
+      return OS_HeapMalloc(heap->alternate, bytes);
+   return block;
+}
+
+
 /******************************************/
 //Modified from K&R
 void OS_HeapFree(void *block)
 {
    OS_Heap_t *heap;
    HeapNode_t *bp, *node;
+   HeapSlab_t *slab;
+   int index;
+   uint32 state;
 
    assert(block);
    bp = (HeapNode_t*)block - 1;   //point to block header
@@ -222,7 +584,39 @@ void OS_HeapFree(void *block)
    assert(heap->magic == HEAP_MAGIC);
    if(heap->magic != HEAP_MAGIC)
       return;
+   if(bp->size < 0)
+   {
+      //Slab block goes back to its slab.  Once every block is free the
+      //slab goes back to the K&R free list, unless no other slab of the
+      //class has a free block, so a burst of small blocks doesn't pin
+      //the heap and a single block doesn't refill a slab every time.
+      index = (-bp->size & 15) - 1;
+      slab = (HeapSlab_t*)(bp - (-bp->size >> 4) * SLAB_UNITS(index) - SLAB_HEADER);
+      state = OS_CriticalBegin();
+      bp->next = slab->free;
+      slab->free = bp;
+      ++heap->slabFree[index];
+      if(slab->freeCount++ == 0)
+         OS_HeapSlabInsert(heap, index, slab);
+      if(slab->freeCount == slab->count && heap->slabFree[index] > slab->count)
+      {
+         OS_HeapSlabRemove(heap, index, slab);
+         heap->slabFree[index] -= slab->count;
+      }
+      else
+         slab = NULL;
+      OS_CriticalEnd(state);
+      if(slab == NULL)
+         return;
+      bp = (HeapNode_t*)slab - 1;    //Free the whole slab below
+   }
+   if(heap->tlsf)
+   {
+      OS_TlsfFree(heap, bp);
+      return;
+   }
    OS_SemaphorePend(heap->semaphore, OS_WAIT_FOREVER);
+   heap->used -= bp->size * sizeof(HeapNode_t);
    for(node = heap->available; !(node < bp && bp < node->next); node = node->next)
    {
       if(node >= node->next && (bp > node || bp < node->next))
@@ -266,12 +660,161 @@ void OS_HeapRegister(void *index, OS_Heap_t *heap)
 }
 
 
+/******************************************/
+void OS_HeapInfo(OS_Heap_t *heap, OS_HeapInfo_t *info)
+{
+   HeapNode_t *node;
+   uint32 largest=0, state;
+   int fl, sl, i;
+
+   if((uint32)heap < HEAP_COUNT)
+      heap = HeapArray[(int)heap];
+   if(heap->tlsf)
+   {
+      //The largest free block is in the highest non-empty list.  Report
+      //the first block there, which is within 1/16 of it, instead of
+      //walking the list with interrupts disabled.
+      state = OS_CriticalBegin();
+      if(heap->tlsf->flMap)
+      {
+         fl = OS_BitHighest(heap->tlsf->flMap);
+         sl = OS_BitHighest(heap->tlsf->slMap[fl]);
+         largest = TLSF_SIZE(heap->tlsf->free[fl][sl]);
+      }
+   }
+   else
+   {
+      OS_SemaphorePend(heap->semaphore, OS_WAIT_FOREVER);
+      node = heap->available;
+      do
+      {
+         if(node->size * sizeof(HeapNode_t) > largest)
+            largest = node->size * sizeof(HeapNode_t);
+         node = node->next;
+      } while(node != heap->available);
+   }
+   info->size = heap->size;
+   info->used = heap->used;
+   for(i = 0; i < SLAB_COUNT; ++i)   //free slab blocks are available
+      info->used -= heap->slabFree[i] * SLAB_UNITS(i) * sizeof(HeapNode_t);
+   info->highWater = heap->highWater;
+   info->available = heap->size - info->used;
+   info->largest = largest;
+   if(heap->tlsf)
+      OS_CriticalEnd(state);
+   else
+      OS_SemaphorePost(heap->semaphore);
+   info->fragmentation = 0;
+   if(info->available >= 100)
+      info->fragmentation = 100 - (int)(largest / (info->available / 100));
+   if(info->fragmentation < 0)
+      info->fragmentation = 0;
+}
+
+
+
+/***************** Timeout wheel **********/
+/******************************************/
+//Must be called with interrupts disabled
+static void OS_TimeoutListAdd(OS_Timeout_t **head, OS_Timeout_t *node)
+{
+   node->next = *head;
+   if(*head)
+      (*head)->pprev = &node->next;
+   node->pprev = head;
+   *head = node;
+}
+
+
+/******************************************/
+//Must be called with interrupts disabled
+static void OS_TimeoutRemove(OS_Timeout_t *node)
+{
+   if(node->pprev == NULL)
+      return;         //not in list
+   *node->pprev = node->next;
+   if(node->next)
+      node->next->pprev = node->pprev;
+   node->next = NULL;
+   node->pprev = NULL;
+}
+
+
+/******************************************/
+//Hierarchical timing wheel: level 0 has a slot per tick for the next 64
+//ticks, level 1 a slot per 64 ticks for the next 4096 ticks, and so on.
+//When the wheel reaches a slot of a higher level its timeouts move down
+//a level, so insert, remove and expiry take constant time.
+//Must be called with interrupts disabled
+static void OS_WheelPlace(OS_Wheel_t *wheel, OS_Timeout_t *node)
+{
+   uint32 ticks = node->ticks, diff;
+   int level;
+
+   diff = ticks - wheel->time;
+   if(diff >= 1 << (WHEEL_BITS * WHEEL_LEVELS))
+   {
+      //Too far away: park in the last slot and place it again from there
+      diff = (1 << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+      ticks = wheel->time + diff;
+   }
+   for(level = 0; level < WHEEL_LEVELS - 1; ++level)
+   {
+      if(diff < (uint32)1 << (WHEEL_BITS * (level + 1)))
+         break;
+   }
+   OS_TimeoutListAdd(&wheel->slot[level]
+      [(ticks >> (WHEEL_BITS * level)) & (WHEEL_SIZE - 1)], node);
+}
+
+
+/******************************************/
+//Must be called with interrupts disabled
+static void OS_WheelInsert(OS_Wheel_t *wheel, OS_Timeout_t *node)
+{
+   int diff = node->ticks - wheel->time;
+
+   if(diff <= 0)
+      node->ticks = wheel->time + 1;  //already due so expire next tick
+   OS_WheelPlace(wheel, node);
+}
+
+
+/******************************************/
+//Advance the wheel one tick and move the timeouts now due to *expired
+//Must be called with interrupts disabled
+static void OS_WheelTick(OS_Wheel_t *wheel, OS_Timeout_t **expired)
+{
+   OS_Timeout_t **slot, *node;
+   int level;
+
+   ++wheel->time;
+   for(level = 1; level < WHEEL_LEVELS; ++level)
+   {
+      if(wheel->time & ((1 << (WHEEL_BITS * level)) - 1))
+         break;
+      slot = &wheel->slot[level][(wheel->time >> (WHEEL_BITS * level)) & (WHEEL_SIZE - 1)];
+      while(*slot)
+      {
+         node = *slot;
+         OS_TimeoutRemove(node);
+         OS_WheelPlace(wheel, node);
+      }
+   }
+   slot = &wheel->slot[0][wheel->time & (WHEEL_SIZE - 1)];
+   while(*slot)
+   {
+      node = *slot;
+      OS_TimeoutRemove(node);
+      OS_TimeoutListAdd(expired, node);
+   }
+}
+
+
 
 /***************** Thread *****************/
 /******************************************/
-//Linked list of threads sorted by priority
-//The listed list is either ThreadHead (ready to run threads not including
-//the currently running thread) or a list of threads waiting on a semaphore.
+//Linked list of threads waiting on a semaphore sorted by priority
 //Must be called with interrupts disabled
 static void OS_ThreadPriorityInsert(OS_Thread_t **head, OS_Thread_t *thread)
 {
@@ -301,8 +844,6 @@ static void OS_ThreadPriorityInsert(OS_Thread_t **head, OS_Thread_t *thread)
       thread->prev = prev;
       prev->next = thread;
    }
-   assert(ThreadHead);
-   thread->state = THREAD_READY;
 }
 
 
@@ -323,61 +864,126 @@ static void OS_ThreadPriorityRemove(OS_Thread_t **head, OS_Thread_t *thread)
 
 
 /******************************************/
-//Linked list of threads sorted by timeout value
-//Must be called with interrupts disabled
-static void OS_ThreadTimeoutInsert(OS_Thread_t *thread)
+//Index of the highest bit set in a non-zero value
+static int OS_BitHighest(uint32 value)
 {
-   OS_Thread_t *node, *prev;
-   int diff;
+   static const uint8 nibble[16] = {0,0,1,1,2,2,2,2,3,3,3,3,3,3,3,3};
+   int bit = 0;
 
-   prev = NULL;
-   for(node = TimeoutHead; node; node = node->nextTimeout)
+   if(value & 0xffff0000)
    {
-      diff = thread->ticksTimeout - node->ticksTimeout;
-      if(diff <= 0)
-         break;
-      prev = node;
+      value >>= 16;
+      bit = 16;
    }
+   if(value & 0xff00)
+   {
+      value >>= 8;
+      bit += 8;
+   }
+   if(value & 0xf0)
+   {
+      value >>= 4;
+      bit += 4;
+   }
+   return bit + nibble[value];
+}
 
-   if(prev == NULL)
+
+/******************************************/
+//Ready to run threads (not including the currently running threads) are
+//in a FIFO list per priority with a bitmap of the non-empty lists, so
+//insert, remove and finding the highest priority take constant time.
+//ThreadReady[priority]->prev is the last thread in the list.
+//Must be called with interrupts disabled
+static void OS_ThreadReadyInsert(OS_Thread_t *thread)
+{
+   OS_Thread_t *head;
+   uint32 priority = thread->priority;
+
+   assert(priority < PRIORITY_COUNT);
+   head = ThreadReady[priority];
+   thread->next = NULL;
+   if(head == NULL)
    {
-      thread->nextTimeout = TimeoutHead;
-      thread->prevTimeout = NULL;
-      if(TimeoutHead)
-         TimeoutHead->prevTimeout = thread;
-      TimeoutHead = thread;
+      thread->prev = thread;
+      ThreadReady[priority] = thread;
+      ThreadReadyMap[priority >> 5] |= 1 << (priority & 31);
+      ThreadReadyGroup |= 1 << (priority >> 5);
    }
    else
    {
-      if(prev->nextTimeout)
-         prev->nextTimeout->prevTimeout = thread;
-      thread->nextTimeout = prev->nextTimeout;
-      thread->prevTimeout = prev;
-      prev->nextTimeout = thread;
+      thread->prev = head->prev;
+      head->prev->next = thread;
+      head->prev = thread;
    }
+   thread->state = THREAD_READY;
 }
 
 
 /******************************************/
 //Must be called with interrupts disabled
-static void OS_ThreadTimeoutRemove(OS_Thread_t *thread)
+static void OS_ThreadReadyRemove(OS_Thread_t *thread)
 {
-   if(thread->prevTimeout == NULL && TimeoutHead != thread)
-      return;         //not in list
-   if(thread->prevTimeout == NULL)
-      TimeoutHead = thread->nextTimeout;
+   OS_Thread_t *head;
+   uint32 priority = thread->priority;
+
+   assert(thread->magic[0] == THREAD_MAGIC);  //check stack overflow
+   head = ThreadReady[priority];
+   if(thread == head)
+   {
+      ThreadReady[priority] = thread->next;
+      if(thread->next)
+         thread->next->prev = thread->prev;
+      else
+      {
+         ThreadReadyMap[priority >> 5] &= ~(1 << (priority & 31));
+         if(ThreadReadyMap[priority >> 5] == 0)
+            ThreadReadyGroup &= ~(1 << (priority >> 5));
+      }
+   }
    else
-      thread->prevTimeout->nextTimeout = thread->nextTimeout;
-   if(thread->nextTimeout)
-      thread->nextTimeout->prevTimeout = thread->prevTimeout;
-   thread->nextTimeout = NULL;
-   thread->prevTimeout = NULL;
+   {
+      thread->prev->next = thread->next;
+      if(thread->next)
+         thread->next->prev = thread->prev;
+      else
+         head->prev = thread->prev;
+   }
+   thread->next = NULL;
+   thread->prev = NULL;
 }
 
 
 /******************************************/
-//Loads highest priority thread from the ThreadHead linked list
-//The currently running thread isn't in the ThreadHead list
+//Highest priority ready thread that may run on cpuIndex or NULL
+//Only threads locked to another CPU make this search past the first list
+//Must be called with interrupts disabled
+static OS_Thread_t *OS_ThreadReadyFirst(int cpuIndex)
+{
+   OS_Thread_t *thread;
+   uint32 group, map;
+   int word, bit;
+
+   for(group = ThreadReadyGroup; group; group &= ~(1 << word))
+   {
+      word = OS_BitHighest(group);
+      for(map = ThreadReadyMap[word]; map; map &= ~(1 << bit))
+      {
+         bit = OS_BitHighest(map);
+         for(thread = ThreadReady[(word << 5) + bit]; thread; thread = thread->next)
+         {
+            if(thread->cpuLock == -1 || thread->cpuLock == cpuIndex)
+               return thread;
+         }
+      }
+   }
+   return NULL;
+}
+
+
+/******************************************/
+//Loads highest priority thread from the ThreadReady linked lists
+//The currently running thread isn't in the ThreadReady lists
 //Must be called with interrupts disabled
 static void OS_ThreadReschedule(int roundRobin)
 {
@@ -391,10 +997,7 @@ static void OS_ThreadReschedule(int roundRobin)
    }
 
    //Determine which thread should run
-   threadNext = ThreadHead;
-   while(threadNext && threadNext->cpuLock != -1 && 
-         threadNext->cpuLock != cpuIndex)
-      threadNext = threadNext->next;
+   threadNext = OS_ThreadReadyFirst(cpuIndex);
    if(threadNext == NULL)
       return;
    threadCurrent = ThreadCurrent[cpuIndex];
@@ -410,16 +1013,16 @@ static void OS_ThreadReschedule(int roundRobin)
       {
          assert(threadCurrent->magic[0] == THREAD_MAGIC); //check stack overflow
          if(threadCurrent->state == THREAD_RUNNING)
-            OS_ThreadPriorityInsert(&ThreadHead, threadCurrent);
+            OS_ThreadReadyInsert(threadCurrent);
          rc = setjmp(threadCurrent->env);  //ANSI C call to save registers
          if(rc)
             return;  //Returned from longjmp()
       }
 
-      //Remove the new running thread from the ThreadHead linked list
+      //Remove the new running thread from the ThreadReady linked list
       threadNext = ThreadCurrent[OS_CpuIndex()]; //removed warning
       assert(threadNext->state == THREAD_READY);
-      OS_ThreadPriorityRemove(&ThreadHead, threadNext); 
+      OS_ThreadReadyRemove(threadNext);
       threadNext->state = THREAD_RUNNING;               
       threadNext->cpuIndex = OS_CpuIndex();
       longjmp(threadNext->env, 1);         //ANSI C call to restore registers
@@ -474,6 +1077,8 @@ OS_Thread_t *OS_ThreadCreate(const char *name,
    NeedToFree = NULL;
    OS_SemaphorePost(SemaphoreRelease);
 
+   if(priority > THREAD_PRIORITY_MAX)
+      priority = THREAD_PRIORITY_MAX;    //ThreadReady[] has one list per priority
    if(stackSize == 0)
       stackSize = STACK_SIZE_DEFAULT;
    if(stackSize < STACK_SIZE_MINIMUM)
@@ -506,8 +1111,7 @@ OS_Thread_t *OS_ThreadCreate(const char *name,
    }
    thread->next = NULL;
    thread->prev = NULL;
-   thread->nextTimeout = NULL;
-   thread->prevTimeout = NULL;
+   thread->timeout.owner = thread;
    thread->magic[0] = THREAD_MAGIC;
 
    OS_ThreadRegsInit(thread->env);
@@ -516,7 +1120,7 @@ OS_Thread_t *OS_ThreadCreate(const char *name,
    env->pc = (uint32)OS_ThreadInit;
 
    state = OS_CriticalBegin();
-   OS_ThreadPriorityInsert(&ThreadHead, thread);
+   OS_ThreadReadyInsert(thread);
    OS_ThreadReschedule(0);
    OS_CriticalEnd(state);
    return thread;
@@ -599,14 +1203,18 @@ uint32 OS_ThreadPriorityGet(OS_Thread_t *thread)
 void OS_ThreadPrioritySet(OS_Thread_t *thread, uint32 priority)
 {
    uint32 state;
+   if(priority > THREAD_PRIORITY_MAX)
+      priority = THREAD_PRIORITY_MAX;
    state = OS_CriticalBegin();
-   thread->priority = priority;
    if(thread->state == THREAD_READY)
    {
-      OS_ThreadPriorityRemove(&ThreadHead, thread);
-      OS_ThreadPriorityInsert(&ThreadHead, thread);
+      OS_ThreadReadyRemove(thread);
+      thread->priority = priority;
+      OS_ThreadReadyInsert(thread);
       OS_ThreadReschedule(0);
    }
+   else
+      thread->priority = priority;
    OS_CriticalEnd(state);
 }
 
@@ -625,24 +1233,28 @@ void OS_ThreadTick(void *Arg)
 {
    OS_Thread_t *thread;
    OS_Semaphore_t *semaphore;
-   int diff;
+   OS_Timeout_t *expired=NULL, *timers;
    (void)Arg;
 
    ++ThreadTime;
-   while(TimeoutHead)
+   OS_WheelTick(&ThreadWheel, &expired);
+   while(expired)
    {
-      thread = TimeoutHead;
-      diff = ThreadTime - thread->ticksTimeout;
-      if(diff < 0)
-         break;
-      OS_ThreadTimeoutRemove(thread);
+      thread = (OS_Thread_t*)expired->owner;
+      OS_TimeoutRemove(expired);
       semaphore = thread->semaphorePending;
       ++semaphore->count;
       thread->semaphorePending = NULL;
       thread->returnCode = -1;
       OS_ThreadPriorityRemove(&semaphore->threadHead, thread);
-      OS_ThreadPriorityInsert(&ThreadHead, thread);
+      OS_ThreadReadyInsert(thread);
    }
+
+   //OS_TimerThread sends the messages for expired timers
+   timers = TimerExpired;
+   OS_WheelTick(&TimerWheel, &TimerExpired);
+   if(timers == NULL && TimerExpired)
+      OS_SemaphorePost(SemaphoreTimer);
    OS_ThreadReschedule(1);
 }
 
@@ -701,13 +1313,13 @@ int OS_SemaphorePend(OS_Semaphore_t *semaphore, int ticks)
       thread = ThreadCurrent[cpuIndex];
       assert(thread);
       thread->semaphorePending = semaphore;
-      thread->ticksTimeout = ticks + OS_ThreadTime();
-      //FYI: The current thread isn't in the ThreadHead linked list
+      thread->timeout.ticks = ticks + OS_ThreadTime();
+      //FYI: The current thread isn't in the ThreadReady linked lists
       OS_ThreadPriorityInsert(&semaphore->threadHead, thread);
       thread->state = THREAD_PEND;
       if(ticks != OS_WAIT_FOREVER)
-         OS_ThreadTimeoutInsert(thread);
-      assert(ThreadHead);
+         OS_WheelInsert(&ThreadWheel, &thread->timeout);
+      assert(ThreadReadyGroup);
       OS_ThreadReschedule(0);
       returnCode = thread->returnCode;
    }
@@ -727,9 +1339,9 @@ void OS_SemaphorePost(OS_Semaphore_t *semaphore)
    if(++semaphore->count <= 0)
    {
       thread = semaphore->threadHead;
-      OS_ThreadTimeoutRemove(thread);
+      OS_TimeoutRemove(&thread->timeout);
       OS_ThreadPriorityRemove(&semaphore->threadHead, thread);
-      OS_ThreadPriorityInsert(&ThreadHead, thread);
+      OS_ThreadReadyInsert(thread);
       thread->semaphorePending = NULL;
       thread->returnCode = 0;
       OS_ThreadReschedule(0);
@@ -883,6 +1495,98 @@ int OS_MQueueGet(OS_MQueue_t *mQueue, void *message, int ticks)
 
 
 
+/***************** Pool *******************/
+/******************************************/
+//Fixed size blocks from one heap allocation.  Free blocks are linked
+//through their first word with interrupts disabled, so alloc and free
+//are constant time and can be called from an ISR.
+OS_Pool_t *OS_PoolCreate(const char *name, uint32 blockSize, uint32 count)
+{
+   OS_Pool_t *pool;
+   uint8 *block;
+   uint32 i;
+
+   if(blockSize > 0x7fffffff)
+      return NULL;
+   blockSize = (blockSize + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
+   if(blockSize == 0)
+      blockSize = sizeof(void*);
+   //OS_HeapMalloc() takes an int so blockSize * count must not wrap it
+   if(count > (0x7fffffff - sizeof(OS_Pool_t)) / blockSize)
+      return NULL;
+   pool = (OS_Pool_t*)OS_HeapMalloc(HEAP_SYSTEM, sizeof(OS_Pool_t) + 
+      blockSize * count);
+   if(pool == NULL)
+      return NULL;
+   pool->name = name;
+   pool->freeHead = NULL;
+   pool->freeCount = count;
+   pool->count = count;
+   pool->blockSize = blockSize;
+   block = (uint8*)(pool + 1);
+   memset(block, 0, blockSize * count);
+   for(i = count; i > 0; --i)
+   {
+      *(void**)(block + (i - 1) * blockSize) = pool->freeHead;
+      pool->freeHead = block + (i - 1) * blockSize;
+   }
+   return pool;
+}
+
+
+/******************************************/
+void OS_PoolDelete(OS_Pool_t *pool)
+{
+   assert(pool->freeCount == pool->count);
+   OS_HeapFree(pool);
+}
+
+
+/******************************************/
+//Returns NULL if the pool is empty; can be called from an ISR
+void *OS_PoolAlloc(OS_Pool_t *pool)
+{
+   void **block;
+   uint32 state;
+
+   assert(pool);
+   state = OS_CriticalBegin();
+   block = (void**)pool->freeHead;
+   if(block)
+   {
+      pool->freeHead = *block;
+      --pool->freeCount;
+   }
+   OS_CriticalEnd(state);
+   return (void*)block;
+}
+
+
+/******************************************/
+//Can be called from an ISR
+void OS_PoolFree(OS_Pool_t *pool, void *block)
+{
+   uint32 state;
+
+   assert(pool && block);
+   assert((uint8*)block >= (uint8*)(pool + 1) && 
+      (uint8*)block < (uint8*)(pool + 1) + pool->blockSize * pool->count);
+   state = OS_CriticalBegin();
+   *(void**)block = pool->freeHead;
+   pool->freeHead = block;
+   ++pool->freeCount;
+   OS_CriticalEnd(state);
+}
+
+
+/******************************************/
+int OS_PoolFreeCount(OS_Pool_t *pool)
+{
+   return pool->freeCount;
+}
+
+
+
 /***************** Jobs *******************/
 /******************************************/
 typedef void (*JobFunc_t)();
@@ -927,45 +1631,34 @@ void OS_Job(void (*funcPtr)(), void *arg0, void *arg1, void *arg2)
 
 /***************** Timer ******************/
 /******************************************/
+//OS_ThreadTick() moves timers that time out to TimerExpired
 static void OS_TimerThread(void *arg)
 {
-   uint32 timeNow;
-   int diff, ticks;
-   uint32 message[8];
+   uint32 message[8], state;
    OS_Timer_t *timer;
    (void)arg;
 
-   timeNow = OS_ThreadTime();
    for(;;)
    {
-      //Determine how long to sleep
-      OS_SemaphorePend(SemaphoreLock, OS_WAIT_FOREVER);
-      if(TimerHead)
-         ticks = TimerHead->ticksTimeout - timeNow;
-      else
-         ticks = OS_WAIT_FOREVER;
-      OS_SemaphorePost(SemaphoreLock);
-      OS_SemaphorePend(SemaphoreTimer, ticks);
+      OS_SemaphorePend(SemaphoreTimer, OS_WAIT_FOREVER);
 
       //Send messages for all timed out timers
-      timeNow = OS_ThreadTime();
       for(;;)
       {
-         timer = NULL;
-         OS_SemaphorePend(SemaphoreLock, OS_WAIT_FOREVER);
-         if(TimerHead)
+         state = OS_CriticalBegin();
+         if(TimerExpired == NULL)
          {
-            diff = timeNow - TimerHead->ticksTimeout;
-            if(diff >= 0)
-               timer = TimerHead;
-         }
-         OS_SemaphorePost(SemaphoreLock);
-         if(timer == NULL)
+            OS_CriticalEnd(state);
             break;
+         }
+         timer = (OS_Timer_t*)TimerExpired->owner;
+         OS_TimeoutRemove(&timer->timeout);
          if(timer->ticksRestart)
-            OS_TimerStart(timer, timer->ticksRestart, timer->ticksRestart);
-         else
-            OS_TimerStop(timer);
+         {
+            timer->timeout.ticks = OS_ThreadTime() + timer->ticksRestart;
+            OS_WheelInsert(&TimerWheel, &timer->timeout);
+         }
+         OS_CriticalEnd(state);
 
          if(timer->callback)
             timer->callback(timer, timer->info);
@@ -1001,10 +1694,10 @@ OS_Timer_t *OS_TimerCreate(const char *name, OS_MQueue_t *mQueue, uint32 info)
    timer->name = name;
    timer->callback = NULL;
    timer->mqueue = mQueue;
-   timer->next = NULL;
-   timer->prev = NULL;
+   timer->timeout.next = NULL;
+   timer->timeout.pprev = NULL;
+   timer->timeout.owner = timer;
    timer->info = info;
-   timer->active = 0;
    return timer;
 }
 
@@ -1025,70 +1718,29 @@ void OS_TimerCallback(OS_Timer_t *timer, OS_TimerFuncPtr_t callback)
 
 
 /******************************************/
-//Must not be called from an ISR
 void OS_TimerStart(OS_Timer_t *timer, uint32 ticks, uint32 ticksRestart)
 {
-   OS_Timer_t *node, *prev;
-   int diff, check=0;
+   uint32 state;
 
    assert(timer);
-   assert(InterruptInside[OS_CpuIndex()] == 0);
-   ticks += OS_ThreadTime();
-   if(timer->active)
-      OS_TimerStop(timer);
-   OS_SemaphorePend(SemaphoreLock, OS_WAIT_FOREVER);
-   if(timer->active)
-   {
-      //Prevent race condition
-      OS_SemaphorePost(SemaphoreLock);
-      return;
-   }
-   timer->ticksTimeout = ticks;
+   state = OS_CriticalBegin();
+   OS_TimeoutRemove(&timer->timeout);
+   timer->timeout.ticks = ticks + OS_ThreadTime();
    timer->ticksRestart = ticksRestart;
-   timer->active = 1;
-   prev = NULL;
-   for(node = TimerHead; node; node = node->next)
-   {
-      diff = ticks - node->ticksTimeout;
-      if(diff <= 0)
-         break;
-      prev = node;
-   }
-   timer->next = node;
-   timer->prev = prev;
-   if(node)
-      node->prev = timer;
-   if(prev == NULL)
-   {
-      TimerHead = timer;
-      check = 1;
-   }
-   else
-      prev->next = timer;
-   OS_SemaphorePost(SemaphoreLock);
-   if(check)
-      OS_SemaphorePost(SemaphoreTimer);
+   OS_WheelInsert(&TimerWheel, &timer->timeout);
+   OS_CriticalEnd(state);
 }
 
 
 /******************************************/
-//Must not be called from an ISR
 void OS_TimerStop(OS_Timer_t *timer)
 {
+   uint32 state;
+
    assert(timer);
-   assert(InterruptInside[OS_CpuIndex()] == 0);
-   OS_SemaphorePend(SemaphoreLock, OS_WAIT_FOREVER);
-   if(timer->active)
-   {
-      timer->active = 0;
-      if(timer->prev == NULL)
-         TimerHead = timer->next;
-      else
-         timer->prev->next = timer->next;
-      if(timer->next)
-         timer->next->prev = timer->prev;
-   }
-   OS_SemaphorePost(SemaphoreLock);
+   state = OS_CriticalBegin();
+   OS_TimeoutRemove(&timer->timeout);
+   OS_CriticalEnd(state);
 }
 
 
@@ -1196,7 +1848,7 @@ static void OS_IdleSimulateIsr(void *arg)
 
    for(;;)
    {
-      MemoryRead(IRQ_MASK + 4);       //calls Sleep(10)
+      MemoryRead(IRQ_MASK + 4);       //waits for the next tick
 #if WIN32
       while(OS_InterruptMaskSet(0) & IRQ_UART_WRITE_AVAILABLE)
          OS_InterruptServiceRoutine(IRQ_UART_WRITE_AVAILABLE, 0);
@@ -1254,10 +1906,32 @@ void OS_Init(uint32 *heapStorage, uint32 bytes)
 }
 
 
+/******************************************/
+#if OS_CPU_COUNT > 1 && !defined(WIN32)
+//Entry point of the other CPUs
+static void OS_CpuStart(void)
+{
+   (void)OS_SpinLock();
+   OS_ThreadReschedule(1);
+}
+#endif
+
+
 /******************************************/
 void OS_Start(void)
 {
+#if OS_CPU_COUNT > 1 && !defined(WIN32)
+   int i;
+#endif
    ThreadSwapEnabled = 1;
+#if OS_CPU_COUNT > 1 && !defined(WIN32)
+   //Start the other CPUs (mlite.exe -cpus n) each with its own stack
+   for(i = 1; i < OS_CPU_COUNT; ++i)
+   {
+      MemoryWrite(CPU_STACK, (uint32)OS_HeapMalloc(NULL, 512) + 512 - 24);
+      MemoryWrite(CPU_START, (uint32)OS_CpuStart);
+   }
+#endif
    (void)OS_SpinLock();
    OS_ThreadReschedule(1);
 }
@@ -1275,7 +1949,7 @@ static uint8 SpinLockArray[OS_CPU_COUNT];
 /******************************************/
 uint32 OS_CpuIndex(void)
 {
-   return 0; //0 to OS_CPU_COUNT-1
+   return MemoryRead(CPU_INDEX); //0 to OS_CPU_COUNT-1
 }
 
 
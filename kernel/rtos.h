@@ -13,7 +13,9 @@
 #define __RTOS_H__
 
 // Symmetric Multi-Processing
+#ifndef OS_CPU_COUNT
 #define OS_CPU_COUNT 1
+#endif
 
 // Typedefs
 typedef unsigned int   uint32;
@@ -144,6 +146,20 @@ void *OS_HeapMalloc(OS_Heap_t *heap, int bytes);
 void OS_HeapFree(void *block);
 void OS_HeapAlternate(OS_Heap_t *heap, OS_Heap_t *alternate);
 void OS_HeapRegister(void *index, OS_Heap_t *heap);
+//Two-Level Segregated Fit heap with bounded malloc and free times and
+//no slabs; returns NULL if size is too small.
+//e.g. OS_HeapRegister(HEAP_SYSTEM, OS_HeapCreateTlsf("Sys", mem, size))
+OS_Heap_t *OS_HeapCreateTlsf(const char *name, void *memory, uint32 size);
+typedef struct {
+   uint32 size;          //Bytes managed including block headers
+   uint32 used;          //Bytes allocated including block headers
+                         //but not free blocks in small-size slabs
+   uint32 highWater;     //Most bytes ever used
+   uint32 available;     //Bytes free
+   uint32 largest;       //Largest free block, within 1/16 for TLSF
+   int fragmentation;    //Percent of free bytes not in the largest block
+} OS_HeapInfo_t;
+void OS_HeapInfo(OS_Heap_t *heap, OS_HeapInfo_t *info);
 
 /***************** Critical Sections *****************/
 #if OS_CPU_COUNT <= 1
@@ -171,7 +187,7 @@ void OS_HeapRegister(void *index, OS_Heap_t *heap);
 #define STACK_SIZE_DEFAULT 1024*2
 #undef THREAD_PRIORITY_IDLE
 #define THREAD_PRIORITY_IDLE 0
-#define THREAD_PRIORITY_MAX 255
+#define THREAD_PRIORITY_MAX 255   //priorities are 0 (low) to 255; higher is clamped
 
 typedef void (*OS_FuncPtr_t)(void *arg);
 typedef struct OS_Thread_s OS_Thread_t;
@@ -223,6 +239,14 @@ void OS_MQueueDelete(OS_MQueue_t *mQueue);
 int OS_MQueueSend(OS_MQueue_t *mQueue, void *message);
 int OS_MQueueGet(OS_MQueue_t *mQueue, void *message, int ticks);
 
+/***************** Pool *****************/
+typedef struct OS_Pool_s OS_Pool_t;
+OS_Pool_t *OS_PoolCreate(const char *name, uint32 blockSize, uint32 count);
+void OS_PoolDelete(OS_Pool_t *pool);
+void *OS_PoolAlloc(OS_Pool_t *pool);
+void OS_PoolFree(OS_Pool_t *pool, void *block);
+int OS_PoolFreeCount(OS_Pool_t *pool);
+
 /***************** Job ********************/
 void OS_Job(void (*funcPtr)(), void *arg0, void *arg1, void *arg2);
 
@@ -232,6 +256,8 @@ typedef void (*OS_TimerFuncPtr_t)(OS_Timer_t *timer, uint32 info);
 OS_Timer_t *OS_TimerCreate(const char *name, OS_MQueue_t *mQueue, uint32 info);
 void OS_TimerDelete(OS_Timer_t *timer);
 void OS_TimerCallback(OS_Timer_t *timer, OS_TimerFuncPtr_t callback);
+//OS_TimerStart() and OS_TimerStop() may be called from an ISR.
+//ticks of 0 fires on the next tick; ticksRestart of 0 fires once.
 void OS_TimerStart(OS_Timer_t *timer, uint32 ticks, uint32 ticksRestart);
 void OS_TimerStop(OS_Timer_t *timer);
 
@@ -88,13 +88,12 @@ static void TestCLib(void)
 }
 
 //******************************************************************
-static void TestHeap(void)
+//Random malloc and free of extra+0..255 bytes; leaves the blocks in ptrs[256]
+static void TestHeapChurn(OS_Heap_t *heap, uint8 **ptrs, int extra)
 {
-   uint8 *ptrs[256], size[256], *ptr;
-   int i, j, k, value;
+   uint8 *ptr;
+   int size[256], i, j, k, value;
 
-   printf("TestHeap\n");
-   memset(ptrs, 0, sizeof(ptrs));
    for(i = 0; i < 1000; ++i)
    {
       j = rand() & 255;
@@ -104,23 +103,113 @@ static void TestHeap(void)
          value = size[j];
          for(k = 0; k < value; ++k)
          {
-            if(ptr[k] != value)
+            if(ptr[k] != (uint8)value)
                printf("Error\n");
          }
          OS_HeapFree(ptrs[j]);
       }
-      size[j] = (uint8)(rand() & 255);
-      ptrs[j] = OS_HeapMalloc(NULL, size[j]);
+      size[j] = extra + (rand() & 255);
+      ptrs[j] = OS_HeapMalloc(heap, size[j]);
       if(ptrs[j] == NULL)
          printf("malloc NULL\n");
       else
          memset(ptrs[j], size[j], size[j]);
    }
+}
+
+//Churn on a TLSF heap; freeing everything must merge it back into one block
+static void TestHeapTlsf(uint8 *memory, uint8 **ptrs, int extra)
+{
+   OS_Heap_t *heap;
+   OS_HeapInfo_t before, during, after;
+   int i;
+
+   heap = OS_HeapCreateTlsf("Tlsf", memory, 192*1024);
+   OS_HeapInfo(heap, &before);
+   memset(ptrs, 0, 256 * sizeof(uint8*));
+   TestHeapChurn(heap, ptrs, extra);
+   OS_HeapInfo(heap, &during);
+   for(i = 0; i < 256; ++i)
+   {
+      if(ptrs[i])
+         OS_HeapFree(ptrs[i]);
+   }
+   OS_HeapInfo(heap, &after);
+   printf("used=%d highWater=%d largest=%d\n", 
+      during.used, after.highWater, after.largest);
+   if(during.used <= before.used || during.highWater < during.used ||
+      during.largest > during.available)
+      printf("Error during\n");
+   if(after.used != before.used || after.highWater < during.used ||
+      after.largest != before.largest)
+      printf("Error after\n");
+   OS_HeapDestroy(heap);
+}
+
+static void TestHeap(void)
+{
+   uint8 *ptrs[256], *memory;
+   int i;
+
+   printf("TestHeap\n");
+   memset(ptrs, 0, sizeof(ptrs));
+   TestHeapChurn(NULL, ptrs, 0);
    for(i = 0; i < 256; ++i)
    {
       if(ptrs[i])
          OS_HeapFree(ptrs[i]);
    }
+
+   //Small blocks, which don't use slabs on a TLSF heap, then large ones
+   memory = (uint8*)OS_HeapMalloc(NULL, 192*1024);
+   if(memory == NULL)
+   {
+      printf("malloc NULL\n");
+      return;
+   }
+   TestHeapTlsf(memory, ptrs, 0);
+   TestHeapTlsf(memory, ptrs, 257);
+   if(OS_HeapCreateTlsf("Tiny", memory, 64) != NULL)
+      printf("Error tiny\n");
+   OS_HeapFree(memory);
+   printf("Done.\n");
+}
+
+//******************************************************************
+static void TestPool(void)
+{
+   OS_Pool_t *pool;
+   uint8 *blocks[20];
+   int i, j, count;
+
+   printf("TestPool\n");
+   pool = OS_PoolCreate("Pool", 24, 16);
+   for(count = 0; count < 20; ++count)
+   {
+      blocks[count] = (uint8*)OS_PoolAlloc(pool);
+      if(blocks[count] == NULL)
+         break;
+      memset(blocks[count], count, 24);
+   }
+   printf("count=%d free=%d\n", count, OS_PoolFreeCount(pool));
+   if(count != 16 || OS_PoolFreeCount(pool) != 0)
+      printf("Error\n");
+   for(i = 0; i < count; ++i)
+   {
+      for(j = 0; j < 24; ++j)
+      {
+         if(blocks[i][j] != i)
+            printf("Error\n");
+      }
+      OS_PoolFree(pool, blocks[i]);
+   }
+   if(OS_PoolFreeCount(pool) != 16)
+      printf("Error\n");
+   OS_PoolDelete(pool);
+
+   //blockSize * count wraps to 0
+   if(OS_PoolCreate("Big", 0x10000, 0x10000) != NULL)
+      printf("Error\n");
    printf("Done.\n");
 }
 
@@ -312,10 +401,26 @@ static void TestTimerThread(void *arg)
    OS_ThreadExit();
 }
 
+//Stops its own periodic timer once it has expired again
+static volatile int TimerStopCount;
+static void TestTimerStopSelf(OS_Timer_t *timer, uint32 info)
+{
+   uint32 ticks;
+   (void)info;
+
+   if(++TimerStopCount < 3)
+      return;
+   ticks = OS_ThreadTime();
+   while(OS_ThreadTime() - ticks < 2)
+      ;
+   OS_TimerStop(timer);
+}
+
 static void TestTimer(void)
 {
    int i;
    TestInfo_t info;
+   OS_Timer_t *timer;
 
    printf("TestTimer\n");
    info.TimerDone = 0;
@@ -337,6 +442,16 @@ static void TestTimer(void)
       OS_TimerDelete(info.MyTimer[i]);
    }
 
+   TimerStopCount = 0;
+   timer = OS_TimerCreate("StopSelf", NULL, 0);
+   OS_TimerCallback(timer, TestTimerStopSelf);
+   OS_TimerStart(timer, 1, 1);
+   while(TimerStopCount < 3)
+      OS_ThreadSleep(1);
+   OS_ThreadSleep(10);
+   printf("StopSelf %s\n", TimerStopCount == 3 ? "OK" : "ERROR");
+   OS_TimerDelete(timer);
+
    printf("Done.\n");
 }
 
@@ -474,6 +589,7 @@ void MainThread(void *Arg)
          printf("7 Timer\n");
          printf("8 Math\n");
          printf("9 Syscall\n");
+         printf("a Pool\n");
 #ifdef __MMU_ENUM_H__
          printf("p MMU Process\n");
 #endif
@@ -498,6 +614,7 @@ void MainThread(void *Arg)
 #ifndef WIN32
       case '9': TestSyscall(); break;
 #endif
+      case 'a': TestPool(); break;
 #ifdef __MMU_ENUM_H__
       case 'p': TestProcess(); break;
 #endif
@@ -164,8 +164,7 @@ static uint8 ipAddressGateway[] = {0xff, 0xff, 0xff, 0xff}; //changed by DHCP
 static uint32 ipAddressDns;                                 //changed by DHCP
 
 static OS_Mutex_t *IPMutex;
-static int FrameFreeCount;
-static IPFrame *FrameFreeHead;
+static OS_Pool_t *FramePool;
 static IPFrame *FrameSendHead;
 static IPFrame *FrameSendTail;
 static IPFrame *FrameResendHead;
@@ -210,15 +209,8 @@ IPFrame *IPFrameGet(int freeCount)
    uint32 state;
 
    state = OS_CriticalBegin();
-   if(FrameFreeCount > freeCount)
-   {
-      frame = FrameFreeHead;
-      if(FrameFreeHead)
-      {
-         FrameFreeHead = FrameFreeHead->next;
-         --FrameFreeCount;
-      }
-   }
+   if(OS_PoolFreeCount(FramePool) > freeCount)
+      frame = (IPFrame*)OS_PoolAlloc(FramePool);
    OS_CriticalEnd(state);
    if(frame)
    {
@@ -231,15 +223,9 @@ IPFrame *IPFrameGet(int freeCount)
 
 static void FrameFree(IPFrame *frame)
 {
-   uint32 state;
-
    assert(frame->state == 1);
    frame->state = 0;
-   state = OS_CriticalBegin();
-   frame->next = FrameFreeHead;
-   FrameFreeHead = frame;
-   ++FrameFreeCount;
-   OS_CriticalEnd(state);
+   OS_PoolFree(FramePool, frame);
 }
 
 
@@ -353,7 +339,7 @@ static void IPFrameReschedule(IPFrame *frame)
       FrameFree(frame);     //can't be ACK'ed
    }
 #ifdef WIN32
-   else if(FrameFreeCount < FRAME_COUNT_SYNC)
+   else if(OS_PoolFreeCount(FramePool) < FRAME_COUNT_SYNC)
    {
       FrameFree(frame);     //can't be ACK'ed
    }
@@ -1112,9 +1098,6 @@ uint8 *MyPacketGet(void)
 //Set FrameSendFunction only if single threaded
 void IPInit(IPFuncPtr frameSendFunction, uint8 macAddress[6], char name[6])
 {
-   int i;
-   IPFrame *frame;
-
    if(macAddress)
       memcpy(ethernetAddressPlasma, macAddress, 6);
    if(name)
@@ -1122,15 +1105,7 @@ void IPInit(IPFuncPtr frameSendFunction, uint8 macAddress[6], char name[6])
    FrameSendFunc = frameSendFunction;
    IPMutex = OS_MutexCreate("IPSem");
    IPMQueue = OS_MQueueCreate("IPMQ", FRAME_COUNT*2, 32);
-   for(i = 0; i < FRAME_COUNT; ++i)
-   {
-      frame = (IPFrame*)malloc(sizeof(IPFrame));
-      memset(frame, 0, sizeof(IPFrame));
-      frame->next = FrameFreeHead;
-      frame->prev = NULL;
-      FrameFreeHead = frame;
-   }
-   FrameFreeCount = FRAME_COUNT;
+   FramePool = OS_PoolCreate("IPFrame", sizeof(IPFrame), FRAME_COUNT);
 #ifndef WIN32
    UartPacketConfig(MyPacketGet, PACKET_SIZE, IPMQueue);
    if(frameSendFunction == NULL)
@@ -1529,10 +1504,10 @@ void IPTick(void)
    {
       if(IPVerbose && (Seconds % 60) == 0)
       {
-         if(FrameFreeCount >= FRAME_COUNT-1)
+         if(OS_PoolFreeCount(FramePool) >= FRAME_COUNT-1)
             printf("T");
          else
-            printf("T(%d)", FrameFreeCount);
+            printf("T(%d)", OS_PoolFreeCount(FramePool));
       }
       ++Seconds;
       if(--DhcpRetrySeconds <= 0)
@@ -1568,7 +1543,7 @@ void IPTick(void)
             socket2->timeout = 10;
             if(IPVerbose && socket2->state != IP_CLOSED &&
                             socket2->state != IP_FIN_SERVER)
-               printf("t(%d,%d)", socket2->state, FrameFreeCount);
+               printf("t(%d,%d)", socket2->state, OS_PoolFreeCount(FramePool));
             if(socket2->state == IP_TCP)
                IPClose(socket2);
             else if(socket2->state == IP_FIN_CLIENT)
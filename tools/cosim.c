@@ -0,0 +1,368 @@
+/*--------------------------------------------------------------------
+ * TITLE: Plasma Co-simulation Checker
+ * DATE CREATED: 10/16/26
+ * FILENAME: cosim.c
+ * PROJECT: Plasma CPU core
+ * COPYRIGHT: Software placed into the public domain by the author.
+ *    Software 'as is' without warranty.  Author liable for nothing.
+ * DESCRIPTION:
+ *    Runs code.txt in mlite and compares its register and memory writes
+ *    with the trace written by the VHDL CPU (trace_file in tbench.vhd).
+ *    Reports the first write that differs with the PC of the opcode.
+ *
+ *    Both traces are read as streams so they may be any length.  mlite
+ *    writes its binary trace (tracebin.h) into a pipe.  The RTL trace
+ *    has one line per write:
+ *       cycle R pc register value
+ *       cycle W pc address byte_we data
+ *    Register writes that don't change the register are dropped on both
+ *    sides since mlite only traces changed registers.  Register writes
+ *    and memory writes are compared as two streams because the pipeline
+ *    may retire them a cycle apart.  Interrupts must be off in the
+ *    testbench since mlite takes them at different times.
+ *--------------------------------------------------------------------*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+#include "tracebin.h"
+
+#define QUEUE_SIZE 4096      //writes one side may run ahead of the other
+
+typedef struct {
+   unsigned int pc;
+   unsigned int address;     //register number for register writes
+   unsigned int value;
+   unsigned int byteWe;      //byte lanes written, bit 3 is bits 31:24
+   long long index;          //opcode count in mlite or cycle in the RTL
+} Write;
+
+typedef struct {
+   Write entry[QUEUE_SIZE];
+   int head, count;
+} Queue;
+
+typedef struct {
+   FILE *in;
+   unsigned int lastPc, lastAddress;
+   unsigned int opcodeValue[TRACE_OPCODE_CACHE];
+   unsigned int reg[32];
+   long long opcodes;
+   Queue regs, stores;
+} Mlite;
+
+static Mlite mlite;
+static unsigned int rtlReg[32];
+
+static void queue_put(Queue *q, const Write *w)
+{
+   if(q->count == QUEUE_SIZE)
+   {
+      printf("mlite is more than %d writes ahead of the RTL trace\n", QUEUE_SIZE);
+      exit(2);
+   }
+   q->entry[(q->head + q->count++) % QUEUE_SIZE] = *w;
+}
+
+static unsigned int get_varint(FILE *in)
+{
+   unsigned int value=0;
+   int shift=0, ch;
+   do
+   {
+      ch = getc(in);
+      if(ch == EOF)
+         return 0;
+      value |= (ch & 0x7f) << shift;
+      shift += 7;
+   } while(ch & 0x80);
+   return value;
+}
+
+static unsigned int get_word(FILE *in)
+{
+   unsigned int value;
+   value = getc(in);
+   value |= getc(in) << 8;
+   value |= getc(in) << 16;
+   value |= (unsigned int)getc(in) << 24;
+   return value;
+}
+
+//Byte lanes and bus data of a big endian store
+static void store_lanes(Write *w, unsigned int opcode, unsigned int value)
+{
+   unsigned int offset = w->address & 3;
+
+   switch(opcode >> 26)
+   {
+      case 0x28:  //SB
+         w->byteWe = 8 >> offset;
+         w->value = (value & 0xff) << (24 - offset * 8);
+         break;
+      case 0x29:  //SH
+         w->byteWe = 0xc >> offset;
+         w->value = (value & 0xffff) << (16 - offset * 8);
+         break;
+      case 0x2a:  //SWL
+         w->byteWe = 0xf >> offset;
+         w->value = value >> (offset * 8);
+         break;
+      case 0x2e:  //SWR
+         w->byteWe = (0xf << (3 - offset)) & 0xf;
+         w->value = value << ((3 - offset) * 8);
+         break;
+      default:    //SW, SC
+         w->byteWe = 0xf;
+         w->value = value;
+   }
+   w->address &= ~3;
+}
+
+//Decode the next mlite opcode into the queues; returns 0 at the end
+static int mlite_next(Mlite *m)
+{
+   Write w;
+   unsigned int pc, opcode, value, delta;
+   int tag, count, i, reg;
+
+   tag = getc(m->in);
+   if(tag == EOF || tag == TRACE_END)
+      return 0;
+   pc = m->lastPc + 4;
+   if(tag & TRACE_PC)
+   {
+      delta = get_varint(m->in);
+      pc += TRACE_UNZIGZAG(delta) << 2;
+   }
+   m->lastPc = pc;
+   if(tag & TRACE_OPCODE)
+      m->opcodeValue[TRACE_OPCODE_INDEX(pc)] = get_word(m->in);
+   opcode = m->opcodeValue[TRACE_OPCODE_INDEX(pc)];
+   w.pc = pc;
+   w.index = m->opcodes++;
+   if(tag & TRACE_REG)
+   {
+      count = getc(m->in);
+      for(i = 0; i < count; ++i)
+      {
+         reg = getc(m->in);
+         value = get_varint(m->in);
+         if(reg <= 0 || reg >= 32 || m->reg[reg] == value)
+            continue;      //HI and LO aren't in the RTL trace
+         m->reg[reg] = value;
+         w.address = reg;
+         w.value = value;
+         w.byteWe = 0;
+         queue_put(&m->regs, &w);
+      }
+   }
+   if(tag & TRACE_MEM)
+   {
+      delta = get_varint(m->in);
+      m->lastAddress += TRACE_UNZIGZAG(delta);
+   }
+   if(tag & TRACE_STORE)
+   {
+      value = get_varint(m->in);
+      w.address = m->lastAddress;
+      store_lanes(&w, opcode, value);
+      queue_put(&m->stores, &w);
+   }
+   return 1;
+}
+
+//Next mlite write of the same kind or NULL at the end of the trace
+static Write *mlite_get(Mlite *m, Queue *q)
+{
+   Write *w;
+   while(q->count == 0)
+   {
+      if(mlite_next(m) == 0)
+         return NULL;
+   }
+   w = &q->entry[q->head];
+   q->head = (q->head + 1) % QUEUE_SIZE;
+   --q->count;
+   return w;
+}
+
+static unsigned int lane_mask(unsigned int byteWe)
+{
+   return (byteWe & 8 ? 0xff000000 : 0) | (byteWe & 4 ? 0xff0000 : 0) |
+          (byteWe & 2 ? 0xff00 : 0) | (byteWe & 1 ? 0xff : 0);
+}
+
+//Write the code.txt words to a binary image for mlite
+static int code_convert(const char *code, const char *image)
+{
+   FILE *in, *out;
+   char line[80];
+   unsigned int word;
+   unsigned char bytes[4];
+   int count=0;
+
+   in = fopen(code, "r");
+   out = fopen(image, "wb");
+   if(in == NULL || out == NULL)
+      return -1;
+   while(fgets(line, sizeof(line), in))
+   {
+      word = strtoul(line, NULL, 16);
+      bytes[0] = (unsigned char)(word >> 24);
+      bytes[1] = (unsigned char)(word >> 16);
+      bytes[2] = (unsigned char)(word >> 8);
+      bytes[3] = (unsigned char)word;
+      fwrite(bytes, 1, 4, out);
+      ++count;
+   }
+   fclose(in);
+   fclose(out);
+   return count;
+}
+
+//Start "mlite image -batch -trace pipe" and return its pid
+static int mlite_start(const char *path, const char *image, int *fd)
+{
+   int pipes[2], null;
+   char trace[32];
+   pid_t pid;
+
+   if(pipe(pipes))
+      return -1;
+   pid = fork();
+   if(pid == 0)
+   {
+      close(pipes[0]);
+      null = open("/dev/null", O_WRONLY);
+      dup2(null, 1);              //UART output
+      sprintf(trace, "/dev/fd/%d", pipes[1]);
+      execl(path, path, image, "-batch", "-trace", trace, (char*)NULL);
+      _exit(127);
+   }
+   close(pipes[1]);
+   *fd = pipes[0];
+   return pid;
+}
+
+int main(int argc, char *argv[])
+{
+   FILE *rtl;
+   char line[256], kind, image[64];
+   unsigned char header[TRACE_HEADER_SIZE];
+   const char *path="./mlite.exe", *code=NULL, *trace=NULL;
+   unsigned int pc, address, value, byteWe, mask;
+   long long cycle, lineNumber=0, regWrites=0, stores=0;
+   int index, fd, pid, ended=0, result=0;
+   Write *w;
+
+   for(index = 1; index < argc; ++index)
+   {
+      if(strcmp(argv[index], "-mlite") == 0 && index + 1 < argc)
+         path = argv[++index];
+      else if(code == NULL)
+         code = argv[index];
+      else
+         trace = argv[index];
+   }
+   if(trace == NULL)
+   {
+      printf("Usage: cosim [-mlite path] code.txt rtl_trace.txt\n");
+      return 2;
+   }
+   rtl = fopen(trace, "r");
+   if(rtl == NULL)
+   {
+      printf("Can't open %s\n", trace);
+      return 2;
+   }
+   strcpy(image, "/tmp/cosim.XXXXXX");
+   fd = mkstemp(image);
+   if(fd < 0 || (close(fd), code_convert(code, image)) <= 0)
+   {
+      printf("Can't convert %s\n", code);
+      return 2;
+   }
+   pid = mlite_start(path, image, &fd);
+   mlite.in = fdopen(fd, "rb");
+   if(pid < 0 || mlite.in == NULL ||
+      fread(header, 1, TRACE_HEADER_SIZE, mlite.in) != TRACE_HEADER_SIZE ||
+      memcmp(header, TRACE_MAGIC, 4) || header[4] != TRACE_VERSION)
+   {
+      printf("Can't run %s %s -trace\n", path, image);
+      unlink(image);
+      return 2;
+   }
+   mlite.lastPc = (header[8] | (header[9] << 8) | (header[10] << 16) |
+      ((unsigned int)header[11] << 24)) - 4;
+
+   while(result == 0 && fgets(line, sizeof(line), rtl))
+   {
+      ++lineNumber;
+      if(sscanf(line, "%lld %c %x %x %x %x",
+         &cycle, &kind, &pc, &address, &value, &byteWe) < 5)
+         continue;
+      if(kind == 'R')
+      {
+         if(address == 0 || address >= 32 || rtlReg[address] == value)
+            continue;
+         rtlReg[address] = value;
+         ++regWrites;
+         w = mlite_get(&mlite, &mlite.regs);
+         if(w == NULL)
+         {
+            ended = 1;
+            break;
+         }
+         if(w->address == address && w->value == value)
+            continue;
+         printf("Register write %lld differs at mlite opcode %lld PC 0x%8.8x\n",
+            regWrites, w->index, w->pc);
+         printf("   mlite: r[%d]=0x%8.8x\n", w->address, w->value);
+         printf("   RTL:   r[%d]=0x%8.8x at cycle %lld PC 0x%8.8x (%s:%lld)\n",
+            address, value, cycle, pc, trace, lineNumber);
+         result = 1;
+      }
+      else if(kind == 'W')
+      {
+         //value is the byte enables and byteWe the data
+         mask = lane_mask(value);
+         ++stores;
+         w = mlite_get(&mlite, &mlite.stores);
+         if(w == NULL)
+         {
+            ended = 1;
+            break;
+         }
+         if(w->address == address && w->byteWe == value &&
+            ((w->value ^ byteWe) & mask) == 0)
+            continue;
+         printf("Memory write %lld differs at mlite opcode %lld PC 0x%8.8x\n",
+            stores, w->index, w->pc);
+         printf("   mlite: [0x%8.8x] lanes %x <= 0x%8.8x\n",
+            w->address, w->byteWe, w->value & lane_mask(w->byteWe));
+         printf("   RTL:   [0x%8.8x] lanes %x <= 0x%8.8x at cycle %lld PC 0x%8.8x (%s:%lld)\n",
+            address, value, byteWe & mask, cycle, pc, trace, lineNumber);
+         result = 1;
+      }
+   }
+   if(result == 0)
+   {
+      printf("%lld register writes and %lld memory writes match over %lld mlite opcodes\n",
+         regWrites, stores, mlite.opcodes);
+      if(ended)
+      {
+         printf("mlite stopped before the end of %s\n", trace);
+         result = 1;
+      }
+   }
+   kill(pid, SIGTERM);
+   fclose(mlite.in);
+   waitpid(pid, NULL, 0);
+   fclose(rtl);
+   unlink(image);
+   return result;
+}
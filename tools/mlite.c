@@ -11,16 +11,49 @@
 --   This file served as the starting point for the VHDL code.
 --   Assumes running on a little endian PC.
 --------------------------------------------------------------------*/
+#ifndef WIN32
+#define _GNU_SOURCE           //posix_openpt() for -serial pty
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
 #include <assert.h>
+#include "tracebin.h"
+#include "plasmasim.h"
 
 //#define ENABLE_CACHE
-#define SIMPLE_CACHE
+//#define SIMPLE_CACHE
+#define ENABLE_PREDECODE
+#if defined(__x86_64__) && !defined(WIN32) && !defined(ENABLE_CACHE)
+#define ENABLE_JIT
+#endif
+#ifndef WIN32
+#define ENABLE_THREADS        //host threads for -trace and -threads
+#include <pthread.h>
+#ifndef PLASMA_LIBRARY        //library users add devices with plasma_mmio()
+#define ENABLE_GDB            //-gdb remote serial protocol stub
+#define ENABLE_ETHERNET       //-eth model of eth_dma.vhd
+#define ENABLE_SERIAL         //-serial pty or socket UART backend
+#endif
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#ifdef __linux__
+#include <net/if.h>
+#include <linux/if_tun.h>
+#endif
+#endif
 
-#define MEM_SIZE (1024*1024*2)
+#undef ntohs     //may be defined by <netinet/in.h>
+#undef htons
+#undef ntohl
+#undef htonl
 #define ntohs(A) ( ((A)>>8) | (((A)&0xff)<<8) )
 #define htons(A) ntohs(A)
 #define ntohl(A) ( ((A)>>24) | (((A)&0xff0000)>>8) | (((A)&0xff00)<<8) | ((A)<<24) )
@@ -32,12 +65,14 @@
 #include <termios.h>
 #include <unistd.h>
 
-void Sleep(unsigned int value)
+#ifndef PLASMA_LIBRARY
+static void Sleep(unsigned int value)
 { 
    usleep(value * 1000);
 }
+#endif
 
-int kbhit(void)
+static int kbhit(void)
 {
    struct termios oldt, newt;
    struct timeval tv;
@@ -59,7 +94,7 @@ int kbhit(void)
    return 0;
 }
 
-int getch(void)
+static int getch(void)
 {
    struct termios oldt, newt;
    int ch;
@@ -82,18 +117,37 @@ extern void __stdcall Sleep(unsigned long value);
 #define UART_READ         0x20000000
 #define IRQ_MASK          0x20000010
 #define IRQ_STATUS        0x20000020
-#define CONFIG_REG        0x20000070
+#define GPIO0_OUT         0x20000030
+#define GPIO0_CLEAR       0x20000040
+#define COUNTER_REG       0x20000060
+#define ETHERNET_REG      0x20000070
 #define MMU_PROCESS_ID    0x20000080
 #define MMU_FAULT_ADDR    0x20000090
 #define MMU_TLB           0x200000a0
+#define MISC_BASE         0x20000000
+#define FLASH_BASE        0x30000000
+#define SIM_EXIT          0x200000f0  //simulator only: exit with value
+#define SIM_SNAPSHOT      0x200000f4  //simulator only: save -save file
+#define CPU_INDEX         0x200000d0  //simulator only: read this CPU's index
+#define CPU_STACK         0x200000d4  //simulator only: $sp for CPU_START
+#define CPU_START         0x200000d8  //simulator only: start next CPU at value
+#define CPU_MAX           8
+#define ETHERNET_ENABLE   0x01000000  //GPIO0 bit that starts receive DMA
+#define ETHERNET_RECEIVE  0x13ff0000
+#define ETHERNET_TRANSMIT 0x13fe0000
 
 #define IRQ_UART_READ_AVAILABLE  0x001
 #define IRQ_UART_WRITE_AVAILABLE 0x002
 #define IRQ_COUNTER18_NOT        0x004
 #define IRQ_COUNTER18            0x008
+#define IRQ_ETHERNET_RECEIVE     0x010
+#define IRQ_ETHERNET_TRANSMIT    0x020
 #define IRQ_MMU                  0x200
 
 #define MMU_ENTRIES 4
+#define REGION_SHIFT 20                        //1MB regions
+#define REGION_COUNT (1 << (32 - REGION_SHIFT))
+#define REGION_MASK  ((1 << REGION_SHIFT) - 1)
 #define MMU_MASK (1024*4-1)
 
 typedef struct
@@ -102,7 +156,25 @@ typedef struct
    unsigned int physicalAddress;
 } MmuEntry;
 
+typedef struct Timing_s Timing;
+typedef struct CacheModel_s CacheModel;
+typedef struct Profile_s Profile;
+typedef struct Trace_s Trace;
+typedef struct Machine_s Machine;
+typedef struct Uart_s Uart;
+typedef struct Eth_s Eth;
+typedef struct Flash_s Flash;
+typedef struct MmioHook_s MmioHook;
+typedef struct MemBank_s MemBank;
+typedef struct Decode_s Decode;
+typedef struct JitBlock_s JitBlock;
+
 typedef struct {
+   unsigned int address;
+   char *name;
+} Symbol;
+
+typedef struct PlasmaSim_s {
    int r[32];
    int pc, pc_next, epc;
    unsigned int hi;
@@ -114,12 +186,74 @@ typedef struct {
    int faultAddr;
    int irqStatus;
    int skip;
-   unsigned char *mem;
+   unsigned char *region[REGION_COUNT]; //host memory for each region or NULL
+   int swizzle;         //xor for byte addresses (3 if big endian)
    int wakeup;
    int big_endian;
+   int batch;           //running without the debugger
+   int breakExit;       //BREAK n stops the simulator with exit code n
+   int exitCode;        //from SIM_EXIT or BREAK; -1 while running
+   FILE *uartIn;        //batch mode UART input or NULL
+   FILE *uartOut;       //batch mode UART output
+   Timing *timing;      //clock estimate or NULL
+   CacheModel *icache;  //cache statistics or NULL
+   CacheModel *dcache;
+   Profile *profile;    //instruction counts or NULL
+   Trace *trace;        //binary trace writer or NULL
+   const char *snapshotFile;  //-save file or NULL
+   int cpuIndex;        //0 to cpuCount-1
+   int halted;          //waiting for CPU_START
+   int cpuStack;        //written to CPU_STACK
+   unsigned int counter;      //COUNTER_REG; CPU 0 keeps the clock
+   long long counterCycles;   //-timing cycles already in counter
+   int fence;           //order stores between host threads
+   unsigned int llAddress;    //LL reservation: address | 1, or 0
+   unsigned int llValue;      //word loaded by LL
+   int instrument;      //per opcode hooks are active: no predecode or JIT
+   Machine *m;          //memory and peripherals shared with the other CPUs
+   Symbol *symbol;      //sorted by address
+   int symbolCount;
+   int symbolLast;      //index of the last lookup
    MmuEntry mmuEntry[MMU_ENTRIES];
 } State;
 
+//Everything the CPUs of one simulator share: memory, peripherals and
+//the decoded and translated opcodes.  Nothing is file-scope so a 
+//process can run several simulators (see plasmasim.h).
+struct Machine_s {
+   State *cpuList[CPU_MAX];   //cpuList[0] is the State in main()
+   int cpuCount;
+   int cpuQuantum;            //opcodes per turn
+   int cpuRandom;             //-random turns
+   unsigned int cpuSeed;
+   volatile int cpuStop;      //-threads: a CPU stopped
+   long long cpuMax;          //-threads: opcodes per CPU
+   int threads;               //-threads: no predecode or JIT tables
+   unsigned int HWMemory[8];
+   Uart *uart;
+#ifdef ENABLE_ETHERNET
+   Eth *eth;                  //NULL without -eth
+#endif
+   Flash *flash;
+   MmioHook *mmioHook;        //plasma_mmio() ranges
+   int mmioHookCount;
+   MemBank *bank;             //RAM
+   int bankCount;
+#ifdef ENABLE_PREDECODE
+   Decode *decodeTable;
+#endif
+#ifdef ENABLE_JIT
+   JitBlock *jitBlock;
+   unsigned char *jitCode, *jitPtr;
+   int jitFlushes;
+   unsigned char jitPage[1 << 20];
+#endif
+#ifdef ENABLE_GDB
+   unsigned char gdbPage[1 << 20];
+   int gdbWatchCount;
+#endif
+};
+
 static char *opcode_string[]={
    "SPECIAL","REGIMM","J","JAL","BEQ","BNE","BLEZ","BGTZ",
    "ADDI","ADDIU","SLTI","SLTIU","ANDI","ORI","XORI","LUI",
@@ -149,448 +283,1365 @@ static char *regimm_string[]={
    "?","?","?","?","?","?","?","?"
 };
 
-static unsigned int HWMemory[8];
-
+static int snapshot_save(State *s, const char *filename);
+static int mem_bank_add(Machine *m, unsigned int address, unsigned int size);
+static void region_init(State *s);
 
-static int mem_read(State *s, int size, unsigned int address)
+//Release the next halted CPU at pc with $gp from the caller
+static void cpu_start(State *s, unsigned int pc)
 {
-   unsigned int value=0, ptr;
+   State *c;
+   int i;
 
-   s->irqStatus |= IRQ_UART_WRITE_AVAILABLE;
-   switch(address)
+   for(i = 1; i < s->m->cpuCount; ++i)
    {
-      case UART_READ: 
-         if(kbhit())
-            HWMemory[0] = getch();
-         s->irqStatus &= ~IRQ_UART_READ_AVAILABLE; //clear bit
-         return HWMemory[0];
-      case IRQ_MASK: 
-         return HWMemory[1];
-      case IRQ_MASK + 4:
-         Sleep(10);
-         return 0;
-      case IRQ_STATUS: 
-         if(kbhit())
-            s->irqStatus |= IRQ_UART_READ_AVAILABLE;
-         return s->irqStatus;
-      case MMU_PROCESS_ID:
-         return s->processId;
-      case MMU_FAULT_ADDR:
-         return s->faultAddr;
+      c = s->m->cpuList[i];
+      if(c->halted == 0)
+         continue;
+      c->r[28] = s->r[28];
+      c->r[29] = s->cpuStack;
+      c->pc = pc;
+      c->pc_next = pc + 4;
+      c->skip = 0;
+      c->halted = 0;
+      return;
    }
+}
 
-   ptr = (unsigned int)s->mem + (address % MEM_SIZE);
+/************* UART *************/
+//uart->vhd has no FIFO and takes 10 bit times to send a byte.  -baud 
+//paces the UART in virtual time and -fifo gives it receive and transmit
+//FIFOs.  Without -baud it is infinitely fast.  Output is flushed at most
+//every 4096 clock cycles.  -serial connects it to a pseudo-terminal 
+//or a UNIX socket peer instead of the console or the -input and -uart
+//files.
+#define UART_FIFO_MAX 256
+#define UART_BUFFER   4096
+#define UART_POLL     1024          //cycles between reads from the host
 
-   if(0x10000000 <= address && address < 0x10000000 + 1024*1024)
-      ptr += 1024*1024;
+struct Uart_s {
+   int fd;                          //-serial backend or -1
+   unsigned int cycles;             //clock cycles per byte or 0
+   int fifo;                        //FIFO depth
+   unsigned char rx[UART_FIFO_MAX];
+   int rxHead, rxCount;
+   unsigned int rxNext;             //counter when the next byte may arrive
+   unsigned int txDone;             //counter when the last byte is sent
+   unsigned int pollNext;           //counter for the next host read
+   unsigned char out[UART_BUFFER];  //bytes not yet written to fd
+   int outCount;
+   int pending;                     //output not flushed
+};
 
-   switch(size) 
+#ifdef ENABLE_SERIAL
+//"pty", "unix:path" or "fd:n"
+static int uart_open(Uart *uart, const char *spec)
+{
+   struct sockaddr_un addr;
+   struct termios term;
+
+   if(strcmp(spec, "pty") == 0)
    {
-      case 4: 
-         if(address & 3)
-            printf("Unaligned access PC=0x%x address=0x%x\n", (int)s->pc, (int)address);
-         assert((address & 3) == 0);
-         value = *(int*)ptr;
-         if(s->big_endian) 
-            value = ntohl(value);
-         break;
-      case 2:
-         assert((address & 1) == 0);
-         value = *(unsigned short*)ptr;
-         if(s->big_endian) 
-            value = ntohs((unsigned short)value);
-         break;
-      case 1:
-         value = *(unsigned char*)ptr;
-         break;
-      default: 
-         printf("ERROR");
+      uart->fd = posix_openpt(O_RDWR | O_NOCTTY);
+      if(uart->fd < 0 || grantpt(uart->fd) || unlockpt(uart->fd))
+         return -1;
+      tcgetattr(uart->fd, &term);
+      cfmakeraw(&term);
+      tcsetattr(uart->fd, TCSANOW, &term);
+      printf("UART on %s\n", ptsname(uart->fd));
    }
-   return(value);
+   else if(strncmp(spec, "unix:", 5) == 0)
+   {
+      uart->fd = socket(AF_UNIX, SOCK_STREAM, 0);
+      memset(&addr, 0, sizeof(addr));
+      addr.sun_family = AF_UNIX;
+      strncpy(addr.sun_path, spec + 5, sizeof(addr.sun_path) - 1);
+      if(uart->fd < 0 || connect(uart->fd, (struct sockaddr*)&addr, sizeof(addr)) < 0)
+         return -1;
+   }
+   else if(strncmp(spec, "fd:", 3) == 0)
+      uart->fd = atoi(spec + 3);
+   else
+      return -1;
+   fcntl(uart->fd, F_SETFL, fcntl(uart->fd, F_GETFL) | O_NONBLOCK);
+   return 0;
 }
+#endif
 
-static void mem_write(State *s, int size, int unsigned address, unsigned int value)
+//Next byte from the host or -1.  Batch mode reads the UART from a file
+//instead of polling the terminal.
+static int uart_host_getc(State *s)
 {
-   unsigned int ptr;
+#ifdef ENABLE_SERIAL
+   unsigned char ch;
+   if(s->m->uart->fd >= 0)
+      return read(s->m->uart->fd, &ch, 1) == 1 ? ch : -1;
+#endif
+   if(s->batch)
+      return s->uartIn ? getc(s->uartIn) : -1;
+   return kbhit() ? getch() : -1;
+}
 
-   switch(address)
-   {
-      case UART_WRITE: 
-         putch(value); 
-         fflush(stdout);
-         return;
-      case IRQ_MASK:   
-         HWMemory[1] = value; 
-         return;
-      case IRQ_STATUS: 
-         s->irqStatus = value; 
-         return;
-      case CONFIG_REG:
-         return;
-      case MMU_PROCESS_ID:
-         //printf("processId=%d\n", value);
-         s->processId = value;
-         return;
-   }
+//Move bytes from the host into the receive FIFO
+static void uart_receive(State *s)
+{
+   Uart *uart = s->m->uart;
+   unsigned int now = s->m->cpuList[0]->counter;
+   int ch;
 
-   if(MMU_TLB <= address && address <= MMU_TLB+MMU_ENTRIES * 8)
-   {
-      //printf("TLB 0x%x 0x%x\n", address - MMU_TLB, value);
-      ptr = (unsigned int)s->mmuEntry + address - MMU_TLB;
-      *(int*)ptr = value;
-      s->irqStatus &= ~IRQ_MMU;
+   if((int)(now - uart->pollNext) < 0)
       return;
+   uart->pollNext = now + (uart->cycles && uart->cycles < UART_POLL ? uart->cycles : UART_POLL);
+   while(uart->rxCount < uart->fifo && (int)(now - uart->rxNext) >= 0 && 
+      (ch = uart_host_getc(s)) >= 0)
+   {
+      uart->rx[(uart->rxHead + uart->rxCount++) % UART_FIFO_MAX] = (unsigned char)ch;
+      if(uart->cycles)
+         uart->rxNext = now + uart->cycles;
    }
+}
 
-   ptr = (unsigned int)s->mem + (address % MEM_SIZE);
+static int uart_read(State *s)
+{
+   Uart *uart = s->m->uart;
 
-   if(0x10000000 <= address && address < 0x10000000 + 1024*1024)
-      ptr += 1024*1024;
+   uart_receive(s);
+   if(uart->rxCount)
+   {
+      s->m->HWMemory[0] = uart->rx[uart->rxHead];
+      uart->rxHead = (uart->rxHead + 1) % UART_FIFO_MAX;
+      --uart->rxCount;
+   }
+   return s->m->HWMemory[0];
+}
 
-   switch(size) 
+static void uart_flush(State *s)
+{
+   Uart *uart = s->m->uart;
+#ifdef ENABLE_SERIAL
+   int i, bytes;
+   for(i = 0; i < uart->outCount; i += bytes)
    {
-      case 4: 
-         assert((address & 3) == 0);
-         if(s->big_endian) 
-            value = htonl(value);
-         *(int*)ptr = value;
-         break;
-      case 2:
-         assert((address & 1) == 0);
-         if(s->big_endian) 
-            value = htons((unsigned short)value);
-         *(short*)ptr = (unsigned short)value; 
-         break;
-      case 1:
-         *(char*)ptr = (unsigned char)value; 
-         break;
-      default: 
-         printf("ERROR");
+      bytes = write(uart->fd, uart->out + i, uart->outCount - i);
+      if(bytes <= 0)
+         break;        //peer is gone or not reading
    }
+   uart->outCount = 0;
+#endif
+   fflush(s->batch ? s->uartOut : stdout);
+   uart->pending = 0;
 }
 
-#ifdef ENABLE_CACHE
-/************* Optional MMU and cache implementation *************/
-/* TAG = VirtualAddress | ProcessId | WriteableBit */
-unsigned int mmu_lookup(State *s, unsigned int processId, 
-                         unsigned int address, int write)
+static void uart_write(State *s, unsigned int value)
 {
-   int i;
-   unsigned int compare, tag;
+   Uart *uart = s->m->uart;
+   unsigned int now = s->m->cpuList[0]->counter;
 
-   if(processId == 0 || s->userMode == 0)
-      return address;
-   //if(address < 0x30000000)
-   //   return address;
-   compare = (address & ~MMU_MASK) | (processId << 1);
-   for(i = 0; i < MMU_ENTRIES; ++i)
+   if(uart->cycles)
+      uart->txDone = ((int)(uart->txDone - now) > 0 ? uart->txDone : now) + uart->cycles;
+   uart->pending = 1;
+   if(uart->fd >= 0)
    {
-      tag = s->mmuEntry[i].virtualAddress;
-      if((tag & ~1) == compare && (write == 0 || (tag & 1)))
-         return s->mmuEntry[i].physicalAddress | (address & MMU_MASK);
+      uart->out[uart->outCount++] = (unsigned char)value;
+      if(uart->outCount == UART_BUFFER)
+         uart_flush(s);
    }
-   //printf("\nMMUTlbMiss 0x%x PC=0x%x w=%d pid=%d user=%d\n", 
-   //   address, s->pc, write, processId, s->userMode);
-   //printf("m");
-   s->exceptionId = 1;
-   s->faultAddr = address & ~MMU_MASK;
-   s->irqStatus |= IRQ_MMU;
-   return address;
+   else if(s->batch)
+      putc(value, s->uartOut);
+   else
+      putch(value);
 }
 
+static unsigned int uart_status(State *s)
+{
+   Uart *uart = s->m->uart;
+   unsigned int status=0;
+   if(uart->rxCount)
+      status |= IRQ_UART_READ_AVAILABLE;
+   if((int)(uart->txDone - s->m->cpuList[0]->counter) <= (int)uart->cycles * (uart->fifo - 1))
+      status |= IRQ_UART_WRITE_AVAILABLE;
+   return status;
+}
 
-#define CACHE_SET_ASSOC_LN2   0
-#define CACHE_SET_ASSOC       (1 << CACHE_SET_ASSOC_LN2)
-#define CACHE_SIZE_LN2        (13 - CACHE_SET_ASSOC_LN2)  //8 KB
-#define CACHE_SIZE            (1 << CACHE_SIZE_LN2)
-#define CACHE_LINE_SIZE_LN2   2                           //4 bytes
-#define CACHE_LINE_SIZE       (1 << CACHE_LINE_SIZE_LN2)
+#ifdef ENABLE_ETHERNET
+/************* Ethernet *************/
+//Model of eth_dma.vhd with a 10Mbps PHY.  A received frame is written 
+//to the 64KB ring at ETHERNET_RECEIVE as it appears on the wire 
+//(preamble, 0x5d, data, CRC with the nibbles of each byte swapped) and
+//then IRQ_ETHERNET_RECEIVE is set until ETHERNET_REG is read.  Writing 
+//the word count to ETHERNET_REG sends the frame at ETHERNET_TRANSMIT 
+//and IRQ_ETHERNET_TRANSMIT is clear for the frame's time on the wire.
+//-eth picks the host side:
+//   tap:name        Linux TAP device
+//   unix:path       SOCK_SEQPACKET peer listening at path
+//   fd:n            inherited socket such as one end of socketpair()
+//   pcap:in[,out]   replay in by its timestamps; write sent frames to out
+#define ETH_FRAME       1536
+#define ETH_BYTE_CYCLES 20          //25MHz clock, 10Mbps
+#define ETH_RING        0x10000
 
-static int cacheData[CACHE_SET_ASSOC][CACHE_SIZE/sizeof(int)];
-static int cacheAddr[CACHE_SET_ASSOC][CACHE_SIZE/CACHE_LINE_SIZE];
-static int cacheSetNext;
-static int cacheMiss, cacheWriteBack, cacheCount;
+struct Eth_s {
+   int fd;                          //tap, unix and fd backends or -1
+   FILE *pcapIn, *pcapOut;
+   int pcapSwap;                    //pcap file in the other byte order
+   int pcapNano;                    //nanosecond timestamps
+   long long pcapStart;             //first timestamp in us
+   unsigned int pcapBase;           //counter when the first frame was read
+   unsigned char frame[ETH_FRAME];  //next frame from pcapIn
+   int frameLength;                 //0 when frame is empty
+   unsigned int frameTime;          //counter when frame arrives
+   unsigned int recIndex;           //next byte in the receive ring
+   unsigned int recFree;            //counter when the wire is free
+   unsigned int sendDone;           //counter when transmit finishes
+   int recDone;
+   unsigned int crcTable[256];
+};
 
-static void cache_init(void)
+static unsigned int eth_crc(Eth *eth, const unsigned char *data, int length)
 {
-   int set, i;
-   for(set = 0; set < CACHE_SET_ASSOC; ++set)
+   unsigned int crc=0xffffffff;
+   int i;
+   for(i = 0; i < length; ++i)
+      crc = eth->crcTable[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+   return ~crc;
+}
+
+static unsigned int pcap_word(Eth *eth, const unsigned char *ptr)
+{
+   unsigned int value;
+   memcpy(&value, ptr, 4);
+   return eth->pcapSwap ? ntohl(value) : value;
+}
+
+//Read the next pcap record into eth->frame
+static void pcap_next(State *s)
+{
+   Eth *eth = s->m->eth;
+   unsigned char header[16];
+   long long time;
+   unsigned int length;
+
+   for(;;)
    {
-      for(i = 0; i < CACHE_SIZE/CACHE_LINE_SIZE; ++i)
-         cacheAddr[set][i] = 0xffff0000;
+      if(fread(header, 1, 16, eth->pcapIn) != 16)
+      {
+         fclose(eth->pcapIn);
+         eth->pcapIn = NULL;
+         return;
+      }
+      length = pcap_word(eth, header + 8);
+      time = pcap_word(eth, header) * 1000000LL + pcap_word(eth, header + 4) / (eth->pcapNano ? 1000 : 1);
+      if(length > ETH_FRAME)
+      {
+         fseek(eth->pcapIn, length, SEEK_CUR);
+         continue;
+      }
+      if(fread(eth->frame, 1, length, eth->pcapIn) != length)
+         continue;
+      if(eth->pcapStart < 0)
+      {
+         eth->pcapStart = time;
+         eth->pcapBase = s->counter;
+      }
+      eth->frameLength = length;
+      eth->frameTime = eth->pcapBase + (unsigned int)((time - eth->pcapStart) * 25);
+      return;
    }
 }
 
-/* Write-back cache memory tagged by virtual address and processId */
-/* TAG = virtualAddress | processId | dirtyBit */
-static int cache_load(State *s, unsigned int address, int write)
+static void pcap_write(State *s, const unsigned char *frame, int length)
 {
-   int set, i, pid, miss, offsetAddr, offsetData, offsetMem;
-   unsigned int addrTagMatch, addrPrevMatch=0;
-   unsigned int addrPrev;
-   unsigned int addressPhysical, tag;
+   Eth *eth = s->m->eth;
+   unsigned int header[4];
+   header[0] = s->counter / 25000000;
+   header[1] = s->counter % 25000000 / 25;
+   header[2] = header[3] = length;
+   fwrite(header, 4, 4, eth->pcapOut);
+   fwrite(frame, 1, length, eth->pcapOut);
+   fflush(eth->pcapOut);
+}
 
-   ++cacheCount;
-   addrTagMatch = address & ~(CACHE_SIZE-1);
-   offsetAddr = (address & (CACHE_SIZE-1)) >> CACHE_LINE_SIZE_LN2;
+static int eth_open(State *s, const char *spec)
+{
+   unsigned int header[6], i, j, crc;
+   char name[256], *out;
+#ifdef __linux__
+   struct ifreq ifr;
+#endif
+   struct sockaddr_un addr;
+   Eth *eth;
 
-   /* Find match */
-   miss = 1;
-   for(set = 0; set < CACHE_SET_ASSOC; ++set)
+   eth = s->m->eth = (Eth*)calloc(1, sizeof(Eth));
+   eth->fd = -1;
+   eth->pcapStart = -1;
+   for(i = 0; i < 256; ++i)
    {
-      addrPrevMatch = cacheAddr[set][offsetAddr] & ~(CACHE_SIZE-1);
-      if(addrPrevMatch == addrTagMatch)
+      for(crc = i, j = 0; j < 8; ++j)
+         crc = crc & 1 ? (crc >> 1) ^ 0xedb88320 : crc >> 1;
+      eth->crcTable[i] = crc;
+   }
+   //The buffers are at the top of a 64MB DDR; map them if -ram didn't
+   if(s->region[ETHERNET_RECEIVE >> REGION_SHIFT] == NULL &&
+      mem_bank_add(s->m, ETHERNET_RECEIVE & ~REGION_MASK, 1 << REGION_SHIFT) == 0)
+      region_init(s);
+   strncpy(name, strchr(spec, ':') ? strchr(spec, ':') + 1 : "", sizeof(name) - 1);
+   name[sizeof(name) - 1] = 0;
+   if(strncmp(spec, "tap:", 4) == 0)
+   {
+#ifdef __linux__
+      eth->fd = open("/dev/net/tun", O_RDWR);
+      memset(&ifr, 0, sizeof(ifr));
+      ifr.ifr_flags = IFF_TAP | IFF_NO_PI;
+      strncpy(ifr.ifr_name, name, IFNAMSIZ - 1);
+      if(eth->fd >= 0 && ioctl(eth->fd, TUNSETIFF, &ifr) < 0)
       {
-         miss = 0;
-         break;
+         close(eth->fd);
+         eth->fd = -1;
       }
+#endif
    }
-
-   /* Cache miss? */
-   if(miss)
+   else if(strncmp(spec, "unix:", 5) == 0)
    {
-      ++cacheMiss;
-      set = cacheSetNext;
-      cacheSetNext = (cacheSetNext + 1) & (CACHE_SET_ASSOC-1);
+      eth->fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+      memset(&addr, 0, sizeof(addr));
+      addr.sun_family = AF_UNIX;
+      strncpy(addr.sun_path, name, sizeof(addr.sun_path) - 1);
+      if(eth->fd >= 0 && connect(eth->fd, (struct sockaddr*)&addr, sizeof(addr)) < 0)
+      {
+         close(eth->fd);
+         eth->fd = -1;
+      }
    }
-   //else if(write || (address >> 28) != 0x1)
-   //{
-   //   tag = cacheAddr[set][offsetAddr];
-   //   pid = (tag & (CACHE_SIZE-1)) >> 1; 
-   //   if(pid != s->processId)
-   //      miss = 1;
-   //}
-
-   if(miss)
+   else if(strncmp(spec, "fd:", 3) == 0)
+      eth->fd = atoi(name);
+   else if(strncmp(spec, "pcap:", 5) == 0)
    {
-      offsetData = address & (CACHE_SIZE-1) & ~(CACHE_LINE_SIZE-1);
-
-      /* Cache line dirty? */
-      if(cacheAddr[set][offsetAddr] & 1)
+      out = strchr(name, ',');
+      if(out)
       {
-         /* Write back cache line */
-         tag = cacheAddr[set][offsetAddr];
-         addrPrev = tag & ~(CACHE_SIZE-1);
-         addrPrev |= address & (CACHE_SIZE-1);
-         pid = (tag & (CACHE_SIZE-1)) >> 1; 
-         addressPhysical = mmu_lookup(s, pid, addrPrev, 1);   //virtual->physical
-         if(s->exceptionId)
-            return 0;
-         offsetMem = addressPhysical & ~(CACHE_LINE_SIZE-1);
-         for(i = 0; i < CACHE_LINE_SIZE; i += 4)
-            mem_write(s, 4, offsetMem + i, cacheData[set][(offsetData + i) >> 2]);
-         ++cacheWriteBack;
+         *out++ = 0;
+         eth->pcapOut = fopen(out, "wb");
+         if(eth->pcapOut == NULL)
+            return -1;
+         header[0] = 0xa1b2c3d4;
+         header[1] = 2 | (4 << 16);       //version 2.4
+         header[2] = header[3] = 0;
+         header[4] = 65535;
+         header[5] = 1;                   //LINKTYPE_ETHERNET
+         fwrite(header, 4, 6, eth->pcapOut);
       }
-
-      /* Read cache line */
-      addressPhysical = mmu_lookup(s, s->processId, address, write); //virtual->physical
-      if(s->exceptionId)
-         return 0;
-      offsetMem = addressPhysical & ~(CACHE_LINE_SIZE-1);
-      cacheAddr[set][offsetAddr] = addrTagMatch;
-      for(i = 0; i < CACHE_LINE_SIZE; i += 4)
-         cacheData[set][(offsetData + i) >> 2] = mem_read(s, 4, offsetMem + i);
+      if(name[0] == 0)
+         return 0;                        //"pcap:,out" only records
+      eth->pcapIn = fopen(name, "rb");
+      if(eth->pcapIn == NULL || fread(header, 4, 6, eth->pcapIn) != 6)
+         return -1;
+      eth->pcapSwap = header[0] == 0xd4c3b2a1 || header[0] == 0x4d3cb2a1;
+      eth->pcapNano = header[0] == 0x4d3cb2a1 || header[0] == 0xa1b23c4d;
+      if(eth->pcapSwap == 0 && eth->pcapNano == 0 && header[0] != 0xa1b2c3d4)
+         return -1;
+      pcap_next(s);
+      return 0;
    }
-   cacheAddr[set][offsetAddr] |= write;
-   return set;
+   if(eth->fd < 0)
+      return -1;
+   fcntl(eth->fd, F_SETFL, fcntl(eth->fd, F_GETFL) | O_NONBLOCK);
+   return 0;
 }
 
-static int cache_read(State *s, int size, unsigned int address)
+static void eth_store(State *s, unsigned char byte)
 {
-   int set, offset;
-   int value;
+   unsigned int address = ETHERNET_RECEIVE + s->m->eth->recIndex++ % ETH_RING;
+   unsigned char *ptr = s->region[address >> REGION_SHIFT] + (address & REGION_MASK);
+   *(unsigned char*)((size_t)ptr ^ s->swizzle) = byte;
+}
 
-   if((address & 0xfe000000) != 0x10000000)
-      return mem_read(s, size, address);
+#define NIBBLE_SWAP(B) (unsigned char)(((B) << 4) | ((B) >> 4))
 
-   set = cache_load(s, address, 0);
-   if(s->exceptionId)
-      return 0;
-   offset = (address & (CACHE_SIZE-1)) >> 2;
-   value = cacheData[set][offset];
-   if(s->big_endian)
-      address ^= 3;
-   switch(size) 
-   {
-      case 2: 
-         value = (value >> ((address & 2) << 3)) & 0xffff;
-         break;
-      case 1:
-         value = (value >> ((address & 3) << 3)) & 0xff;
-         break;
-   }
-   return value;
+//DMA a frame into the receive ring
+static void eth_receive(State *s, unsigned char *frame, int length)
+{
+   Eth *eth = s->m->eth;
+   unsigned int crc;
+   int i;
+
+   while(length < 60)
+      frame[length++] = 0;                //pad like the sender's MAC
+   crc = eth_crc(eth, frame, length);
+   for(i = 0; i < 7; ++i)
+      eth_store(s, 0x55);
+   eth_store(s, 0x5d);
+   for(i = 0; i < length; ++i)
+      eth_store(s, NIBBLE_SWAP(frame[i]));
+   for(i = 0; i < 4; ++i)
+      eth_store(s, NIBBLE_SWAP((crc >> (i * 8)) & 0xff));
+   while(eth->recIndex & 3)
+      eth_store(s, 0);                    //rest of the last DMA word
+   eth->recDone = 1;
+   eth->recFree = s->counter + (length + 12 + 12) * ETH_BYTE_CYCLES;
 }
 
-static void cache_write(State *s, int size, int unsigned address, unsigned int value)
+//Send the frame at ETHERNET_TRANSMIT; words includes the preamble and CRC
+static void eth_send(State *s, unsigned int words)
 {
-   int set, offset;
-   unsigned int mask;
+   Eth *eth = s->m->eth;
+   unsigned char frame[ETH_FRAME], *ptr;
+   unsigned int address;
+   int length, i;
 
-   if((address >> 28) != 0x1) // && (s->processId == 0 || s->userMode == 0))
-   {
-      mem_write(s, size, address, value);
+   eth->sendDone = s->counter + words * 4 * ETH_BYTE_CYCLES;
+   length = (int)words * 4 - 16;
+   if(length <= 0 || length > ETH_FRAME)
       return;
+   for(i = 0; i < length; ++i)
+   {
+      address = ETHERNET_TRANSMIT + 8 + i;
+      ptr = s->region[address >> REGION_SHIFT] + (address & REGION_MASK);
+      frame[i] = NIBBLE_SWAP(*(unsigned char*)((size_t)ptr ^ s->swizzle));
    }
+   if(eth->fd >= 0 && write(eth->fd, frame, length) < 0)
+      return;
+   if(eth->pcapOut)
+      pcap_write(s, frame, length);
+}
 
-   set = cache_load(s, address, 1);
-   if(s->exceptionId)
+//Deliver the next host frame once the wire is free
+static void eth_poll(State *s)
+{
+   Eth *eth = s->m->eth;
+   unsigned char frame[ETH_FRAME];
+   int length;
+
+   if((s->m->HWMemory[2] & ETHERNET_ENABLE) == 0 || (int)(s->counter - eth->recFree) < 0)
       return;
-   offset = (address & (CACHE_SIZE-1)) >> 2;
-   if(s->big_endian)
-      address ^= 3;
-   switch(size) 
+   if(eth->fd >= 0)
    {
-      case 2:
-         value &= 0xffff;
-         value |= value << 16;
-         mask = 0xffff << ((address & 2) << 3);
-         break;
-      case 1:
-         value &= 0xff;
-         value |= (value << 8) | (value << 16) | (value << 24);
-         mask = 0xff << ((address & 3) << 3);
-         break;
-      case 4:
-      default:
-         mask = 0xffffffff;
-         break;
+      length = read(eth->fd, frame, ETH_FRAME - 64);
+      if(length > 0)
+         eth_receive(s, frame, length);
+   }
+   else if(eth->pcapIn && eth->frameLength && (int)(s->counter - eth->frameTime) >= 0)
+   {
+      memcpy(frame, eth->frame, eth->frameLength);
+      eth_receive(s, frame, eth->frameLength);
+      eth->frameLength = 0;
+      pcap_next(s);
    }
-   cacheData[set][offset] = (value & mask) | (cacheData[set][offset] & ~mask);
 }
 
-#define mem_read cache_read
-#define mem_write cache_write
+static unsigned int eth_status(State *s)
+{
+   Eth *eth = s->m->eth;
+   unsigned int status = eth->recDone ? IRQ_ETHERNET_RECEIVE : 0;
+   if((int)(s->counter - eth->sendDone) >= 0)
+      status |= IRQ_ETHERNET_TRANSMIT;
+   return status;
+}
+#endif  //ENABLE_ETHERNET
+
+/************* Virtual clock *************/
+//COUNTER_REG counts CPU 0 clock cycles: one per opcode, or the modeled 
+//cycles with -timing.  Bit 18 drives IRQ_COUNTER18 and IRQ_COUNTER18_NOT
+//like the hardware, so interrupts don't depend on the host's speed.
+#define COUNTER_EDGE (1 << 18)
+
+//Skip to the next IRQ_COUNTER18 toggle
+static void counter_skip(State *s)
+{
+   s->counter = (s->counter | (COUNTER_EDGE - 1)) + 1;
+}
+
+static unsigned int irq_status(State *s)
+{
+   unsigned int status = s->irqStatus & ~(IRQ_COUNTER18 | IRQ_COUNTER18_NOT | 
+      IRQ_UART_READ_AVAILABLE | IRQ_UART_WRITE_AVAILABLE);
+   status |= uart_status(s);
+#ifdef ENABLE_ETHERNET
+   if(s->m->eth)
+      status |= eth_status(s->m->cpuList[0]);
+#endif
+   if(s->m->cpuList[0]->counter & COUNTER_EDGE)
+      return status | IRQ_COUNTER18;
+   return status | IRQ_COUNTER18_NOT;
+}
+
+#ifdef ENABLE_PREDECODE
+//Direct mapped table of decoded opcodes indexed by PC
+#define DECODE_SIZE_LN2 16
+#define DECODE_SIZE (1 << DECODE_SIZE_LN2)
+#define DECODE_INDEX(A) (((A) >> 2) & (DECODE_SIZE-1))
+
+typedef void (*DecodeFunc)(State *s, const Decode *d);
+struct Decode_s {
+   unsigned int tag;       //pc | 1 when valid; 0 when empty
+   DecodeFunc func;        //opcode handler
+   int imm;                //immediate extended as the opcode requires
+   unsigned char rs, rt, rd, re;
+};
 
+//A store over a decoded opcode forces it to be decoded again.  The
+//table isn't used or touched while the CPUs run in host threads.
+#define decode_invalidate(M,A) \
+   if((M)->threads == 0 && (M)->decodeTable[DECODE_INDEX(A)].tag == (((A) & ~3) | 1)) \
+      (M)->decodeTable[DECODE_INDEX(A)].tag = 0
 #else
-static void cache_init(void) {}
+#define decode_invalidate(M,A)
 #endif
 
+#ifdef ENABLE_JIT
+//m->jitPage marks pages holding translated code; stores to them check
+//for stale blocks
+static void jit_invalidate(Machine *m, unsigned int address);
+#define jit_check(M,A) if((M)->threads == 0 && (M)->jitPage[(A) >> 12]) jit_invalidate(M,A)
+#else
+#define jit_check(M,A)
+#endif
 
-#ifdef SIMPLE_CACHE
+#ifdef ENABLE_GDB
+//m->gdbPage marks pages holding gdb breakpoints and watchpoints; only
+//opcodes and accesses on marked pages search the list
+#define GDB_BREAK 1
+#define GDB_WATCH 2
+static int gdb_break_check(State *s);
+static void gdb_watch_check(State *s, unsigned int address, int size, int write);
+#define gdb_page(M,A) (M)->gdbPage[(A) >> 12]
+#define gdb_watching(M) (M)->gdbWatchCount
+#define gdb_break(S) (((S)->m->gdbPage[(unsigned int)(S)->pc >> 12] & GDB_BREAK) && \
+   gdb_break_check(S))
+#define gdb_watch(S,A,N,W) if((S)->m->gdbPage[(A) >> 12] & GDB_WATCH) gdb_watch_check(S,A,N,W)
+#else
+#define gdb_page(M,A) 0
+#define gdb_watching(M) 0
+#define gdb_break(S) 0
+#define gdb_watch(S,A,N,W)
+#endif
 
-//Write through direct mapped 4KB cache
-#define CACHE_MISS 0x1ff
-static unsigned int cacheData[1024];
-static unsigned int cacheAddr[1024]; //9-bit addresses
-static int cacheTry, cacheMiss, cacheInit;
+/************* Flash *************/
+//-flash file maps an image of the 16-bit flash that kernel/flash.c
+//drives.  Only the low 16 bits of each word are connected, so the
+//halfword at byte offset b of the file (high byte first) is read at
+//FLASH_BASE + b * 2.  The file is mapped copy on write: the program
+//can erase and program it but the file never changes.  Writes are
+//Intel commands: 0xff read array, 0x70 read status, 0x40 program the
+//next write, 0x20 then 0xd0 erase a 128KB block.  Operations finish
+//at once so status reads are always ready.
+#define FLASH_BLOCK  (128*1024)
 
-static int cache_read(State *s, int size, unsigned int address)
+struct Flash_s {
+   unsigned char *mem;     //mapped file or NULL
+   unsigned int size;      //bytes
+   int command;            //0xff in read array mode
+};
+
+#define flash_hit(F,A) ((F)->mem && (A) - FLASH_BASE < (F)->size * 2)
+
+static unsigned int flash_read(Flash *flash, unsigned int address)
 {
-   int offset;
-   unsigned int value, value2, address2=address;
+   unsigned int offset = ((address - FLASH_BASE) >> 1) & ~1;
 
-   if(cacheInit == 0)
+   if(flash->command != 0xff)
+      return 0x80;                        //status: ready, no errors
+   return (flash->mem[offset] << 8) | flash->mem[offset + 1];
+}
+
+static void flash_write(Flash *flash, unsigned int address, unsigned int value)
+{
+   unsigned int offset = ((address - FLASH_BASE) >> 1) & ~1, length;
+
+   switch(flash->command)
    {
-      cacheInit = 1;
-      for(offset = 0; offset < 1024; ++offset)
-         cacheAddr[offset] = CACHE_MISS;
+      case 0x10: case 0x40:               //program only clears bits
+         flash->mem[offset] &= (unsigned char)(value >> 8);
+         flash->mem[offset + 1] &= (unsigned char)value;
+         flash->command = 0x70;
+         return;
+      case 0x20:                          //erase if confirmed
+         offset &= ~(FLASH_BLOCK - 1);
+         length = flash->size - offset < FLASH_BLOCK ? flash->size - offset : FLASH_BLOCK;
+         if((value & 0xff) == 0xd0)
+            memset(flash->mem + offset, 0xff, length);
+         flash->command = 0x70;
+         return;
    }
+   flash->command = value & 0xff;
+}
 
-   offset = address >> 20;
-   if(offset != 0x100 && offset != 0x101)
-      return mem_read(s, size, address);
+/************* MMIO callbacks *************/
+//plasma_mmio() ranges are checked before the built-in peripherals
+#define MMIO_HOOKS 16
 
-   ++cacheTry;
-   offset = (address >> 2) & 0x3ff;
-   if(cacheAddr[offset] != (address >> 12) || cacheAddr[offset] == CACHE_MISS)
+struct MmioHook_s {
+   unsigned int address, length;
+   PlasmaMmioRead read;
+   PlasmaMmioWrite write;
+   void *arg;
+};
+
+static MmioHook *mmio_hook(Machine *m, unsigned int address)
+{
+   int i;
+   for(i = 0; i < m->mmioHookCount; ++i)
    {
-      ++cacheMiss;
-      cacheAddr[offset] = address >> 12;
-      cacheData[offset] = mem_read(s, 4, address & ~3);
+      if(address - m->mmioHook[i].address < m->mmioHook[i].length)
+         return &m->mmioHook[i];
    }
-   value = cacheData[offset];
-   if(s->big_endian)
-      address ^= 3;
+   return NULL;
+}
+
+//Registers in the MISC_BASE region
+static int mmio_read(State *s, int size, unsigned int address)
+{
+   Machine *m = s->m;
+   MmioHook *hook;
+
+   if(m->mmioHookCount && (hook = mmio_hook(m, address)) != NULL)
+      return hook->read ? hook->read(hook->arg, address, size) : 0;
+   if(flash_hit(m->flash, address))
+      return flash_read(m->flash, address);
+   switch(address)
+   {
+      case UART_READ: 
+         return uart_read(s);
+      case IRQ_MASK: 
+         return m->HWMemory[1];
+      case IRQ_MASK + 4:
+         counter_skip(m->cpuList[0]);  //idle until the next tick
+         return 0;
+      case IRQ_STATUS: 
+         uart_receive(s);
+         return irq_status(s);
+      case COUNTER_REG:
+         return m->cpuList[0]->counter;
+      case GPIO0_OUT:
+         return m->HWMemory[2];
+#ifdef ENABLE_ETHERNET
+      case ETHERNET_REG:
+         if(m->eth)
+            m->eth->recDone = 0;
+         return 0;
+#endif
+      case MMU_PROCESS_ID:
+         return s->processId;
+      case MMU_FAULT_ADDR:
+         return s->faultAddr;
+      case CPU_INDEX:
+         return s->cpuIndex;
+   }
+   return 0;
+}
+
+static void mmio_write(State *s, int size, unsigned int address, unsigned int value)
+{
+   Machine *m = s->m;
+   unsigned char *ptr;
+   MmioHook *hook;
+
+   if(m->mmioHookCount && (hook = mmio_hook(m, address)) != NULL)
+   {
+      if(hook->write)
+         hook->write(hook->arg, address, size, value);
+      return;
+   }
+   if(flash_hit(m->flash, address))
+   {
+      flash_write(m->flash, address, value);
+      return;
+   }
+   switch(address)
+   {
+      case UART_WRITE: 
+         uart_write(s, value);
+         return;
+      case SIM_EXIT:
+         s->exitCode = value & 0xff;
+         s->wakeup = 1;
+         return;
+      case CPU_STACK:
+         s->cpuStack = value;
+         return;
+      case CPU_START:
+         cpu_start(s, value);
+         return;
+      case SIM_SNAPSHOT:
+         if(s->snapshotFile && snapshot_save(s, s->snapshotFile))
+            printf("Can't save %s\n", s->snapshotFile);
+         return;
+      case IRQ_MASK:   
+         m->HWMemory[1] = value; 
+         return;
+      case IRQ_STATUS: 
+         s->irqStatus = value; 
+         return;
+      case GPIO0_OUT:
+         m->HWMemory[2] |= value;
+         return;
+      case GPIO0_CLEAR:
+         m->HWMemory[2] &= ~value;
+         return;
+      case ETHERNET_REG:
+#ifdef ENABLE_ETHERNET
+         if(m->eth)
+            eth_send(m->cpuList[0], value);
+#endif
+         return;
+      case MMU_PROCESS_ID:
+         //printf("processId=%d\n", value);
+         s->processId = value;
+         return;
+   }
+
+   if(MMU_TLB <= address && address < MMU_TLB+MMU_ENTRIES * 8)
+   {
+      //printf("TLB 0x%x 0x%x\n", address - MMU_TLB, value);
+      ptr = (unsigned char*)s->mmuEntry + address - MMU_TLB;
+      *(int*)ptr = value;
+      s->irqStatus &= ~IRQ_MMU;
+   }
+}
+
+//RAM holds 32-bit words in host byte order so an aligned word access is 
+//a direct load.  Byte and halfword addresses are xor'ed with s->swizzle.
+static int mem_read(State *s, int size, unsigned int address)
+{
+   unsigned char *ptr = s->region[address >> REGION_SHIFT];
+
+   if(ptr == NULL)
+      return mmio_read(s, size, address);
+   gdb_watch(s, address, size, 0);
+   ptr += address & REGION_MASK;
    switch(size) 
    {
-      case 2: 
-         value = (value >> ((address & 2) << 3)) & 0xffff;
+      case 4: 
+         if(address & 3)
+            printf("Unaligned access PC=0x%x address=0x%x\n", (int)s->pc, (int)address);
+         assert((address & 3) == 0);
+         return *(int*)ptr;
+      case 2:
+         assert((address & 1) == 0);
+         return *(unsigned short*)((size_t)ptr ^ (s->swizzle & 2));
+      case 1:
+         return *(unsigned char*)((size_t)ptr ^ s->swizzle);
+      default: 
+         printf("ERROR");
+   }
+   return 0;
+}
+
+static void mem_write(State *s, int size, int unsigned address, unsigned int value)
+{
+   unsigned char *ptr = s->region[address >> REGION_SHIFT];
+
+   if(ptr == NULL)
+   {
+      mmio_write(s, size, address, value);
+      return;
+   }
+   ptr += address & REGION_MASK;
+   decode_invalidate(s->m, address);
+   jit_check(s->m, address);
+   gdb_watch(s, address, size, 1);
+   switch(size) 
+   {
+      case 4: 
+         assert((address & 3) == 0);
+         *(int*)ptr = value;
+         break;
+      case 2:
+         assert((address & 1) == 0);
+         *(unsigned short*)((size_t)ptr ^ (s->swizzle & 2)) = (unsigned short)value; 
          break;
       case 1:
-         value = (value >> ((address & 3) << 3)) & 0xff;
+         *(unsigned char*)((size_t)ptr ^ s->swizzle) = (unsigned char)value; 
          break;
+      default: 
+         printf("ERROR");
    }
-
-   //Debug testing
-   value2 = mem_read(s, size, address2);
-   if(value != value2)
-      printf("miss match\n");
-   //if((cacheTry & 0xffff) == 0) printf("\n***cache(%d,%d)\n ", cacheMiss, cacheTry);
-   return value;
+#ifdef ENABLE_THREADS
+   if(s->fence)
+      __sync_synchronize();   //sequential consistency for OS_SpinLock()
+#endif
 }
 
-static void cache_write(State *s, int size, int unsigned address, unsigned int value)
+//Store the bytes of value selected by mask into the word at address
+static void mem_write_masked(State *s, unsigned int address, unsigned int value, 
+                             unsigned int mask)
 {
-   int offset;
-
-   mem_write(s, size, address, value);
+   unsigned char *ptr = s->region[address >> REGION_SHIFT];
+   unsigned int *word, old;
+   int i;
 
-   offset = address >> 20;
-   if(offset != 0x100 && offset != 0x101)
+   address &= ~3;
+   if(ptr == NULL)
+   {
+      for(i = 0; i < 4; ++i)
+      {
+         if((mask >> (i * 8)) & 0xff)
+            mmio_write(s, 1, address | (i ^ s->swizzle), (value >> (i * 8)) & 0xff);
+      }
       return;
-
-   offset = (address >> 2) & 0x3ff;
-   if(size != 4)
+   }
+   word = (unsigned int*)(ptr + (address & REGION_MASK));
+   decode_invalidate(s->m, address);
+   jit_check(s->m, address);
+   gdb_watch(s, address, 4, 1);
+#ifdef ENABLE_THREADS
+   if(s->fence)
    {
-      cacheAddr[offset] = CACHE_MISS;
+      //Other CPUs may store to the other bytes of the word
+      do
+      {
+         old = *word;
+      } while(!__sync_bool_compare_and_swap(word, old, (old & ~mask) | (value & mask)));
       return;
    }
-   cacheAddr[offset] = address >> 12;
-   cacheData[offset] = value;
+#endif
+   old = *word;
+   *word = (old & ~mask) | (value & mask);
 }
 
-#define mem_read cache_read
-#define mem_write cache_write
-#endif  //SIMPLE_CACHE
-/************* End optional cache implementation *************/
+//LWL, LWR, SWL and SWR move the part of a word that lies in the aligned
+//word at address.  LWL and SWL shift by the bytes before address in 
+//memory order; LWR and SWR by the bytes after it.
+static unsigned int mem_lwl(State *s, unsigned int address, unsigned int old)
+{
+   int shift = ((address ^ s->swizzle ^ 3) & 3) * 8;
+   return ((unsigned int)mem_read(s, 4, address & ~3) << shift) | 
+      (old & ~(0xffffffff << shift));
+}
 
+static unsigned int mem_lwr(State *s, unsigned int address, unsigned int old)
+{
+   int shift = ((address ^ s->swizzle) & 3) * 8;
+   return ((unsigned int)mem_read(s, 4, address & ~3) >> shift) | 
+      (old & ~(0xffffffff >> shift));
+}
 
-void mult_big(unsigned int a, 
-              unsigned int b,
-              unsigned int *hi, 
-              unsigned int *lo)
+static void mem_swl(State *s, unsigned int address, unsigned int value)
 {
-   unsigned int ahi, alo, bhi, blo;
-   unsigned int c0, c1, c2;
-   unsigned int c1_a, c1_b;
+   int shift = ((address ^ s->swizzle ^ 3) & 3) * 8;
+   mem_write_masked(s, address, value >> shift, 0xffffffff >> shift);
+}
 
-   ahi = a >> 16;
-   alo = a & 0xffff;
-   bhi = b >> 16;
-   blo = b & 0xffff;
+static void mem_swr(State *s, unsigned int address, unsigned int value)
+{
+   int shift = ((address ^ s->swizzle) & 3) * 8;
+   mem_write_masked(s, address, value << shift, 0xffffffff << shift);
+}
 
-   c0 = alo * blo;
-   c1_a = ahi * blo;
-   c1_b = alo * bhi;
-   c2 = ahi * bhi;
+//LL remembers the address and the word loaded.  SC only stores if the 
+//reservation is held and the word still has that value, which catches 
+//stores from other CPUs without checking every store.  Exceptions and 
+//interrupts drop the reservation.
+static unsigned int mem_ll(State *s, unsigned int address)
+{
+   s->llValue = mem_read(s, 4, address);
+   s->llAddress = address | 1;
+   return s->llValue;
+}
 
-   c2 += (c1_a >> 16) + (c1_b >> 16);
-   c1 = (c1_a & 0xffff) + (c1_b & 0xffff) + (c0 >> 16);
-   c2 += (c1 >> 16);
-   c0 = (c1 << 16) + (c0 & 0xffff);
-   *hi = c2;
-   *lo = c0;
+//Returns 1 if SC to address would store
+static int mem_sc_check(State *s, unsigned int address)
+{
+   unsigned char *ptr = s->region[address >> REGION_SHIFT];
+
+   if(s->llAddress != (address | 1))
+      return 0;
+   return ptr == NULL || *(unsigned int*)(ptr + (address & REGION_MASK)) == s->llValue;
 }
 
-void mult_big_signed(int a, 
-                     int b,
-                     unsigned int *hi, 
-                     unsigned int *lo)
+static unsigned int mem_sc(State *s, unsigned int address, unsigned int value)
 {
-   unsigned int ahi, alo, bhi, blo;
-   unsigned int c0, c1, c2;
-   unsigned int c1_a, c1_b;
+   unsigned char *ptr = s->region[address >> REGION_SHIFT];
+   int held = mem_sc_check(s, address);
 
-   ahi = a >> 16;
-   alo = a & 0xffff;
-   bhi = b >> 16;
-   blo = b & 0xffff;
+   s->llAddress = 0;
+   if(held == 0)
+      return 0;
+#ifdef ENABLE_THREADS
+   if(s->fence && ptr)
+   {
+      //Another host thread may store between the check and the write
+      decode_invalidate(s->m, address);
+      jit_check(s->m, address);
+      gdb_watch(s, address, 4, 1);
+      return __sync_bool_compare_and_swap(
+         (unsigned int*)(ptr + (address & REGION_MASK)), s->llValue, value);
+   }
+#endif
+   (void)ptr;
+   mem_write(s, 4, address, value);
+   return 1;
+}
 
-   c0 = alo * blo;
-   c1_a = ahi * blo;
-   c1_b = alo * bhi;
-   c2 = ahi * bhi;
+/************* Memory map *************/
+//RAM is a list of banks of whole 1MB regions that every CPU's region[]
+//points into.  Banks are reserved with mmap() and the host commits a 
+//page the first time it is written, so a 64MB DDR costs nothing until
+//the program uses it.  Addresses outside the banks read as 0 and 
+//ignore writes like the MMIO registers nothing decodes.
+#define BANK_MAX      16
+#define RAM_INTERNAL  0x00000000
+#define RAM_EXTERNAL  0x10000000           //DDR on the Spartan-3E board
+
+struct MemBank_s {
+   unsigned int address, size;
+   unsigned char *mem;      //host memory in host word order or NULL
+   unsigned char *base;     //copy after loading for snapshot diffs
+};
+
+static unsigned char *mem_alloc(unsigned int size)
+{
+#ifndef WIN32
+   void *ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, 
+      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+   return ptr == MAP_FAILED ? NULL : (unsigned char*)ptr;
+#else
+   return (unsigned char*)calloc(1, size);
+#endif
+}
+
+static void mem_release(unsigned char *ptr, unsigned int size)
+{
+   if(ptr == NULL)
+      return;
+#ifndef WIN32
+   munmap(ptr, size);
+#else
+   free(ptr);
+   (void)size;
+#endif
+}
+
+//Add a RAM bank, replacing the banks it overlaps.  Returns -1 if it 
+//overlaps MISC_BASE or the table is full.
+static int mem_bank_add(Machine *m, unsigned int address, unsigned int size)
+{
+   MemBank *b;
+   int i;
+
+   size = (size + REGION_MASK) & ~REGION_MASK;
+   if((address & REGION_MASK) || size == 0 || address + size - 1 < address ||
+      (address < MISC_BASE + 0x10000000 && MISC_BASE < address + size))
+      return -1;
+   for(i = 0; i < m->bankCount; )
+   {
+      b = &m->bank[i];
+      if(b->address < address + size && address < b->address + b->size)
+      {
+         mem_release(b->mem, b->size);
+         mem_release(b->base, b->size);
+         *b = m->bank[--m->bankCount];
+      }
+      else
+         ++i;
+   }
+   if(m->bankCount == BANK_MAX)
+      return -1;
+   b = &m->bank[m->bankCount++];
+   memset(b, 0, sizeof(MemBank));
+   b->address = address;
+   b->size = size;
+   return 0;
+}
+
+#ifndef PLASMA_LIBRARY
+//A number with an optional K or M suffix
+static unsigned int mem_size(const char *text)
+{
+   char *end;
+   unsigned int value = (unsigned int)strtoul(text, &end, 0);
+
+   if(*end == 'K' || *end == 'k')
+      value <<= 10;
+   else if(*end == 'M' || *end == 'm')
+      value <<= 20;
+   return value;
+}
+#endif
+
+//1MB of internal RAM and 64MB of DDR, which holds the Ethernet buffers
+static void mem_defaults(Machine *m)
+{
+   m->bankCount = 0;
+   mem_bank_add(m, RAM_INTERNAL, 1 << REGION_SHIFT);
+   mem_bank_add(m, RAM_EXTERNAL, 64 << REGION_SHIFT);
+}
+
+static void mem_free(Machine *m)
+{
+   int i;
+
+   for(i = 0; i < m->bankCount; ++i)
+   {
+      mem_release(m->bank[i].mem, m->bank[i].size);
+      mem_release(m->bank[i].base, m->bank[i].size);
+   }
+   m->bankCount = 0;
+   if(m->flash->mem)
+      mem_release(m->flash->mem, m->flash->size);
+   m->flash->mem = NULL;
+}
+
+//Point s->region[] at the banks, allocating any that are new
+static void region_init(State *s)
+{
+   MemBank *b;
+   unsigned int i;
+
+   memset(s->region, 0, sizeof(s->region));
+   for(b = s->m->bank; b < s->m->bank + s->m->bankCount; ++b)
+   {
+      if(b->mem == NULL)
+         b->mem = mem_alloc(b->size);
+      if(b->mem == NULL)
+      {
+         printf("Can't allocate %dMB of RAM at 0x%x\n", b->size >> 20, b->address);
+         continue;
+      }
+      for(i = 0; i < b->size >> REGION_SHIFT; ++i)
+         s->region[(b->address >> REGION_SHIFT) + i] = b->mem + (i << REGION_SHIFT);
+   }
+   s->swizzle = s->big_endian ? 3 : 0;
+}
+
+//Copy bytes in target order to RAM; returns the bytes before the first
+//address that isn't RAM
+static int mem_load(State *s, unsigned int address, const unsigned char *data, int length)
+{
+   unsigned char *ptr;
+   int i;
+
+   for(i = 0; i < length; ++i)
+   {
+      ptr = s->region[(address + i) >> REGION_SHIFT];
+      if(ptr == NULL)
+         break;
+      ptr[((address + i) & REGION_MASK) ^ s->swizzle] = data[i];
+   }
+   return i;
+}
+
+#ifdef ENABLE_CACHE
+/************* Optional MMU and cache implementation *************/
+/* TAG = VirtualAddress | ProcessId | WriteableBit */
+static unsigned int mmu_lookup(State *s, unsigned int processId, 
+                         unsigned int address, int write)
+{
+   int i;
+   unsigned int compare, tag;
+
+   if(processId == 0 || s->userMode == 0)
+      return address;
+   //if(address < 0x30000000)
+   //   return address;
+   compare = (address & ~MMU_MASK) | (processId << 1);
+   for(i = 0; i < MMU_ENTRIES; ++i)
+   {
+      tag = s->mmuEntry[i].virtualAddress;
+      if((tag & ~1) == compare && (write == 0 || (tag & 1)))
+         return s->mmuEntry[i].physicalAddress | (address & MMU_MASK);
+   }
+   //printf("\nMMUTlbMiss 0x%x PC=0x%x w=%d pid=%d user=%d\n", 
+   //   address, s->pc, write, processId, s->userMode);
+   //printf("m");
+   s->exceptionId = 1;
+   s->faultAddr = address & ~MMU_MASK;
+   s->irqStatus |= IRQ_MMU;
+   return address;
+}
+
+
+#define CACHE_SET_ASSOC_LN2   0
+#define CACHE_SET_ASSOC       (1 << CACHE_SET_ASSOC_LN2)
+#define CACHE_SIZE_LN2        (13 - CACHE_SET_ASSOC_LN2)  //8 KB
+#define CACHE_SIZE            (1 << CACHE_SIZE_LN2)
+#define CACHE_LINE_SIZE_LN2   2                           //4 bytes
+#define CACHE_LINE_SIZE       (1 << CACHE_LINE_SIZE_LN2)
+
+static int cacheData[CACHE_SET_ASSOC][CACHE_SIZE/sizeof(int)];
+static int cacheAddr[CACHE_SET_ASSOC][CACHE_SIZE/CACHE_LINE_SIZE];
+static int cacheSetNext;
+static int cacheMiss, cacheWriteBack, cacheCount;
+
+static void cache_init(void)
+{
+   int set, i;
+   for(set = 0; set < CACHE_SET_ASSOC; ++set)
+   {
+      for(i = 0; i < CACHE_SIZE/CACHE_LINE_SIZE; ++i)
+         cacheAddr[set][i] = 0xffff0000;
+   }
+}
+
+/* Write-back cache memory tagged by virtual address and processId */
+/* TAG = virtualAddress | processId | dirtyBit */
+static int cache_load(State *s, unsigned int address, int write)
+{
+   int set, i, pid, miss, offsetAddr, offsetData, offsetMem;
+   unsigned int addrTagMatch, addrPrevMatch=0;
+   unsigned int addrPrev;
+   unsigned int addressPhysical, tag;
+
+   ++cacheCount;
+   addrTagMatch = address & ~(CACHE_SIZE-1);
+   offsetAddr = (address & (CACHE_SIZE-1)) >> CACHE_LINE_SIZE_LN2;
+
+   /* Find match */
+   miss = 1;
+   for(set = 0; set < CACHE_SET_ASSOC; ++set)
+   {
+      addrPrevMatch = cacheAddr[set][offsetAddr] & ~(CACHE_SIZE-1);
+      if(addrPrevMatch == addrTagMatch)
+      {
+         miss = 0;
+         break;
+      }
+   }
+
+   /* Cache miss? */
+   if(miss)
+   {
+      ++cacheMiss;
+      set = cacheSetNext;
+      cacheSetNext = (cacheSetNext + 1) & (CACHE_SET_ASSOC-1);
+   }
+   //else if(write || (address >> 28) != 0x1)
+   //{
+   //   tag = cacheAddr[set][offsetAddr];
+   //   pid = (tag & (CACHE_SIZE-1)) >> 1; 
+   //   if(pid != s->processId)
+   //      miss = 1;
+   //}
+
+   if(miss)
+   {
+      offsetData = address & (CACHE_SIZE-1) & ~(CACHE_LINE_SIZE-1);
+
+      /* Cache line dirty? */
+      if(cacheAddr[set][offsetAddr] & 1)
+      {
+         /* Write back cache line */
+         tag = cacheAddr[set][offsetAddr];
+         addrPrev = tag & ~(CACHE_SIZE-1);
+         addrPrev |= address & (CACHE_SIZE-1);
+         pid = (tag & (CACHE_SIZE-1)) >> 1; 
+         addressPhysical = mmu_lookup(s, pid, addrPrev, 1);   //virtual->physical
+         if(s->exceptionId)
+            return 0;
+         offsetMem = addressPhysical & ~(CACHE_LINE_SIZE-1);
+         for(i = 0; i < CACHE_LINE_SIZE; i += 4)
+            mem_write(s, 4, offsetMem + i, cacheData[set][(offsetData + i) >> 2]);
+         ++cacheWriteBack;
+      }
+
+      /* Read cache line */
+      addressPhysical = mmu_lookup(s, s->processId, address, write); //virtual->physical
+      if(s->exceptionId)
+         return 0;
+      offsetMem = addressPhysical & ~(CACHE_LINE_SIZE-1);
+      cacheAddr[set][offsetAddr] = addrTagMatch;
+      for(i = 0; i < CACHE_LINE_SIZE; i += 4)
+         cacheData[set][(offsetData + i) >> 2] = mem_read(s, 4, offsetMem + i);
+   }
+   cacheAddr[set][offsetAddr] |= write;
+   return set;
+}
+
+static int cache_read(State *s, int size, unsigned int address)
+{
+   int set, offset;
+   int value;
+
+   if((address & 0xfe000000) != 0x10000000)
+      return mem_read(s, size, address);
+
+   set = cache_load(s, address, 0);
+   if(s->exceptionId)
+      return 0;
+   offset = (address & (CACHE_SIZE-1)) >> 2;
+   value = cacheData[set][offset];
+   if(s->big_endian)
+      address ^= 3;
+   switch(size) 
+   {
+      case 2: 
+         value = (value >> ((address & 2) << 3)) & 0xffff;
+         break;
+      case 1:
+         value = (value >> ((address & 3) << 3)) & 0xff;
+         break;
+   }
+   return value;
+}
+
+static void cache_write(State *s, int size, int unsigned address, unsigned int value)
+{
+   int set, offset;
+   unsigned int mask;
+
+   if((address >> 28) != 0x1) // && (s->processId == 0 || s->userMode == 0))
+   {
+      mem_write(s, size, address, value);
+      return;
+   }
+
+   set = cache_load(s, address, 1);
+   if(s->exceptionId)
+      return;
+   offset = (address & (CACHE_SIZE-1)) >> 2;
+   if(s->big_endian)
+      address ^= 3;
+   switch(size) 
+   {
+      case 2:
+         value &= 0xffff;
+         value |= value << 16;
+         mask = 0xffff << ((address & 2) << 3);
+         break;
+      case 1:
+         value &= 0xff;
+         value |= (value << 8) | (value << 16) | (value << 24);
+         mask = 0xff << ((address & 3) << 3);
+         break;
+      case 4:
+      default:
+         mask = 0xffffffff;
+         break;
+   }
+   cacheData[set][offset] = (value & mask) | (cacheData[set][offset] & ~mask);
+}
+
+#define mem_read cache_read
+#define mem_write cache_write
+
+#else
+static void cache_init(void) {}
+#endif
+
+
+#ifdef SIMPLE_CACHE
+
+//Write through direct mapped 4KB cache
+#define CACHE_MISS 0x1ff
+static unsigned int cacheData[1024];
+static unsigned int cacheAddr[1024]; //9-bit addresses
+static int cacheTry, cacheMiss, cacheInit;
+
+static int cache_read(State *s, int size, unsigned int address)
+{
+   int offset;
+   unsigned int value, value2, address2=address;
+
+   if(cacheInit == 0)
+   {
+      cacheInit = 1;
+      for(offset = 0; offset < 1024; ++offset)
+         cacheAddr[offset] = CACHE_MISS;
+   }
+
+   offset = address >> 20;
+   if(offset != 0x100 && offset != 0x101)
+      return mem_read(s, size, address);
+
+   ++cacheTry;
+   offset = (address >> 2) & 0x3ff;
+   if(cacheAddr[offset] != (address >> 12) || cacheAddr[offset] == CACHE_MISS)
+   {
+      ++cacheMiss;
+      cacheAddr[offset] = address >> 12;
+      cacheData[offset] = mem_read(s, 4, address & ~3);
+   }
+   value = cacheData[offset];
+   if(s->big_endian)
+      address ^= 3;
+   switch(size) 
+   {
+      case 2: 
+         value = (value >> ((address & 2) << 3)) & 0xffff;
+         break;
+      case 1:
+         value = (value >> ((address & 3) << 3)) & 0xff;
+         break;
+   }
+
+   //Debug testing
+   value2 = mem_read(s, size, address2);
+   if(value != value2)
+      printf("miss match\n");
+   //if((cacheTry & 0xffff) == 0) printf("\n***cache(%d,%d)\n ", cacheMiss, cacheTry);
+   return value;
+}
+
+static void cache_write(State *s, int size, int unsigned address, unsigned int value)
+{
+   int offset;
+
+   mem_write(s, size, address, value);
+
+   offset = address >> 20;
+   if(offset != 0x100 && offset != 0x101)
+      return;
+
+   offset = (address >> 2) & 0x3ff;
+   if(size != 4)
+   {
+      cacheAddr[offset] = CACHE_MISS;
+      return;
+   }
+   cacheAddr[offset] = address >> 12;
+   cacheData[offset] = value;
+}
+
+#define mem_read cache_read
+#define mem_write cache_write
+#endif  //SIMPLE_CACHE
+/************* End optional cache implementation *************/
+
+
+static void mult_big(unsigned int a, 
+                     unsigned int b,
+                     unsigned int *hi, 
+                     unsigned int *lo)
+{
+   unsigned int ahi, alo, bhi, blo;
+   unsigned int c0, c1, c2;
+   unsigned int c1_a, c1_b;
+
+   ahi = a >> 16;
+   alo = a & 0xffff;
+   bhi = b >> 16;
+   blo = b & 0xffff;
+
+   c0 = alo * blo;
+   c1_a = ahi * blo;
+   c1_b = alo * bhi;
+   c2 = ahi * bhi;
+
+   c2 += (c1_a >> 16) + (c1_b >> 16);
+   c1 = (c1_a & 0xffff) + (c1_b & 0xffff) + (c0 >> 16);
+   c2 += (c1 >> 16);
+   c0 = (c1 << 16) + (c0 & 0xffff);
+   *hi = c2;
+   *lo = c0;
+}
+
+static void mult_big_signed(int a, 
+                            int b,
+                            unsigned int *hi, 
+                            unsigned int *lo)
+{
+   unsigned int ahi, alo, bhi, blo;
+   unsigned int c0, c1, c2;
+   unsigned int c1_a, c1_b;
+
+   ahi = a >> 16;
+   alo = a & 0xffff;
+   bhi = b >> 16;
+   blo = b & 0xffff;
+
+   c0 = alo * blo;
+   c1_a = ahi * blo;
+   c1_b = alo * bhi;
+   c2 = ahi * bhi;
 
    c2 += (c1_a >> 16) + (c1_b >> 16);
    c1 = (c1_a & 0xffff) + (c1_b & 0xffff) + (c0 >> 16);
@@ -600,400 +1651,3773 @@ void mult_big_signed(int a,
    *lo = c0;
 }
 
-//execute one cycle of a Plasma CPU
-void cycle(State *s, int show_mode)
+#define ACCESS_READ    1
+#define ACCESS_WRITE   2
+#define ACCESS_PARTIAL 4         //byte or halfword store
+
+//Returns the ACCESS_ flags of a load or store opcode, 0 for others
+static int opcode_access(unsigned int opcode)
+{
+   switch(opcode >> 26)
+   {
+   case 0x20: case 0x21: case 0x22: case 0x23:   //LB LH LWL LW
+   case 0x24: case 0x25: case 0x26: case 0x30:   //LBU LHU LWR LL
+      return ACCESS_READ;
+   case 0x2b: case 0x38:                         //SW SC
+      return ACCESS_WRITE;
+   case 0x28: case 0x29: case 0x2a: case 0x2e:   //SB SH SWL SWR
+      return ACCESS_WRITE | ACCESS_PARTIAL;
+   }
+   return 0;
+}
+
+/************* Timing model *************/
+//Estimates FPGA clock cycles from vhdl/mlite_cpu.vhd.  Every opcode 
+//takes one clock plus pauses from the 3 stage pipeline (pipeline.vhd),
+//the multiplier (mult.vhd), the second clock of loads and stores 
+//(mem_ctrl.vhd), the 4KB cache (cache.vhd) and the DDR (ddr_ctrl.vhd).
+//DDR refresh and UART busy pauses are not modeled.
+#define TIMING_MULT_CLOCKS   32      //mult.vhd count_reg
+#define TIMING_FLASH_WAIT    4
+#define TIMING_DDR_READ      3       //STATE_READ..STATE_READ3
+#define TIMING_DDR_WRITE     1
+#define TIMING_DDR_ACTIVATE  1       //STATE_ROW_ACTIVATE
+#define TIMING_DDR_PRECHARGE 2       //STATE_PRECHARGE..STATE_PRECHARGE2
+#define TIMING_CLOCK_MHZ     25
+#define TIMING_CACHE_INVALID 0x1ff
+
+struct Timing_s {
+   int stages;          //pipeline_stages generic: 2 or 3
+   int useCache;        //use_cache generic
+   int pauseEnable;     //pipeline.vhd pause_enable_reg
+   int multCount;       //clocks until HI/LO are ready
+   unsigned short cacheTag[1024];
+   int ddrRow[4];       //open row for each bank or -1
+   long long opcodes, cycles;
+   long long pipelineStalls, multStalls, memoryWaits;
+   long long cacheHits, cacheMisses;
+};
+
+#ifndef PLASMA_LIBRARY
+static void timing_init(Timing *t, int stages, int useCache)
+{
+   int i;
+   memset(t, 0, sizeof(Timing));
+   t->stages = stages;
+   t->useCache = useCache;
+   for(i = 0; i < 1024; ++i)
+      t->cacheTag[i] = TIMING_CACHE_INVALID;
+   for(i = 0; i < 4; ++i)
+      t->ddrRow[i] = -1;
+}
+#endif
+
+//Returns the wait states for one DDR access (MT46V32M16 address map)
+static int timing_ddr(Timing *t, unsigned int address, int write)
+{
+   int bank = (address >> 11) & 3;
+   int row = (address >> 13) & 0x1fff;
+   int wait = 0;
+
+   if(t->ddrRow[bank] != row)
+   {
+      if(t->ddrRow[bank] >= 0)
+         wait += TIMING_DDR_PRECHARGE;
+      wait += TIMING_DDR_ACTIVATE;
+      t->ddrRow[bank] = row;
+   }
+   return wait + (write ? TIMING_DDR_WRITE : TIMING_DDR_READ);
+}
+
+//Returns the wait states for a fetch, load or store.  Size is 4 except
+//for byte and halfword stores which invalidate the cache line.
+static int timing_memory(Timing *t, unsigned int address, int size, int write)
+{
+   int index, tag;
+
+   switch((address >> 28) & 7)
+   {
+   case 1:                             //DDR
+      if(t->useCache && ((address >> 21) & 0x3ff) == 0x080)
+      {
+         //Only the lowest 2MB of DDR are cached with one word lines
+         index = (address >> 2) & 1023;
+         tag = (address >> 12) & 0x1ff;
+         if(write)
+         {
+            t->cacheTag[index] = size == 4 ? tag : TIMING_CACHE_INVALID;
+            return timing_ddr(t, address, 1);
+         }
+         if(t->cacheTag[index] == tag)
+         {
+            ++t->cacheHits;
+            return 0;
+         }
+         ++t->cacheMisses;
+         t->cacheTag[index] = tag;
+      }
+      return timing_ddr(t, address, write);
+   case 3:                             //flash
+      return TIMING_FLASH_WAIT;
+   }
+   return 0;                           //internal RAM or MMIO
+}
+
+//Account for one opcode; ptr is its load or store address
+static void timing_opcode(State *s, unsigned int opcode, unsigned int ptr)
+{
+   Timing *t = s->timing;
+   unsigned int op = opcode >> 26, func = opcode & 0x3f;
+   int memory=opcode_access(opcode), pause=0, wait, stall=0, clocks;
+
+   if(memory || op == 1 || (op >= 4 && op <= 7) || (op >= 0x14 && op <= 0x17))
+      pause = 1;
+   if(op == 0 && (func == 0x08 || func == 0x09 || func == 0x10 || func == 0x12))
+      pause = 1;                       //JR JALR MFHI MFLO
+
+   wait = timing_memory(t, s->pc, 4, 0);
+   if(memory)
+      wait += 1 + timing_memory(t, ptr, memory & ACCESS_PARTIAL ? 1 : 4, 
+                                memory & ACCESS_WRITE);
+   t->memoryWaits += wait;
+   if(t->stages > 2 && pause && t->pauseEnable)
+   {
+      ++stall;
+      ++t->pipelineStalls;
+   }
+   if(op == 0 && (func == 0x10 || func == 0x12) && t->multCount > 0)
+   {
+      stall += t->multCount;
+      t->multStalls += t->multCount;
+   }
+   clocks = 1 + wait + stall;
+   t->pauseEnable = wait + stall == 0;
+   t->multCount = t->multCount > clocks ? t->multCount - clocks : 0;
+   if(op == 0 && func >= 0x18 && func <= 0x1b)
+      t->multCount = TIMING_MULT_CLOCKS;  //MULT MULTU DIV DIVU
+   ++t->opcodes;
+   t->cycles += clocks;
+}
+
+#ifndef PLASMA_LIBRARY
+static void timing_report(State *s)
+{
+   Timing *t = s->timing;
+   FILE *out = s->batch ? stderr : stdout;
+
+   fprintf(out, "Timing (%d stage pipeline, cache %s):\n", t->stages,
+      t->useCache ? "on" : "off");
+   fprintf(out, "   opcodes          %lld\n", t->opcodes);
+   fprintf(out, "   cycles           %lld (%.3f ms at %dMHz, CPI %.3f)\n",
+      t->cycles, t->cycles / (TIMING_CLOCK_MHZ * 1000.0), TIMING_CLOCK_MHZ,
+      t->opcodes ? (double)t->cycles / t->opcodes : 0.0);
+   fprintf(out, "   pipeline stalls  %lld\n", t->pipelineStalls);
+   fprintf(out, "   multiplier busy  %lld\n", t->multStalls);
+   fprintf(out, "   memory waits     %lld\n", t->memoryWaits);
+   if(t->useCache)
+      fprintf(out, "   cache hits       %lld misses %lld\n", 
+         t->cacheHits, t->cacheMisses);
+}
+#endif
+
+/************* Symbols *************/
+static int symbol_compare(const void *a, const void *b)
+{
+   unsigned int x = ((const Symbol*)a)->address, y = ((const Symbol*)b)->address;
+   return x < y ? -1 : x > y;
+}
+
+#ifndef PLASMA_LIBRARY
+//Read "0xaddress name" lines from a GNU ld -Map file
+static int symbol_load_map(State *s, const char *filename)
+{
+   FILE *in;
+   char line[256], name[256], *ptr, extra;
+   unsigned int address;
+   int size=0;
+
+   in = fopen(filename, "r");
+   if(in == NULL)
+      return -1;
+   while(fgets(line, sizeof(line), in))
+   {
+      if(sscanf(line, " 0x%x %255s", &address, name) != 2)
+         continue;
+      if(sscanf(line, " 0x%*x %*s %c", &extra) == 1)
+         continue;                           //section or assignment
+      for(ptr = name; isalnum((unsigned char)*ptr) || *ptr == '_'; ++ptr)
+         ;
+      if(*ptr || isdigit((unsigned char)name[0]))
+         continue;
+      if(s->symbolCount >= size)
+      {
+         size = size * 2 + 256;
+         s->symbol = (Symbol*)realloc(s->symbol, size * sizeof(Symbol));
+      }
+      s->symbol[s->symbolCount].address = address;
+      s->symbol[s->symbolCount].name = strdup(name);
+      ++s->symbolCount;
+   }
+   fclose(in);
+   qsort(s->symbol, s->symbolCount, sizeof(Symbol), symbol_compare);
+   return s->symbolCount;
+}
+#endif
+
+static unsigned int elf_get(const unsigned char *ptr, int size, int big)
+{
+   unsigned int value=0;
+   int i;
+   for(i = 0; i < size; ++i)
+      value |= ptr[i] << ((big ? size - 1 - i : i) * 8);
+   return value;
+}
+
+//Read the STT_FUNC and STT_NOTYPE symbols of a 32-bit ELF file
+static int symbol_load_elf(State *s, const unsigned char *elf, int length)
+{
+   int big = elf[5] == 2, i, j, size=s->symbolCount;
+   unsigned int shoff, shnum, shentsize, offset, count, strtab, name, info;
+   const unsigned char *sh, *sym;
+
+   shoff = elf_get(elf + 32, 4, big);
+   shentsize = elf_get(elf + 46, 2, big);
+   shnum = elf_get(elf + 48, 2, big);
+   for(i = 0; i < (int)shnum && shoff + (i + 1) * shentsize <= (unsigned int)length; ++i)
+   {
+      sh = elf + shoff + i * shentsize;
+      if(elf_get(sh + 4, 4, big) != 2)      //SHT_SYMTAB
+         continue;
+      offset = elf_get(sh + 16, 4, big);
+      count = elf_get(sh + 20, 4, big) / 16;
+      j = elf_get(sh + 24, 4, big);         //sh_link: string table
+      if(offset + count * 16 > (unsigned int)length || j >= (int)shnum)
+         continue;
+      strtab = elf_get(elf + shoff + j * shentsize + 16, 4, big);
+      for(j = 1; j < (int)count; ++j)
+      {
+         sym = elf + offset + j * 16;
+         name = strtab + elf_get(sym, 4, big);
+         info = sym[12] & 0xf;
+         if((info != 0 && info != 2) || elf_get(sym + 14, 2, big) == 0 || 
+            name >= (unsigned int)length || elf[name] == 0 || elf[name] == '.' ||
+            memchr(elf + name, 0, length - name) == NULL)
+            continue;
+         if(s->symbolCount >= size)
+         {
+            size = size * 2 + 256;
+            s->symbol = (Symbol*)realloc(s->symbol, size * sizeof(Symbol));
+         }
+         s->symbol[s->symbolCount].address = elf_get(sym + 4, 4, big);
+         s->symbol[s->symbolCount].name = strdup((const char*)elf + name);
+         ++s->symbolCount;
+      }
+   }
+   qsort(s->symbol, s->symbolCount, sizeof(Symbol), symbol_compare);
+   return s->symbolCount;
+}
+
+#ifndef PLASMA_LIBRARY
+//Load symbols from an ELF file or a GNU ld -Map file
+static int symbol_load(State *s, const char *filename)
+{
+   FILE *in;
+   unsigned char *elf;
+   int length;
+
+   in = fopen(filename, "rb");
+   if(in == NULL)
+      return -1;
+   fseek(in, 0, SEEK_END);
+   length = ftell(in);
+   fseek(in, 0, SEEK_SET);
+   elf = (unsigned char*)malloc(length + 1);
+   length = fread(elf, 1, length, in);
+   fclose(in);
+   if(length > 52 && memcmp(elf, "\177ELF", 4) == 0 && elf[4] == 1)
+      length = symbol_load_elf(s, elf, length);
+   else
+      length = symbol_load_map(s, filename);
+   free(elf);
+   return length;
+}
+#endif
+
+//Copy the PT_LOAD segments of a 32-bit MIPS ELF file to their vaddr,
+//zero their BSS and set $gp from .reginfo.  BSS bytes that are already
+//zero aren't written so untouched pages stay uncommitted.  Returns the 
+//byte count or -1.
+static int elf_load(State *s, const unsigned char *elf, int length)
+{
+   int big = elf[5] == 2, i, bytes=0;
+   unsigned int phoff, phentsize, phnum, shoff, shentsize, shnum;
+   unsigned int offset, vaddr, filesz, memsz, j;
+   const unsigned char *ph, *sh;
+   unsigned char *ptr;
+
+   if(elf_get(elf + 18, 2, big) != 8)      //EM_MIPS
+      return -1;
+   phoff = elf_get(elf + 28, 4, big);
+   phentsize = elf_get(elf + 42, 2, big);
+   phnum = elf_get(elf + 44, 2, big);
+   s->big_endian = big;
+   region_init(s);
+   for(i = 0; i < (int)phnum && phoff + (i + 1) * phentsize <= (unsigned int)length; ++i)
+   {
+      ph = elf + phoff + i * phentsize;
+      if(elf_get(ph, 4, big) != 1)          //PT_LOAD
+         continue;
+      offset = elf_get(ph + 4, 4, big);
+      vaddr = elf_get(ph + 8, 4, big);
+      filesz = elf_get(ph + 16, 4, big);
+      memsz = elf_get(ph + 20, 4, big);
+      if(offset + filesz > (unsigned int)length || filesz > memsz)
+         return -1;
+      for(j = 0; j < memsz; ++j)
+      {
+         ptr = s->region[(vaddr + j) >> REGION_SHIFT];
+         if(ptr == NULL)
+         {
+            printf("Segment at 0x%x isn't in RAM\n", vaddr + j);
+            break;
+         }
+         ptr += ((vaddr + j) & REGION_MASK) ^ s->swizzle;
+         if(j < filesz)
+            *ptr = elf[offset + j];
+         else if(*ptr)
+            *ptr = 0;
+      }
+      bytes += filesz;
+   }
+   shoff = elf_get(elf + 32, 4, big);
+   shentsize = elf_get(elf + 46, 2, big);
+   shnum = elf_get(elf + 48, 2, big);
+   for(i = 0; i < (int)shnum && shoff + (i + 1) * shentsize <= (unsigned int)length; ++i)
+   {
+      sh = elf + shoff + i * shentsize;
+      offset = elf_get(sh + 16, 4, big);
+      if(elf_get(sh + 4, 4, big) == 0x70000006 && offset + 24 <= (unsigned int)length)
+         s->r[28] = elf_get(elf + offset + 20, 4, big);   //SHT_MIPS_REGINFO
+   }
+   s->pc = elf_get(elf + 24, 4, big);
+   return bytes;
+}
+
+//Returns the index of the symbol containing address or -1
+static int symbol_find(State *s, unsigned int address)
+{
+   int low=0, high=s->symbolCount-1, mid;
+   Symbol *sym = s->symbol;
+
+   mid = s->symbolLast;
+   if(mid < s->symbolCount && sym[mid].address <= address && 
+      (mid + 1 == s->symbolCount || address < sym[mid+1].address))
+      return mid;
+   if(s->symbolCount == 0 || address < sym[0].address)
+      return -1;
+   while(low < high)
+   {
+      mid = (low + high + 1) / 2;
+      if(sym[mid].address <= address)
+         low = mid;
+      else
+         high = mid - 1;
+   }
+   s->symbolLast = low;
+   return low;
+}
+
+/************* Cache statistics *************/
+//Runtime configurable cache model used only for statistics; memory 
+//itself stays coherent.  MMIO (0x2xxxxxxx) is never cached.
+#define CACHE_VALID 1
+#define CACHE_DIRTY 2
+
+typedef struct {
+   long long reads, readMisses;
+   long long writes, writeMisses;
+   long long writeBacks;         //dirty evictions or write through stores
+} CacheStats;
+
+struct CacheModel_s {
+   const char *name;
+   int size, lineSize, ways;
+   int random;                   //random instead of LRU replacement
+   int writeBack;                //write back + allocate, else write through
+   int sets, lineShift;
+   unsigned int *tag;            //line address | CACHE_ flags
+   unsigned int *used;           //LRU time stamps
+   unsigned int time, seed;
+   CacheStats total;
+   CacheStats region[16];        //by address >> 28
+   CacheStats *function;         //by symbol index
+   CacheStats unknown;           //PC without a symbol
+};
+
+#ifndef PLASMA_LIBRARY
+//Parse "size,line,ways[,lru|random][,wb|wt]" such as "4096,16,2,lru,wb"
+static CacheModel *cache_model_create(const char *name, const char *config)
+{
+   CacheModel *c;
+   char option[80];
+   const char *ptr;
+   int length;
+
+   c = (CacheModel*)calloc(1, sizeof(CacheModel));
+   c->name = name;
+   c->size = 4096;
+   c->lineSize = 4;
+   c->ways = 1;
+   sscanf(config, "%d,%d,%d", &c->size, &c->lineSize, &c->ways);
+   for(ptr = strchr(config, ','); ptr; ptr = strchr(ptr + 1, ','))
+   {
+      length = strcspn(ptr + 1, ",");
+      if(length >= (int)sizeof(option))
+         continue;
+      memcpy(option, ptr + 1, length);
+      option[length] = 0;
+      if(strcmp(option, "random") == 0)
+         c->random = 1;
+      else if(strcmp(option, "lru") == 0)
+         c->random = 0;
+      else if(strcmp(option, "wb") == 0)
+         c->writeBack = 1;
+      else if(strcmp(option, "wt") == 0)
+         c->writeBack = 0;
+   }
+   while((1 << c->lineShift) < c->lineSize)
+      ++c->lineShift;
+   if(c->ways < 1 || c->lineSize < 4 || (1 << c->lineShift) != c->lineSize ||
+      c->size < c->lineSize * c->ways)
+   {
+      printf("Bad %s cache configuration %s\n", name, config);
+      free(c);
+      return NULL;
+   }
+   c->sets = c->size / (c->lineSize * c->ways);
+   c->tag = (unsigned int*)calloc(c->sets * c->ways, sizeof(unsigned int));
+   c->used = (unsigned int*)calloc(c->sets * c->ways, sizeof(unsigned int));
+   c->seed = 1;
+   return c;
+}
+#endif
+
+//Returns 1 on a hit
+static int cache_model_access(CacheModel *c, unsigned int address, int write)
+{
+   unsigned int line = address >> c->lineShift;
+   unsigned int *tag = &c->tag[(line % c->sets) * c->ways];
+   unsigned int *used = &c->used[(line % c->sets) * c->ways];
+   unsigned int key = (line << c->lineShift) | CACHE_VALID;
+   int way, victim=0;
+
+   ++c->time;
+   for(way = 0; way < c->ways; ++way)
+   {
+      if((tag[way] & ~CACHE_DIRTY) == key)
+      {
+         used[way] = c->time;
+         if(write)
+         {
+            if(c->writeBack)
+               tag[way] |= CACHE_DIRTY;
+            else
+               ++c->total.writeBacks;
+         }
+         return 1;
+      }
+      if(used[way] < used[victim] || (tag[way] & CACHE_VALID) == 0)
+         victim = way;
+   }
+   if(write && c->writeBack == 0)
+   {
+      ++c->total.writeBacks;         //no allocate on a write miss
+      return 0;
+   }
+   if(c->random && (tag[victim] & CACHE_VALID))
+   {
+      c->seed = c->seed * 1103515245 + 12345;
+      victim = (c->seed >> 16) % c->ways;
+   }
+   if(tag[victim] & CACHE_DIRTY)
+      ++c->total.writeBacks;
+   tag[victim] = key | (write ? CACHE_DIRTY : 0);
+   used[victim] = c->time;
+   return 0;
+}
+
+static void cache_stats_add(CacheStats *stats, int write, int hit)
+{
+   if(write)
+   {
+      ++stats->writes;
+      stats->writeMisses += !hit;
+   }
+   else
+   {
+      ++stats->reads;
+      stats->readMisses += !hit;
+   }
+}
+
+//Count one access; pc selects the function
+static void cache_model_count(State *s, CacheModel *c, unsigned int pc,
+                              unsigned int address, int write)
+{
+   long long writeBacks = c->total.writeBacks;
+   int hit, index;
+
+   if((address >> 28) == 2)
+      return;
+   hit = cache_model_access(c, address, write);
+   cache_stats_add(&c->total, write, hit);
+   cache_stats_add(&c->region[address >> 28], write, hit);
+   c->region[address >> 28].writeBacks += c->total.writeBacks - writeBacks;
+   index = symbol_find(s, pc);
+   if(index >= 0 && c->function == NULL)
+      c->function = (CacheStats*)calloc(s->symbolCount, sizeof(CacheStats));
+   cache_stats_add(index >= 0 ? &c->function[index] : &c->unknown, write, hit);
+}
+
+#ifndef PLASMA_LIBRARY
+static CacheModel *cacheSort;
+
+static int cache_function_compare(const void *a, const void *b)
+{
+   const CacheStats *x = &cacheSort->function[*(const int*)a];
+   const CacheStats *y = &cacheSort->function[*(const int*)b];
+   long long mx = x->readMisses + x->writeMisses;
+   long long my = y->readMisses + y->writeMisses;
+   return mx < my ? 1 : mx > my ? -1 : 0;
+}
+
+static void cache_stats_print(FILE *out, const char *label, CacheStats *stats)
+{
+   long long accesses = stats->reads + stats->writes;
+   long long misses = stats->readMisses + stats->writeMisses;
+   fprintf(out, "   %-24s %12lld %10lld %10lld %10lld %6.2f%%\n", label, 
+      stats->reads, stats->readMisses, stats->writes, stats->writeMisses, 
+      accesses ? 100.0 * misses / accesses : 0.0);
+}
+
+static void cache_model_report(State *s, CacheModel *c, FILE *out)
+{
+   static const char *regionName[16]={"internal RAM", "DDR", "MMIO", "flash"};
+   char label[40];
+   int i, *order;
+
+   fprintf(out, "%s cache %d bytes, %d byte lines, %d way, %s, %s:\n",
+      c->name, c->size, c->lineSize, c->ways, c->random ? "random" : "LRU", 
+      c->writeBack ? "write back" : "write through");
+   fprintf(out, "   %-24s %12s %10s %10s %10s %7s\n", "", 
+      "reads", "misses", "writes", "misses", "miss");
+   cache_stats_print(out, "total", &c->total);
+   fprintf(out, "   %-24s %lld\n", 
+      c->writeBack ? "write backs" : "write throughs", c->total.writeBacks);
+   for(i = 0; i < 16; ++i)
+   {
+      if(c->region[i].reads + c->region[i].writes == 0)
+         continue;
+      sprintf(label, "0x%x %s", i << 28, regionName[i] ? regionName[i] : "");
+      cache_stats_print(out, label, &c->region[i]);
+   }
+   if(c->function == NULL)
+      return;
+   order = (int*)malloc(s->symbolCount * sizeof(int));
+   for(i = 0; i < s->symbolCount; ++i)
+      order[i] = i;
+   cacheSort = c;
+   qsort(order, s->symbolCount, sizeof(int), cache_function_compare);
+   for(i = 0; i < s->symbolCount && i < 20; ++i)
+   {
+      if(c->function[order[i]].readMisses + c->function[order[i]].writeMisses == 0)
+         break;
+      sprintf(label, "%.24s", s->symbol[order[i]].name);
+      cache_stats_print(out, label, &c->function[order[i]]);
+   }
+   if(c->unknown.reads + c->unknown.writes)
+      cache_stats_print(out, "?", &c->unknown);
+   free(order);
+}
+#endif
+
+/************* Profiler *************/
+//Counts every opcode by PC and follows JAL/JALR and JR $ra with a 
+//shadow call stack to build a calling context tree.  Context switches 
+//and exceptions that don't return through $ra confuse the call stack 
+//but not the flat profile.
+#define PROFILE_DEPTH 256
+
+typedef struct ProfileNode_s {
+   int symbol;                   //symbol index or -1
+   long long self;               //opcodes executed in this context
+   long long calls;
+   struct ProfileNode_s *parent, *child, *next;
+} ProfileNode;
+
+struct Profile_s {
+   const char *filename;         //flat profile and call graph
+   const char *folded;           //flamegraph.pl input
+   unsigned int *count[REGION_COUNT];  //opcodes per PC
+   ProfileNode root, *node;
+   unsigned int returnAddress[PROFILE_DEPTH];
+   int depth;
+   int delay;                    //opcodes until 'target' is applied
+   unsigned int target;          //call target or 0 for a return
+   long long total;
+};
+
+#ifndef PLASMA_LIBRARY
+static Profile *profile_create(void)
+{
+   Profile *p = (Profile*)calloc(1, sizeof(Profile));
+   p->root.symbol = -1;
+   p->node = &p->root;
+   return p;
+}
+#endif
+
+static ProfileNode *profile_child(ProfileNode *node, int symbol)
+{
+   ProfileNode *child;
+   for(child = node->child; child; child = child->next)
+   {
+      if(child->symbol == symbol)
+         return child;
+   }
+   child = (ProfileNode*)calloc(1, sizeof(ProfileNode));
+   child->symbol = symbol;
+   child->parent = node;
+   child->next = node->child;
+   node->child = child;
+   return child;
+}
+
+//Called before each opcode executes
+static void profile_opcode(State *s, unsigned int opcode)
+{
+   Profile *p = s->profile;
+   unsigned int pc = s->pc, op = opcode >> 26, func = opcode & 0x3f;
+   unsigned int *count;
+   int i;
+
+   if(p->delay && --p->delay == 0)
+   {
+      //The branch delay slot has executed
+      if(p->target)
+      {
+         p->node = profile_child(p->node, symbol_find(s, pc));
+         ++p->node->calls;
+         ++p->depth;
+      }
+      else
+      {
+         //Unwind to the frame that returns to pc
+         for(i = p->depth - 1; i >= 0 && i >= p->depth - PROFILE_DEPTH; --i)
+         {
+            if(i < PROFILE_DEPTH && p->returnAddress[i] == pc)
+               break;
+         }
+         if(i >= 0)
+         {
+            for(; p->depth > i && p->node->parent; --p->depth)
+               p->node = p->node->parent;
+         }
+      }
+   }
+
+   count = p->count[pc >> REGION_SHIFT];
+   if(count == NULL)
+   {
+      count = (unsigned int*)calloc((1 << REGION_SHIFT) >> 2, sizeof(unsigned int));
+      p->count[pc >> REGION_SHIFT] = count;
+   }
+   ++count[(pc & REGION_MASK) >> 2];
+   ++p->node->self;
+   ++p->total;
+
+   if(op == 3 || (op == 0 && func == 9) || (op == 1 && (opcode >> 16 & 0x1f) == 0x11 &&
+      (opcode >> 21 & 0x1f) == 0))
+   {
+      //JAL, JALR or BAL
+      if(p->depth < PROFILE_DEPTH)
+         p->returnAddress[p->depth] = pc + 8;
+      p->target = 1;
+      p->delay = 2;
+   }
+   else if(op == 0 && func == 8 && (opcode >> 21 & 0x1f) == 31)
+   {
+      p->target = 0;
+      p->delay = 2;                  //JR $ra
+   }
+}
+
+#ifndef PLASMA_LIBRARY
+static const char *profile_name(State *s, int symbol)
+{
+   return symbol >= 0 ? s->symbol[symbol].name : "?";
+}
+
+static long long profile_total(ProfileNode *node)
+{
+   ProfileNode *child;
+   long long total = node->self;
+   for(child = node->child; child; child = child->next)
+      total += profile_total(child);
+   return total;
+}
+
+//Write "caller;callee count" lines
+static void profile_fold(State *s, FILE *out, ProfileNode *node, char *stack, int length)
+{
+   ProfileNode *child;
+   int added = 0;
+
+   if(node->parent)
+   {
+      added = snprintf(stack + length, 4096 - length, "%s%s", 
+         length ? ";" : "", profile_name(s, node->symbol));
+      if(length + added >= 4096)
+         added = 4095 - length;
+   }
+   if(node->self)
+      fprintf(out, "%s %lld\n", length + added ? stack : "?", node->self);
+   for(child = node->child; child; child = child->next)
+      profile_fold(s, out, child, stack, length + added);
+   stack[length] = 0;
+}
+
+typedef struct {
+   int caller, callee;
+   long long calls, total;
+} ProfileEdge;
+
+static void profile_edges(ProfileNode *node, ProfileEdge **edge, int *count, int *size)
+{
+   ProfileNode *child;
+   int i;
+
+   for(child = node->child; child; child = child->next)
+   {
+      for(i = 0; i < *count; ++i)
+      {
+         if((*edge)[i].caller == node->symbol && (*edge)[i].callee == child->symbol)
+            break;
+      }
+      if(i == *count)
+      {
+         if(*count >= *size)
+         {
+            *size = *size * 2 + 64;
+            *edge = (ProfileEdge*)realloc(*edge, *size * sizeof(ProfileEdge));
+         }
+         (*edge)[i].caller = node->symbol;
+         (*edge)[i].callee = child->symbol;
+         (*edge)[i].calls = 0;
+         (*edge)[i].total = 0;
+         ++*count;
+      }
+      (*edge)[i].calls += child->calls;
+      (*edge)[i].total += profile_total(child);
+      profile_edges(child, edge, count, size);
+   }
+}
+
+static long long *profileSort;
+
+static int profile_compare(const void *a, const void *b)
+{
+   long long x = profileSort[*(const int*)a], y = profileSort[*(const int*)b];
+   return x < y ? 1 : x > y ? -1 : 0;
+}
+
+static void profile_report(State *s)
+{
+   Profile *p = s->profile;
+   FILE *out;
+   long long *self, cumulative=0;
+   int *order, i, j, count, symbols=s->symbolCount + 1, edges=0, size=0;
+   unsigned int pc;
+   ProfileEdge *edge=NULL;
+   char *stack;
+
+   if(p->folded)
+   {
+      out = fopen(p->folded, "w");
+      if(out)
+      {
+         stack = (char*)calloc(4096, 1);
+         profile_fold(s, out, &p->root, stack, 0);
+         free(stack);
+         fclose(out);
+      }
+   }
+   if(p->filename == NULL || (out = fopen(p->filename, "w")) == NULL)
+      return;
+
+   //Flat profile by symbol, the last entry is for unknown PCs
+   self = (long long*)calloc(symbols, sizeof(long long));
+   order = (int*)malloc(symbols * sizeof(int));
+   for(i = 0; i < REGION_COUNT; ++i)
+   {
+      if(p->count[i] == NULL)
+         continue;
+      for(j = 0; j < (1 << REGION_SHIFT) >> 2; ++j)
+      {
+         if(p->count[i][j] == 0)
+            continue;
+         pc = (i << REGION_SHIFT) + (j << 2);
+         count = symbol_find(s, pc);
+         self[count >= 0 ? count : symbols - 1] += p->count[i][j];
+      }
+   }
+   for(i = 0; i < symbols; ++i)
+      order[i] = i;
+   profileSort = self;
+   qsort(order, symbols, sizeof(int), profile_compare);
+   fprintf(out, "Flat profile: %lld opcodes\n", p->total);
+   fprintf(out, "    %%   cumulative         self  function\n");
+   for(i = 0; i < symbols && self[order[i]]; ++i)
+   {
+      cumulative += self[order[i]];
+      fprintf(out, "%6.2f %12lld %12lld  %s\n", 100.0 * self[order[i]] / p->total,
+         cumulative, self[order[i]], 
+         order[i] < s->symbolCount ? s->symbol[order[i]].name : "?");
+   }
+
+   //Call graph edges by inclusive opcodes
+   profile_edges(&p->root, &edge, &edges, &size);
+   fprintf(out, "\nCall graph:\n");
+   fprintf(out, "       calls    inclusive  caller -> callee\n");
+   for(i = 0; i < edges; ++i)
+   {
+      for(j = i + 1; j < edges; ++j)
+      {
+         if(edge[j].total > edge[i].total)
+         {
+            ProfileEdge temp = edge[i];
+            edge[i] = edge[j];
+            edge[j] = temp;
+         }
+      }
+      if(edge[i].caller < 0 && edge[i].calls == 0)
+         continue;
+      fprintf(out, "%12lld %12lld  %s -> %s\n", edge[i].calls, edge[i].total,
+         profile_name(s, edge[i].caller), profile_name(s, edge[i].callee));
+   }
+
+   //Hottest opcodes
+   fprintf(out, "\nHot opcodes:\n");
+   for(count = 0; count < 20; ++count)
+   {
+      unsigned int best=0, bestPc=0;
+      for(i = 0; i < REGION_COUNT; ++i)
+      {
+         if(p->count[i] == NULL)
+            continue;
+         for(j = 0; j < (1 << REGION_SHIFT) >> 2; ++j)
+         {
+            if(p->count[i][j] > best)
+            {
+               best = p->count[i][j];
+               bestPc = (i << REGION_SHIFT) + (j << 2);
+            }
+         }
+      }
+      if(best == 0)
+         break;
+      j = symbol_find(s, bestPc);
+      fprintf(out, "%12u  0x%8.8x %s+0x%x\n", best, bestPc, profile_name(s, j),
+         j >= 0 ? bestPc - s->symbol[j].address : bestPc);
+      p->count[bestPc >> REGION_SHIFT][(bestPc & REGION_MASK) >> 2] = 0;
+   }
+   fclose(out);
+   free(edge);
+   free(order);
+   free(self);
+}
+#endif
+
+/************* Binary trace *************/
+//Writes the format in tracebin.h.  A record is finished when the next 
+//opcode starts so register changes can be found by comparing against 
+//a copy of the registers.
+#define TRACE_BUFFER_SIZE (1024*1024)
+
+struct Trace_s {
+   FILE *file;
+   unsigned char *buffer[2];
+   int current, length;
+   unsigned int pc, opcode, address, value;
+   int tag;                      //of the unfinished record
+   int pending;                  //a record is unfinished
+   unsigned int lastPc, lastAddress;
+   unsigned int r[TRACE_REGISTERS];
+   unsigned int opcodePc[TRACE_OPCODE_CACHE];
+   unsigned int opcodeValue[TRACE_OPCODE_CACHE];
+   long long count;
+#ifdef ENABLE_THREADS
+   pthread_t thread;
+   pthread_mutex_t lock;
+   pthread_cond_t cond;
+   int full;                     //buffer index waiting to be written or -1
+   int fullLength;
+   int done;
+#endif
+};
+
+#if defined(ENABLE_THREADS) && !defined(PLASMA_LIBRARY)
+static void *trace_thread(void *arg)
+{
+   Trace *t = (Trace*)arg;
+
+   pthread_mutex_lock(&t->lock);
+   for(;;)
+   {
+      while(t->full < 0 && t->done == 0)
+         pthread_cond_wait(&t->cond, &t->lock);
+      if(t->full < 0)
+         break;
+      pthread_mutex_unlock(&t->lock);
+      fwrite(t->buffer[t->full], 1, t->fullLength, t->file);
+      pthread_mutex_lock(&t->lock);
+      t->full = -1;
+      pthread_cond_signal(&t->cond);
+   }
+   pthread_mutex_unlock(&t->lock);
+   return NULL;
+}
+#endif
+
+//Hand the current buffer to the writer
+static void trace_flush(Trace *t)
+{
+#ifdef ENABLE_THREADS
+   pthread_mutex_lock(&t->lock);
+   while(t->full >= 0)
+      pthread_cond_wait(&t->cond, &t->lock);
+   t->full = t->current;
+   t->fullLength = t->length;
+   pthread_cond_signal(&t->cond);
+   pthread_mutex_unlock(&t->lock);
+   t->current ^= 1;
+#else
+   fwrite(t->buffer[t->current], 1, t->length, t->file);
+#endif
+   t->length = 0;
+}
+
+static void trace_varint(unsigned char **ptr, unsigned int value)
+{
+   while(value >= 0x80)
+   {
+      *(*ptr)++ = (unsigned char)(value | 0x80);
+      value >>= 7;
+   }
+   *(*ptr)++ = (unsigned char)value;
+}
+
+static void trace_word(unsigned char **ptr, unsigned int value)
+{
+   (*ptr)[0] = (unsigned char)value;
+   (*ptr)[1] = (unsigned char)(value >> 8);
+   (*ptr)[2] = (unsigned char)(value >> 16);
+   (*ptr)[3] = (unsigned char)(value >> 24);
+   *ptr += 4;
+}
+
+#ifndef PLASMA_LIBRARY
+static Trace *trace_create(State *s, const char *filename)
+{
+   Trace *t;
+   unsigned char header[TRACE_HEADER_SIZE], *ptr=header;
+
+   t = (Trace*)calloc(1, sizeof(Trace));
+   t->file = fopen(filename, "wb");
+   if(t->file == NULL)
+   {
+      free(t);
+      return NULL;
+   }
+   t->buffer[0] = (unsigned char*)malloc(TRACE_BUFFER_SIZE);
+   t->buffer[1] = (unsigned char*)malloc(TRACE_BUFFER_SIZE);
+   memset(t->opcodePc, 0xff, sizeof(t->opcodePc));
+   memcpy(ptr, TRACE_MAGIC, 4);
+   ptr[4] = TRACE_VERSION;
+   ptr[5] = s->big_endian ? TRACE_BIG_ENDIAN : 0;
+   ptr[6] = ptr[7] = 0;
+   ptr += 8;
+   trace_word(&ptr, s->pc);
+   fwrite(header, 1, TRACE_HEADER_SIZE, t->file);
+   t->lastPc = s->pc - 4;
+   memcpy(t->r, s->r, 32 * sizeof(int));
+   t->r[32] = s->hi;
+   t->r[33] = s->lo;
+#ifdef ENABLE_THREADS
+   pthread_mutex_init(&t->lock, NULL);
+   pthread_cond_init(&t->cond, NULL);
+   t->full = -1;
+   pthread_create(&t->thread, NULL, trace_thread, t);
+#endif
+   return t;
+}
+#endif
+
+//Write the unfinished record now that its register changes are known
+static void trace_finish(State *s, Trace *t)
+{
+   unsigned char *ptr, *start, *count=NULL;
+   unsigned int value;
+   int i, changed=0;
+
+   if(t->pending == 0)
+      return;
+   if(t->length + 16 + TRACE_REGISTERS * 6 > TRACE_BUFFER_SIZE)
+      trace_flush(t);
+   start = ptr = t->buffer[t->current] + t->length;
+   ++ptr;
+   if(t->tag & TRACE_PC)
+      trace_varint(&ptr, TRACE_ZIGZAG((int)(t->pc - t->lastPc - 4) >> 2));
+   if(t->tag & TRACE_OPCODE)
+      trace_word(&ptr, t->opcode);
+   for(i = 0; i < TRACE_REGISTERS; ++i)
+   {
+      value = i < 32 ? (unsigned int)s->r[i] : i == 32 ? s->hi : s->lo;
+      if(value == t->r[i] || i == 0)
+         continue;
+      if(changed++ == 0)
+         count = ptr++;
+      *ptr++ = (unsigned char)i;
+      trace_varint(&ptr, value);
+      t->r[i] = value;
+   }
+   if(changed)
+   {
+      *count = (unsigned char)changed;
+      t->tag |= TRACE_REG;
+   }
+   if(t->tag & TRACE_MEM)
+      trace_varint(&ptr, TRACE_ZIGZAG(t->address - t->lastAddress));
+   if(t->tag & TRACE_STORE)
+      trace_varint(&ptr, t->value);
+   *start = (unsigned char)t->tag;
+   t->length = (int)(ptr - t->buffer[t->current]);
+   t->lastPc = t->pc;
+   if(t->tag & TRACE_MEM)
+      t->lastAddress = t->address;
+   t->pending = 0;
+   ++t->count;
+}
+
+//Called before each opcode executes
+static void trace_opcode(State *s, unsigned int opcode, unsigned int ptr)
+{
+   Trace *t = s->trace;
+   int index = TRACE_OPCODE_INDEX(s->pc), access;
+
+   trace_finish(s, t);
+   t->pc = s->pc;
+   t->pending = 1;
+   t->tag = t->pc != t->lastPc + 4 ? TRACE_PC : 0;
+   if(s->skip)
+   {
+      t->tag |= TRACE_SKIP;
+      return;
+   }
+   if(t->opcodePc[index] != (unsigned int)s->pc || t->opcodeValue[index] != opcode)
+   {
+      t->opcodePc[index] = s->pc;
+      t->opcodeValue[index] = opcode;
+      t->opcode = opcode;
+      t->tag |= TRACE_OPCODE;
+   }
+   access = opcode_access(opcode);
+   if(access)
+   {
+      t->tag |= TRACE_MEM;
+      t->address = ptr;
+      if((access & ACCESS_WRITE) && ((opcode >> 26) != 0x38 || mem_sc_check(s, ptr)))
+      {
+         t->tag |= TRACE_STORE;
+         t->value = s->r[(opcode >> 16) & 0x1f];
+      }
+   }
+}
+
+#ifndef PLASMA_LIBRARY
+static void trace_close(State *s)
+{
+   Trace *t = s->trace;
+
+   trace_finish(s, t);
+   t->buffer[t->current][t->length++] = TRACE_END;
+   trace_flush(t);
+#ifdef ENABLE_THREADS
+   pthread_mutex_lock(&t->lock);
+   while(t->full >= 0)
+      pthread_cond_wait(&t->cond, &t->lock);
+   t->done = 1;
+   pthread_cond_signal(&t->cond);
+   pthread_mutex_unlock(&t->lock);
+   pthread_join(t->thread, NULL);
+#endif
+   fclose(t->file);
+   if(s->batch == 0)
+      printf("Wrote %lld trace records\n", t->count);
+}
+#endif
+
+//Called by cycle() for each opcode while s->instrument is set
+static void instrument_opcode(State *s, unsigned int opcode, unsigned int ptr)
+{
+   int access;
+
+   if(s->timing)
+      timing_opcode(s, opcode, ptr);
+   if(s->profile)
+      profile_opcode(s, opcode);
+   if(s->trace)
+      trace_opcode(s, opcode, ptr);
+   if(s->icache)
+      cache_model_count(s, s->icache, s->pc, s->pc, 0);
+   if(s->dcache)
+   {
+      access = opcode_access(opcode);
+      if(access)
+         cache_model_count(s, s->dcache, s->pc, ptr & ~3, access & ACCESS_WRITE);
+   }
+}
+
+#ifndef PLASMA_LIBRARY
+static void instrument_report(State *s)
+{
+   FILE *out = s->batch ? stderr : stdout;
+
+   if(s->timing)
+      timing_report(s);
+   if(s->profile)
+      profile_report(s);
+   if(s->trace)
+      trace_close(s);
+   if(s->icache)
+      cache_model_report(s, s->icache, out);
+   if(s->dcache && s->dcache != s->icache)
+      cache_model_report(s, s->dcache, out);
+}
+#endif
+
+#ifdef ENABLE_PREDECODE
+/************* Predecoded instruction cache *************/
+//Each opcode is decoded once into m->decodeTable[] and afterwards 
+//executed by calling its handler.  Handlers run after the PC has 
+//been advanced so they match the behavior of cycle().
+#define OPFUNC(NAME, CODE) \
+static void NAME(State *s, const Decode *d) \
+{ int *r=s->r; unsigned int *u=(unsigned int*)s->r; \
+  unsigned int ptr=d->imm+r[d->rs]; (void)u; (void)ptr; CODE; }
+
+OPFUNC(op_sll,    r[d->rd]=r[d->rt]<<d->re)
+OPFUNC(op_srl,    r[d->rd]=u[d->rt]>>d->re)
+OPFUNC(op_sra,    r[d->rd]=r[d->rt]>>d->re)
+OPFUNC(op_sllv,   r[d->rd]=r[d->rt]<<r[d->rs])
+OPFUNC(op_srlv,   r[d->rd]=u[d->rt]>>r[d->rs])
+OPFUNC(op_srav,   r[d->rd]=r[d->rt]>>r[d->rs])
+OPFUNC(op_jr,     s->pc_next=r[d->rs])
+OPFUNC(op_jalr,   r[d->rd]=s->pc_next; s->pc_next=r[d->rs])
+OPFUNC(op_movz,   if(!r[d->rt]) r[d->rd]=r[d->rs])
+OPFUNC(op_movn,   if(r[d->rt]) r[d->rd]=r[d->rs])
+OPFUNC(op_syscall,s->exceptionId=1)
+OPFUNC(op_break,  s->exceptionId=1; 
+                  if(s->breakExit) { s->exitCode=((d->rs<<5)|d->rt)&0xff; s->wakeup=1; })
+OPFUNC(op_sync,   s->wakeup=1)
+OPFUNC(op_mfhi,   r[d->rd]=s->hi)
+OPFUNC(op_mthi,   s->hi=r[d->rs])
+OPFUNC(op_mflo,   r[d->rd]=s->lo)
+OPFUNC(op_mtlo,   s->lo=r[d->rs])
+OPFUNC(op_mult,   mult_big_signed(r[d->rs],r[d->rt],&s->hi,&s->lo))
+OPFUNC(op_multu,  mult_big(r[d->rs],r[d->rt],&s->hi,&s->lo))
+OPFUNC(op_div,    s->lo=r[d->rs]/r[d->rt]; s->hi=r[d->rs]%r[d->rt])
+OPFUNC(op_divu,   s->lo=u[d->rs]/u[d->rt]; s->hi=u[d->rs]%u[d->rt])
+OPFUNC(op_addu,   r[d->rd]=r[d->rs]+r[d->rt])
+OPFUNC(op_subu,   r[d->rd]=r[d->rs]-r[d->rt])
+OPFUNC(op_and,    r[d->rd]=r[d->rs]&r[d->rt])
+OPFUNC(op_or,     r[d->rd]=r[d->rs]|r[d->rt])
+OPFUNC(op_xor,    r[d->rd]=r[d->rs]^r[d->rt])
+OPFUNC(op_nor,    r[d->rd]=~(r[d->rs]|r[d->rt]))
+OPFUNC(op_slt,    r[d->rd]=r[d->rs]<r[d->rt])
+OPFUNC(op_sltu,   r[d->rd]=u[d->rs]<u[d->rt])
+OPFUNC(op_daddu,  r[d->rd]=r[d->rs]+u[d->rt])
+OPFUNC(op_nop,    ;)
+OPFUNC(op_bltzal, r[31]=s->pc_next; if(r[d->rs]<0) s->pc_next+=d->imm)
+OPFUNC(op_bltz,   if(r[d->rs]<0) s->pc_next+=d->imm)
+OPFUNC(op_bgezal, r[31]=s->pc_next; if(r[d->rs]>=0) s->pc_next+=d->imm)
+OPFUNC(op_bgez,   if(r[d->rs]>=0) s->pc_next+=d->imm)
+OPFUNC(op_bltzall,r[31]=s->pc_next; if(r[d->rs]<0) s->pc_next+=d->imm; else s->skip=1)
+OPFUNC(op_bltzl,  if(r[d->rs]<0) s->pc_next+=d->imm; else s->skip=1)
+OPFUNC(op_bgezall,r[31]=s->pc_next; if(r[d->rs]>=0) s->pc_next+=d->imm; else s->skip=1)
+OPFUNC(op_bgezl,  if(r[d->rs]>=0) s->pc_next+=d->imm; else s->skip=1)
+OPFUNC(op_jal,    r[31]=s->pc_next; s->pc_next=(s->pc&0xf0000000)|d->imm)
+OPFUNC(op_j,      s->pc_next=(s->pc&0xf0000000)|d->imm)
+OPFUNC(op_beq,    if(r[d->rs]==r[d->rt]) s->pc_next+=d->imm)
+OPFUNC(op_bne,    if(r[d->rs]!=r[d->rt]) s->pc_next+=d->imm)
+OPFUNC(op_blez,   if(r[d->rs]<=0) s->pc_next+=d->imm)
+OPFUNC(op_bgtz,   if(r[d->rs]>0) s->pc_next+=d->imm)
+OPFUNC(op_addiu,  r[d->rt]=r[d->rs]+d->imm)
+OPFUNC(op_slti,   r[d->rt]=r[d->rs]<d->imm)
+OPFUNC(op_sltiu,  r[d->rt]=u[d->rs]<(unsigned int)d->imm)
+OPFUNC(op_andi,   r[d->rt]=r[d->rs]&d->imm)
+OPFUNC(op_ori,    r[d->rt]=r[d->rs]|d->imm)
+OPFUNC(op_xori,   r[d->rt]=r[d->rs]^d->imm)
+OPFUNC(op_lui,    r[d->rt]=d->imm)
+OPFUNC(op_mfc0,   r[d->rt]=d->rd==12 ? s->status : s->epc)
+OPFUNC(op_mtc0,   s->status=r[d->rt]&1; 
+                  if(s->processId && (r[d->rt]&2)) s->userMode|=r[d->rt]&2)
+OPFUNC(op_beql,   if(r[d->rs]==r[d->rt]) s->pc_next+=d->imm; else s->skip=1)
+OPFUNC(op_bnel,   if(r[d->rs]!=r[d->rt]) s->pc_next+=d->imm; else s->skip=1)
+OPFUNC(op_blezl,  if(r[d->rs]<=0) s->pc_next+=d->imm; else s->skip=1)
+OPFUNC(op_bgtzl,  if(r[d->rs]>0) s->pc_next+=d->imm; else s->skip=1)
+OPFUNC(op_lb,     r[d->rt]=(signed char)mem_read(s,1,ptr))
+OPFUNC(op_lh,     r[d->rt]=(signed short)mem_read(s,2,ptr))
+OPFUNC(op_lw,     r[d->rt]=mem_read(s,4,ptr))
+OPFUNC(op_lbu,    r[d->rt]=(unsigned char)mem_read(s,1,ptr))
+OPFUNC(op_lhu,    r[d->rt]=(unsigned short)mem_read(s,2,ptr))
+OPFUNC(op_sb,     mem_write(s,1,ptr,r[d->rt]))
+OPFUNC(op_sh,     mem_write(s,2,ptr,r[d->rt]))
+OPFUNC(op_sw,     mem_write(s,4,ptr,r[d->rt]))
+OPFUNC(op_lwl,    r[d->rt]=mem_lwl(s,ptr,r[d->rt]))
+OPFUNC(op_lwr,    r[d->rt]=mem_lwr(s,ptr,r[d->rt]))
+OPFUNC(op_swl,    mem_swl(s,ptr,r[d->rt]))
+OPFUNC(op_swr,    mem_swr(s,ptr,r[d->rt]))
+OPFUNC(op_ll,     r[d->rt]=mem_ll(s,ptr))
+OPFUNC(op_sc,     r[d->rt]=mem_sc(s,ptr,r[d->rt]))
+OPFUNC(op_error,  printf("ERROR2 address=0x%x opcode=0x%x\n", s->pc, d->imm);
+                  s->wakeup=1)
+
+//Select the handler and extend the immediate value for an opcode
+static DecodeFunc decode_opcode(unsigned int opcode, int *imm)
+{
+   unsigned int op, rt, func;
+
+   op = (opcode >> 26) & 0x3f;
+   rt = (opcode >> 16) & 0x1f;
+   func = opcode & 0x3f;
+   *imm = (short)opcode;
+   switch(op) 
+   {
+      case 0x00:/*SPECIAL*/
+         switch(func) 
+         {
+            case 0x00:/*SLL*/  return op_sll;
+            case 0x02:/*SRL*/  return op_srl;
+            case 0x03:/*SRA*/  return op_sra;
+            case 0x04:/*SLLV*/ return op_sllv;
+            case 0x06:/*SRLV*/ return op_srlv;
+            case 0x07:/*SRAV*/ return op_srav;
+            case 0x08:/*JR*/   return op_jr;
+            case 0x09:/*JALR*/ return op_jalr;
+            case 0x0a:/*MOVZ*/ return op_movz;
+            case 0x0b:/*MOVN*/ return op_movn;
+            case 0x0c:/*SYSCALL*/ return op_syscall;
+            case 0x0d:/*BREAK*/   return op_break;
+            case 0x0f:/*SYNC*/ return op_sync;
+            case 0x10:/*MFHI*/ return op_mfhi;
+            case 0x11:/*MTHI*/ return op_mthi;
+            case 0x12:/*MFLO*/ return op_mflo;
+            case 0x13:/*MTLO*/ return op_mtlo;
+            case 0x18:/*MULT*/ return op_mult;
+            case 0x19:/*MULTU*/return op_multu;
+            case 0x1a:/*DIV*/  return op_div;
+            case 0x1b:/*DIVU*/ return op_divu;
+            case 0x20:/*ADD*/  return op_addu;
+            case 0x21:/*ADDU*/ return op_addu;
+            case 0x22:/*SUB*/  return op_subu;
+            case 0x23:/*SUBU*/ return op_subu;
+            case 0x24:/*AND*/  return op_and;
+            case 0x25:/*OR*/   return op_or;
+            case 0x26:/*XOR*/  return op_xor;
+            case 0x27:/*NOR*/  return op_nor;
+            case 0x2a:/*SLT*/  return op_slt;
+            case 0x2b:/*SLTU*/ return op_sltu;
+            case 0x2d:/*DADDU*/return op_daddu;
+            case 0x31:/*TGEU*/ 
+            case 0x32:/*TLT*/  
+            case 0x33:/*TLTU*/ 
+            case 0x34:/*TEQ*/  
+            case 0x36:/*TNE*/  return op_nop;
+         }
+         return NULL;
+      case 0x01:/*REGIMM*/
+         *imm = (*imm << 2) - 4;
+         switch(rt) 
+         {
+            case 0x10:/*BLTZAL*/ return op_bltzal;
+            case 0x00:/*BLTZ*/   return op_bltz;
+            case 0x11:/*BGEZAL*/ return op_bgezal;
+            case 0x01:/*BGEZ*/   return op_bgez;
+            case 0x12:/*BLTZALL*/return op_bltzall;
+            case 0x02:/*BLTZL*/  return op_bltzl;
+            case 0x13:/*BGEZALL*/return op_bgezall;
+            case 0x03:/*BGEZL*/  return op_bgezl;
+         }
+         return NULL;
+      case 0x02:/*J*/      *imm = (opcode << 6) >> 4; return op_j;
+      case 0x03:/*JAL*/    *imm = (opcode << 6) >> 4; return op_jal;
+      case 0x04:/*BEQ*/    *imm = (*imm << 2) - 4; return op_beq;
+      case 0x05:/*BNE*/    *imm = (*imm << 2) - 4; return op_bne;
+      case 0x06:/*BLEZ*/   *imm = (*imm << 2) - 4; return op_blez;
+      case 0x07:/*BGTZ*/   *imm = (*imm << 2) - 4; return op_bgtz;
+      case 0x08:/*ADDI*/   return op_addiu;
+      case 0x09:/*ADDIU*/  return op_addiu;
+      case 0x0a:/*SLTI*/   return op_slti;
+      case 0x0b:/*SLTIU*/  return op_sltiu;
+      case 0x0c:/*ANDI*/   *imm = opcode & 0xffff; return op_andi;
+      case 0x0d:/*ORI*/    *imm = opcode & 0xffff; return op_ori;
+      case 0x0e:/*XORI*/   *imm = opcode & 0xffff; return op_xori;
+      case 0x0f:/*LUI*/    *imm = opcode << 16; return op_lui;
+      case 0x10:/*COP0*/   return (opcode & (1<<23)) ? op_mtc0 : op_mfc0;
+      case 0x14:/*BEQL*/   *imm = (*imm << 2) - 4; return op_beql;
+      case 0x15:/*BNEL*/   *imm = (*imm << 2) - 4; return op_bnel;
+      case 0x16:/*BLEZL*/  *imm = (*imm << 2) - 4; return op_blezl;
+      case 0x17:/*BGTZL*/  *imm = (*imm << 2) - 4; return op_bgtzl;
+      case 0x20:/*LB*/     return op_lb;
+      case 0x21:/*LH*/     return op_lh;
+      case 0x22:/*LWL*/    return op_lwl;
+      case 0x23:/*LW*/     return op_lw;
+      case 0x24:/*LBU*/    return op_lbu;
+      case 0x25:/*LHU*/    return op_lhu;
+      case 0x26:/*LWR*/    return op_lwr;
+      case 0x28:/*SB*/     return op_sb;
+      case 0x29:/*SH*/     return op_sh;
+      case 0x2a:/*SWL*/    return op_swl;
+      case 0x2b:/*SW*/     return op_sw;
+      case 0x2e:/*SWR*/    return op_swr;
+      case 0x2f:/*CACHE*/  return op_nop;
+      case 0x30:/*LL*/     return op_ll;
+      case 0x38:/*SC*/     return op_sc;
+   }
+   return NULL;
+}
+
+//Same as cycle(s, 0) but fetches the opcode from m->decodeTable[]
+static void cycle_decoded(State *s)
+{
+   Decode *d;
+   unsigned int opcode, epc, rSave;
+
+   d = &s->m->decodeTable[DECODE_INDEX(s->pc)];
+   if(d->tag != ((unsigned int)s->pc | 1))
+   {
+      opcode = mem_read(s, 4, s->pc);
+      d->func = decode_opcode(opcode, &d->imm);
+      d->rs = (opcode >> 21) & 0x1f;
+      d->rt = (opcode >> 16) & 0x1f;
+      d->rd = (opcode >> 11) & 0x1f;
+      d->re = (opcode >> 6) & 0x1f;
+      d->tag = s->exceptionId ? 0 : s->pc | 1;
+      if(d->func == NULL)
+      {
+         d->func = op_error;
+         d->imm = opcode;
+      }
+   }
+   s->r[0] = 0;
+   epc = s->pc + 4;
+   if(s->pc_next != s->pc + 4)
+      epc |= 2;  //branch delay slot
+   s->pc = s->pc_next;
+   s->pc_next = s->pc_next + 4;
+   if(s->skip) 
+   {
+      s->skip = 0;
+      return;
+   }
+   rSave = s->r[d->rt];
+   d->func(s, d);
+   s->pc_next &= ~3;
+
+   if(s->exceptionId)
+   {
+      if(d->func == op_syscall || d->func == op_break)
+         epc |= 1;
+      s->r[d->rt] = rSave;
+      s->epc = epc; 
+      s->llAddress = 0;
+      s->pc_next = 0x3c;
+      s->skip = 1; 
+      s->exceptionId = 0;
+      s->userMode = 0;
+      s->status = 0;     //writing EPC disables interrupts
+   }
+}
+#endif  //ENABLE_PREDECODE
+
+//execute one cycle of a Plasma CPU
+static void cycle(State *s, int show_mode)
+{
+   unsigned int opcode;
+   unsigned int op, rs, rt, rd, re, func, imm, target;
+   int imm_shift, branch=0, lbranch=2, skip2=0;
+   int *r=s->r;
+   unsigned int *u=(unsigned int*)s->r;
+   unsigned int ptr, epc, rSave;
+
+#ifdef ENABLE_PREDECODE
+   if(show_mode == 0 && (s->processId == 0 || s->userMode == 0) && 
+      s->instrument == 0 && s->m->threads == 0)
+   {
+      cycle_decoded(s);
+      return;
+   }
+#endif
+   opcode = mem_read(s, 4, s->pc);
+   op = (opcode >> 26) & 0x3f;
+   rs = (opcode >> 21) & 0x1f;
+   rt = (opcode >> 16) & 0x1f;
+   rd = (opcode >> 11) & 0x1f;
+   re = (opcode >> 6) & 0x1f;
+   func = opcode & 0x3f;
+   imm = opcode & 0xffff;
+   imm_shift = (((int)(short)imm) << 2) - 4;
+   target = (opcode << 6) >> 4;
+   ptr = (short)imm + r[rs];
+   r[0] = 0;
+   if(show_mode) 
+   {
+      printf("%8.8x %8.8x ", s->pc, opcode);
+      if(op == 0) 
+         printf("%8s ", special_string[func]);
+      else if(op == 1) 
+         printf("%8s ", regimm_string[rt]);
+      else 
+         printf("%8s ", opcode_string[op]);
+      printf("$%2.2d $%2.2d $%2.2d $%2.2d ", rs, rt, rd, re);
+      printf("%4.4x", imm);
+      if(show_mode == 1)
+         printf(" r[%2.2d]=%8.8x r[%2.2d]=%8.8x", rs, r[rs], rt, r[rt]);
+      printf("\n");
+   }
+   if(show_mode > 5) 
+      return;
+   if(s->instrument)
+      instrument_opcode(s, s->skip ? 0 : opcode, ptr);  //skipped is a NOP
+   epc = s->pc + 4;
+   if(s->pc_next != s->pc + 4)
+      epc |= 2;  //branch delay slot
+   s->pc = s->pc_next;
+   s->pc_next = s->pc_next + 4;
+   if(s->skip) 
+   {
+      s->skip = 0;
+      return;
+   }
+   rSave = r[rt];
+   switch(op) 
+   {
+      case 0x00:/*SPECIAL*/
+         switch(func) 
+         {
+            case 0x00:/*SLL*/  r[rd]=r[rt]<<re;          break;
+            case 0x02:/*SRL*/  r[rd]=u[rt]>>re;          break;
+            case 0x03:/*SRA*/  r[rd]=r[rt]>>re;          break;
+            case 0x04:/*SLLV*/ r[rd]=r[rt]<<r[rs];       break;
+            case 0x06:/*SRLV*/ r[rd]=u[rt]>>r[rs];       break;
+            case 0x07:/*SRAV*/ r[rd]=r[rt]>>r[rs];       break;
+            case 0x08:/*JR*/   s->pc_next=r[rs];         break;
+            case 0x09:/*JALR*/ r[rd]=s->pc_next; s->pc_next=r[rs]; break;
+            case 0x0a:/*MOVZ*/ if(!r[rt]) r[rd]=r[rs];   break;  /*IV*/
+            case 0x0b:/*MOVN*/ if(r[rt]) r[rd]=r[rs];    break;  /*IV*/
+            case 0x0c:/*SYSCALL*/ epc|=1; s->exceptionId=1; break;
+            case 0x0d:/*BREAK*/   epc|=1; s->exceptionId=1; 
+               if(s->breakExit) { s->exitCode=(opcode>>16)&0xff; s->wakeup=1; } break;
+            case 0x0f:/*SYNC*/ s->wakeup=1;              break;
+            case 0x10:/*MFHI*/ r[rd]=s->hi;              break;
+            case 0x11:/*FTHI*/ s->hi=r[rs];              break;
+            case 0x12:/*MFLO*/ r[rd]=s->lo;              break;
+            case 0x13:/*MTLO*/ s->lo=r[rs];              break;
+            case 0x18:/*MULT*/ mult_big_signed(r[rs],r[rt],&s->hi,&s->lo); break;
+            case 0x19:/*MULTU*/ mult_big(r[rs],r[rt],&s->hi,&s->lo); break;
+            case 0x1a:/*DIV*/  s->lo=r[rs]/r[rt]; s->hi=r[rs]%r[rt]; break;
+            case 0x1b:/*DIVU*/ s->lo=u[rs]/u[rt]; s->hi=u[rs]%u[rt]; break;
+            case 0x20:/*ADD*/  r[rd]=r[rs]+r[rt];        break;
+            case 0x21:/*ADDU*/ r[rd]=r[rs]+r[rt];        break;
+            case 0x22:/*SUB*/  r[rd]=r[rs]-r[rt];        break;
+            case 0x23:/*SUBU*/ r[rd]=r[rs]-r[rt];        break;
+            case 0x24:/*AND*/  r[rd]=r[rs]&r[rt];        break;
+            case 0x25:/*OR*/   r[rd]=r[rs]|r[rt];        break;
+            case 0x26:/*XOR*/  r[rd]=r[rs]^r[rt];        break;
+            case 0x27:/*NOR*/  r[rd]=~(r[rs]|r[rt]);     break;
+            case 0x2a:/*SLT*/  r[rd]=r[rs]<r[rt];        break;
+            case 0x2b:/*SLTU*/ r[rd]=u[rs]<u[rt];        break;
+            case 0x2d:/*DADDU*/r[rd]=r[rs]+u[rt];        break;
+            case 0x31:/*TGEU*/ break;
+            case 0x32:/*TLT*/  break;
+            case 0x33:/*TLTU*/ break;
+            case 0x34:/*TEQ*/  break;
+            case 0x36:/*TNE*/  break;
+            default: printf("ERROR0(*0x%x~0x%x)\n", s->pc, opcode);
+               s->wakeup=1;
+         }
+         break;
+      case 0x01:/*REGIMM*/
+         switch(rt) {
+            case 0x10:/*BLTZAL*/ r[31]=s->pc_next;
+            case 0x00:/*BLTZ*/   branch=r[rs]<0;    break;
+            case 0x11:/*BGEZAL*/ r[31]=s->pc_next;
+            case 0x01:/*BGEZ*/   branch=r[rs]>=0;   break;
+            case 0x12:/*BLTZALL*/r[31]=s->pc_next;
+            case 0x02:/*BLTZL*/  lbranch=r[rs]<0;   break;
+            case 0x13:/*BGEZALL*/r[31]=s->pc_next;
+            case 0x03:/*BGEZL*/  lbranch=r[rs]>=0;  break;
+            default: printf("ERROR1\n"); s->wakeup=1;
+          }
+         break;
+      case 0x03:/*JAL*/    r[31]=s->pc_next;
+      case 0x02:/*J*/      s->pc_next=(s->pc&0xf0000000)|target; break;
+      case 0x04:/*BEQ*/    branch=r[rs]==r[rt];     break;
+      case 0x05:/*BNE*/    branch=r[rs]!=r[rt];     break;
+      case 0x06:/*BLEZ*/   branch=r[rs]<=0;         break;
+      case 0x07:/*BGTZ*/   branch=r[rs]>0;          break;
+      case 0x08:/*ADDI*/   r[rt]=r[rs]+(short)imm;  break;
+      case 0x09:/*ADDIU*/  u[rt]=u[rs]+(short)imm;  break;
+      case 0x0a:/*SLTI*/   r[rt]=r[rs]<(short)imm;  break;
+      case 0x0b:/*SLTIU*/  u[rt]=u[rs]<(unsigned int)(short)imm; break;
+      case 0x0c:/*ANDI*/   r[rt]=r[rs]&imm;         break;
+      case 0x0d:/*ORI*/    r[rt]=r[rs]|imm;         break;
+      case 0x0e:/*XORI*/   r[rt]=r[rs]^imm;         break;
+      case 0x0f:/*LUI*/    r[rt]=(imm<<16);         break;
+      case 0x10:/*COP0*/
+         if((opcode & (1<<23)) == 0)  //move from CP0
+         {
+            if(rd == 12)
+               r[rt]=s->status;
+            else
+               r[rt]=s->epc;
+         }
+         else                         //move to CP0
+         {
+            s->status=r[rt]&1;
+            if(s->processId && (r[rt]&2))
+            {
+               s->userMode|=r[rt]&2;
+               //printf("CpuStatus=%d %d %d\n", r[rt], s->status, s->userMode);
+               //s->wakeup = 1;
+               //printf("pc=0x%x\n", epc);
+            }
+         }
+         break;
+//      case 0x11:/*COP1*/ break;
+//      case 0x12:/*COP2*/ break;
+//      case 0x13:/*COP3*/ break;
+      case 0x14:/*BEQL*/   lbranch=r[rs]==r[rt];    break;
+      case 0x15:/*BNEL*/   lbranch=r[rs]!=r[rt];    break;
+      case 0x16:/*BLEZL*/  lbranch=r[rs]<=0;        break;
+      case 0x17:/*BGTZL*/  lbranch=r[rs]>0;         break;
+//      case 0x1c:/*MAD*/  break;   /*IV*/
+      case 0x20:/*LB*/   r[rt]=(signed char)mem_read(s,1,ptr);  break;
+      case 0x21:/*LH*/   r[rt]=(signed short)mem_read(s,2,ptr); break;
+      case 0x22:/*LWL*/  r[rt]=mem_lwl(s,ptr,r[rt]); break;
+      case 0x23:/*LW*/   r[rt]=mem_read(s,4,ptr);   break;
+      case 0x24:/*LBU*/  r[rt]=(unsigned char)mem_read(s,1,ptr); break;
+      case 0x25:/*LHU*/  r[rt]=(unsigned short)mem_read(s,2,ptr); break;
+      case 0x26:/*LWR*/  r[rt]=mem_lwr(s,ptr,r[rt]); break;
+      case 0x28:/*SB*/   mem_write(s,1,ptr,r[rt]);  break;
+      case 0x29:/*SH*/   mem_write(s,2,ptr,r[rt]);  break;
+      case 0x2a:/*SWL*/  mem_swl(s,ptr,r[rt]);      break;
+      case 0x2b:/*SW*/   mem_write(s,4,ptr,r[rt]);  break;
+      case 0x2e:/*SWR*/  mem_swr(s,ptr,r[rt]);      break;
+      case 0x2f:/*CACHE*/break;
+      case 0x30:/*LL*/   r[rt]=mem_ll(s,ptr);       break;
+//      case 0x31:/*LWC1*/ break;
+//      case 0x32:/*LWC2*/ break;
+//      case 0x33:/*LWC3*/ break;
+//      case 0x35:/*LDC1*/ break;
+//      case 0x36:/*LDC2*/ break;
+//      case 0x37:/*LDC3*/ break;
+      case 0x38:/*SC*/   r[rt]=mem_sc(s,ptr,r[rt]); break;
+//      case 0x39:/*SWC1*/ break;
+//      case 0x3a:/*SWC2*/ break;
+//      case 0x3b:/*SWC3*/ break;
+//      case 0x3d:/*SDC1*/ break;
+//      case 0x3e:/*SDC2*/ break;
+//      case 0x3f:/*SDC3*/ break;
+      default: printf("ERROR2 address=0x%x opcode=0x%x\n", s->pc, opcode); 
+         s->wakeup=1;
+   }
+   s->pc_next += (branch || lbranch == 1) ? imm_shift : 0;
+   s->pc_next &= ~3;
+   s->skip = (lbranch == 0) | skip2;
+
+   if(s->exceptionId)
+   {
+      r[rt] = rSave;
+      s->epc = epc; 
+      s->llAddress = 0;
+      s->pc_next = 0x3c;
+      s->skip = 1; 
+      s->exceptionId = 0;
+      s->userMode = 0;
+      s->status = 0;     //writing EPC disables interrupts
+      //s->wakeup = 1;
+      return;
+   }
+}
+
+#ifdef ENABLE_JIT
+/************* Basic block translator for x86-64 hosts *************/
+//Hot basic blocks (up to and including the branch delay slot) are 
+//translated into host code operating directly on State.  Opcodes 
+//that are not translated end the block and are executed by cycle().
+//Loads and stores to 0x2xxxxxxx (MMIO) leave the block before the 
+//access so cycle() performs it.
+#include <stddef.h>
+
+#define JIT_BLOCKS_LN2  14
+#define JIT_BLOCKS      (1 << JIT_BLOCKS_LN2)
+#define JIT_INDEX(A)    (((A) >> 2) & (JIT_BLOCKS-1))
+#define JIT_BLOCK_MAX   32                 //opcodes per block
+#define JIT_HOT         16                 //interpreted runs before translate
+#define JIT_CODE_SIZE   (1024*1024*16)
+#define JIT_OPCODE_MAX  96                 //host bytes per opcode
+
+typedef int (*JitFunc)(State *s);
+struct JitBlock_s {
+   unsigned int pc;       //first opcode
+   unsigned int end;      //last opcode
+   JitFunc func;          //NULL until translated
+   int count;             //times interpreted; -1 if can't translate
+};
+
+#define R_OFF(N)   (int)(offsetof(State, r) + (N) * 4)
+#define PC_OFF     (int)offsetof(State, pc)
+#define NEXT_OFF   (int)offsetof(State, pc_next)
+#define HI_OFF     (int)offsetof(State, hi)
+#define LO_OFF     (int)offsetof(State, lo)
+#define EAX 0
+#define ECX 1
+#define EDX 2
+#define ESI 6
+#define EDI 7
+
+static void emit1(Machine *m, int value) { *m->jitPtr++ = (unsigned char)value; }
+static void emit4(Machine *m, unsigned int value) { memcpy(m->jitPtr, &value, 4); m->jitPtr += 4; }
+
+static void emit_bytes(Machine *m, const char *bytes, int length)
+{
+   memcpy(m->jitPtr, bytes, length);
+   m->jitPtr += length;
+}
+
+//mov reg,[rbx+offset]
+static void emit_load(Machine *m, int reg, int offset)
+{
+   emit1(m, 0x8b); emit1(m, 0x80 | (reg << 3) | 3); emit4(m, offset);
+}
+
+//mov [rbx+offset],reg
+static void emit_store(Machine *m, int offset, int reg)
+{
+   emit1(m, 0x89); emit1(m, 0x80 | (reg << 3) | 3); emit4(m, offset);
+}
+
+//mov dword [rbx+offset],value
+static void emit_store_imm(Machine *m, int offset, unsigned int value)
+{
+   emit1(m, 0xc7); emit1(m, 0x83); emit4(m, offset); emit4(m, value);
+}
+
+//mov reg,value
+static void emit_mov_imm(Machine *m, int reg, unsigned int value)
+{
+   emit1(m, 0xb8 + reg); emit4(m, value);
+}
+
+//Store eax into a MIPS register; writes to $0 are dropped
+static void emit_store_reg(Machine *m, int rd)
+{
+   if(rd)
+      emit_store(m, R_OFF(rd), EAX);
+}
+
+//mov rdi,rbx; mov rax,func; call rax
+static void emit_call(Machine *m, void *func)
+{
+   size_t address = (size_t)func;
+   emit_bytes(m, "\x48\x89\xdf\x48\xb8", 5);
+   memcpy(m->jitPtr, &address, 8);
+   m->jitPtr += 8;
+   emit_bytes(m, "\xff\xd0", 2);
+}
+
+//Leave the block with 'count' opcodes executed
+static void emit_exit(Machine *m, unsigned int pc, int setNext, int count)
+{
+   emit_store_imm(m, PC_OFF, pc);
+   if(setNext)
+      emit_store_imm(m, NEXT_OFF, pc + 4);
+   emit_mov_imm(m, EAX, count);
+   emit_bytes(m, "\x5b\xc3", 2);          //pop rbx; ret
+}
+
+//esi = r[rs] + imm; leave the block if the address is MMIO
+static void emit_address(Machine *m, unsigned int opcode, unsigned int pc, int delay, int count)
+{
+   unsigned char *skip;
+   emit_load(m, ESI, R_OFF((opcode >> 21) & 0x1f));
+   emit_bytes(m, "\x81\xc6", 2); emit4(m, (short)opcode);  //add esi,imm
+   emit_bytes(m, "\x89\xf0\x2d", 3); emit4(m, 0x20000000); //mov eax,esi; sub eax
+   emit1(m, 0x3d); emit4(m, 0x10000000);                   //cmp eax
+   emit_bytes(m, "\x73", 1);                            //jae skip
+   skip = m->jitPtr++;
+   emit_exit(m, pc, !delay, count);
+   *skip = (unsigned char)(m->jitPtr - skip - 1);
+}
+
+static unsigned int jit_lb(State *s, unsigned int a) { return (signed char)mem_read(s,1,a); }
+static unsigned int jit_lh(State *s, unsigned int a) { return (signed short)mem_read(s,2,a); }
+static unsigned int jit_lw(State *s, unsigned int a) { return mem_read(s,4,a); }
+static unsigned int jit_lbu(State *s, unsigned int a) { return (unsigned char)mem_read(s,1,a); }
+static unsigned int jit_lhu(State *s, unsigned int a) { return (unsigned short)mem_read(s,2,a); }
+static void jit_sb(State *s, unsigned int a, unsigned int v) { mem_write(s,1,a,v); }
+static void jit_sh(State *s, unsigned int a, unsigned int v) { mem_write(s,2,a,v); }
+static void jit_sw(State *s, unsigned int a, unsigned int v) { mem_write(s,4,a,v); }
+static unsigned int jit_lwl(State *s, unsigned int a, unsigned int v) { return mem_lwl(s,a,v); }
+static unsigned int jit_lwr(State *s, unsigned int a, unsigned int v) { return mem_lwr(s,a,v); }
+static void jit_swl(State *s, unsigned int a, unsigned int v) { mem_swl(s,a,v); }
+static void jit_swr(State *s, unsigned int a, unsigned int v) { mem_swr(s,a,v); }
+static unsigned int jit_ll(State *s, unsigned int a) { return mem_ll(s,a); }
+static unsigned int jit_sc(State *s, unsigned int a, unsigned int v) { return mem_sc(s,a,v); }
+static void jit_mult(State *s, int a, int b) { mult_big_signed(a,b,&s->hi,&s->lo); }
+static void jit_multu(State *s, int a, int b) { mult_big(a,b,&s->hi,&s->lo); }
+static void jit_div(State *s, int a, int b) { s->lo=a/b; s->hi=a%b; }
+static void jit_divu(State *s, unsigned int a, unsigned int b) { s->lo=a/b; s->hi=a%b; }
+
+//Returns 1 for branches and jumps, 0 for other opcodes, or -1 if the 
+//opcode can't be translated
+static int jit_branch_type(unsigned int opcode)
+{
+   unsigned int op = opcode >> 26, rt = (opcode >> 16) & 0x1f;
+   unsigned int func = opcode & 0x3f;
+
+   switch(op)
+   {
+      case 0x00:/*SPECIAL*/
+         switch(func)
+         {
+            case 0x00: case 0x02: case 0x03: case 0x04: case 0x06: 
+            case 0x07: case 0x10: case 0x11: case 0x12: case 0x13: 
+            case 0x18: case 0x19: case 0x1a: case 0x1b: case 0x20: 
+            case 0x21: case 0x22: case 0x23: case 0x24: case 0x25: 
+            case 0x26: case 0x27: case 0x2a: case 0x2b:
+               return 0;
+            case 0x08:/*JR*/ case 0x09:/*JALR*/
+               return 1;
+         }
+         return -1;
+      case 0x01:/*REGIMM*/
+         return rt == 0x00 || rt == 0x01 || rt == 0x10 || rt == 0x11 ? 1 : -1;
+      case 0x02: case 0x03: case 0x04: case 0x05: case 0x06: case 0x07:
+         return 1;
+      case 0x08: case 0x09: case 0x0a: case 0x0b: case 0x0c: case 0x0d:
+      case 0x0e: case 0x0f: case 0x20: case 0x21: case 0x22: case 0x23: 
+      case 0x24: case 0x25: case 0x26: case 0x28: case 0x29: case 0x2a: 
+      case 0x2b: case 0x2e: case 0x30: case 0x38:
+         return 0;
+   }
+   return -1;
+}
+
+//Translate one opcode at 'pc' which is opcode number 'count' in the block
+static void jit_opcode(Machine *m, unsigned int opcode, unsigned int pc, int delay, int count)
+{
+   unsigned int op, rs, rt, rd, re, func, imm;
+   void *load=NULL, *store=NULL, *call=NULL;
+   int cc=0;
+
+   op = (opcode >> 26) & 0x3f;
+   rs = (opcode >> 21) & 0x1f;
+   rt = (opcode >> 16) & 0x1f;
+   rd = (opcode >> 11) & 0x1f;
+   re = (opcode >> 6) & 0x1f;
+   func = opcode & 0x3f;
+   imm = opcode & 0xffff;
+
+   switch(op)
+   {
+      case 0x00:/*SPECIAL*/
+         switch(func)
+         {
+            case 0x00:/*SLL*/ case 0x02:/*SRL*/ case 0x03:/*SRA*/
+               emit_load(m, EAX, R_OFF(rt));
+               emit1(m, 0xc1); emit1(m, func == 0 ? 0xe0 : func == 2 ? 0xe8 : 0xf8);
+               emit1(m, re);
+               emit_store_reg(m, rd);
+               return;
+            case 0x04:/*SLLV*/ case 0x06:/*SRLV*/ case 0x07:/*SRAV*/
+               emit_load(m, EAX, R_OFF(rt));
+               emit_load(m, ECX, R_OFF(rs));
+               emit1(m, 0xd3); emit1(m, func == 4 ? 0xe0 : func == 6 ? 0xe8 : 0xf8);
+               emit_store_reg(m, rd);
+               return;
+            case 0x08:/*JR*/ case 0x09:/*JALR*/
+               if(func == 0x09 && rd)
+                  emit_store_imm(m, R_OFF(rd), pc + 8);
+               emit_load(m, EAX, R_OFF(rs));
+               emit1(m, 0x25); emit4(m, ~3);                   //and eax,~3
+               emit_store(m, NEXT_OFF, EAX);
+               return;
+            case 0x10:/*MFHI*/ emit_load(m, EAX, HI_OFF); emit_store_reg(m, rd); return;
+            case 0x11:/*MTHI*/ emit_load(m, EAX, R_OFF(rs)); emit_store(m, HI_OFF, EAX); return;
+            case 0x12:/*MFLO*/ emit_load(m, EAX, LO_OFF); emit_store_reg(m, rd); return;
+            case 0x13:/*MTLO*/ emit_load(m, EAX, R_OFF(rs)); emit_store(m, LO_OFF, EAX); return;
+            case 0x18:/*MULT*/  call = (void*)jit_mult;  break;
+            case 0x19:/*MULTU*/ call = (void*)jit_multu; break;
+            case 0x1a:/*DIV*/   call = (void*)jit_div;   break;
+            case 0x1b:/*DIVU*/  call = (void*)jit_divu;  break;
+            case 0x2a:/*SLT*/ case 0x2b:/*SLTU*/
+               emit_load(m, EAX, R_OFF(rs));
+               emit_load(m, ECX, R_OFF(rt));
+               emit_bytes(m, "\x39\xc8\x0f", 3);             //cmp eax,ecx
+               emit1(m, func == 0x2a ? 0x9c : 0x92);         //setl/setb al
+               emit_bytes(m, "\xc0\x0f\xb6\xc0", 4);         //movzx eax,al
+               emit_store_reg(m, rd);
+               return;
+            default:                                      //ALU
+               emit_load(m, EAX, R_OFF(rs));
+               emit_load(m, ECX, R_OFF(rt));
+               switch(func)
+               {
+                  case 0x20: case 0x21: emit1(m, 0x01); break; //add
+                  case 0x22: case 0x23: emit1(m, 0x29); break; //sub
+                  case 0x24: emit1(m, 0x21); break;            //and
+                  case 0x25: case 0x27: emit1(m, 0x09); break; //or
+                  case 0x26: emit1(m, 0x31); break;            //xor
+               }
+               emit1(m, 0xc8);
+               if(func == 0x27)
+                  emit_bytes(m, "\xf7\xd0", 2);              //not eax
+               emit_store_reg(m, rd);
+               return;
+         }
+         emit_load(m, ESI, R_OFF(rs));
+         emit_load(m, EDX, R_OFF(rt));
+         emit_call(m, call);
+         return;
+      case 0x01:/*REGIMM*/
+         if(rt & 0x10)                                    //BLTZAL/BGEZAL
+            emit_store_imm(m, R_OFF(31), pc + 8);
+         cc = (rt & 1) ? 0x4d : 0x4c;                     //cmovge/cmovl
+         break;
+      case 0x03:/*JAL*/ 
+         emit_store_imm(m, R_OFF(31), pc + 8);
+      case 0x02:/*J*/
+         emit_store_imm(m, NEXT_OFF, ((pc + 4) & 0xf0000000) | ((opcode << 6) >> 4));
+         return;
+      case 0x04:/*BEQ*/  cc = 0x44; break;
+      case 0x05:/*BNE*/  cc = 0x45; break;
+      case 0x06:/*BLEZ*/ cc = 0x4e; break;
+      case 0x07:/*BGTZ*/ cc = 0x4f; break;
+      case 0x08:/*ADDI*/ case 0x09:/*ADDIU*/
+         emit_load(m, EAX, R_OFF(rs));
+         emit1(m, 0x05); emit4(m, (short)imm);
+         emit_store_reg(m, rt);
+         return;
+      case 0x0a:/*SLTI*/ case 0x0b:/*SLTIU*/
+         emit_load(m, EAX, R_OFF(rs));
+         emit1(m, 0x3d); emit4(m, (short)imm);                  //cmp eax,imm
+         emit_bytes(m, "\x0f", 1);
+         emit1(m, op == 0x0a ? 0x9c : 0x92);
+         emit_bytes(m, "\xc0\x0f\xb6\xc0", 4);
+         emit_store_reg(m, rt);
+         return;
+      case 0x0c:/*ANDI*/ case 0x0d:/*ORI*/ case 0x0e:/*XORI*/
+         emit_load(m, EAX, R_OFF(rs));
+         emit1(m, op == 0x0c ? 0x25 : op == 0x0d ? 0x0d : 0x35); emit4(m, imm);
+         emit_store_reg(m, rt);
+         return;
+      case 0x0f:/*LUI*/
+         if(rt)
+            emit_store_imm(m, R_OFF(rt), imm << 16);
+         return;
+      case 0x20:/*LB*/  load = (void*)jit_lb;  break;
+      case 0x21:/*LH*/  load = (void*)jit_lh;  break;
+      case 0x23:/*LW*/  load = (void*)jit_lw;  break;
+      case 0x24:/*LBU*/ load = (void*)jit_lbu; break;
+      case 0x25:/*LHU*/ load = (void*)jit_lhu; break;
+      case 0x28:/*SB*/  store = (void*)jit_sb; break;
+      case 0x29:/*SH*/  store = (void*)jit_sh; break;
+      case 0x2b:/*SW*/  store = (void*)jit_sw; break;
+      case 0x22:/*LWL*/ load = (void*)jit_lwl; break;
+      case 0x26:/*LWR*/ load = (void*)jit_lwr; break;
+      case 0x2a:/*SWL*/ store = (void*)jit_swl; break;
+      case 0x2e:/*SWR*/ store = (void*)jit_swr; break;
+      case 0x30:/*LL*/  load = (void*)jit_ll;  break;
+      case 0x38:/*SC*/  load = (void*)jit_sc;  break;  //returns the flag
+   }
+
+   if(cc)
+   {
+      //Conditional branch: pc_next = condition ? target : pc + 8
+      emit_load(m, EAX, R_OFF(rs));
+      if(op == 0x04 || op == 0x05)
+      {
+         emit1(m, 0x3b); emit1(m, 0x83); emit4(m, R_OFF(rt));      //cmp eax,[rt]
+      }
+      else
+         emit_bytes(m, "\x85\xc0", 2);                       //test eax,eax
+      emit_mov_imm(m, ECX, pc + 8);
+      emit_mov_imm(m, EDX, pc + 4 + ((short)imm << 2));
+      emit1(m, 0x0f); emit1(m, cc); emit1(m, 0xca);                //cmovcc ecx,edx
+      emit_store(m, NEXT_OFF, ECX);
+      return;
+   }
+
+   emit_address(m, opcode, pc, delay, count);
+   if(load)
+   {
+      if(op == 0x22 || op == 0x26 || op == 0x38)
+         emit_load(m, EDX, R_OFF(rt));                       //LWL, LWR, SC
+      emit_call(m, load);
+      emit_store_reg(m, rt);
+   }
+   else
+   {
+      emit_load(m, EDX, R_OFF(rt));
+      emit_call(m, store);
+   }
+}
+
+//Translate the basic block starting at b->pc
+static void jit_translate(State *s, JitBlock *b)
+{
+   Machine *m = s->m;
+   unsigned int pc, opcode;
+   int count, type=0;
+   JitFunc func;
+
+   if(m->jitCode == NULL)
+   {
+      m->jitCode = (unsigned char*)mmap(NULL, JIT_CODE_SIZE, 
+         PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if(m->jitCode == MAP_FAILED)
+      {
+         m->jitCode = NULL;
+         b->count = -1;
+         return;
+      }
+      m->jitPtr = m->jitCode;
+   }
+   if(m->jitPtr + (JIT_BLOCK_MAX + 2) * JIT_OPCODE_MAX > m->jitCode + JIT_CODE_SIZE)
+   {
+      //Out of space so discard all translations
+      memset(m->jitBlock, 0, JIT_BLOCKS * sizeof(JitBlock));
+      memset(m->jitPage, 0, sizeof(m->jitPage));
+      m->jitPtr = m->jitCode;
+      ++m->jitFlushes;
+   }
+
+   func = (JitFunc)m->jitPtr;
+   emit_bytes(m, "\x53\x48\x89\xfb", 4);                    //push rbx; mov rbx,rdi
+   emit_store_imm(m, R_OFF(0), 0);
+   pc = b->pc;
+   for(count = 0; count < JIT_BLOCK_MAX; ++count, pc += 4)
+   {
+      opcode = mem_read(s, 4, pc);
+      type = jit_branch_type(opcode);
+      if(type < 0)
+         break;
+      if(type > 0)
+      {
+         //The delay slot must be translatable too, otherwise end the
+         //block before the branch
+         opcode = mem_read(s, 4, pc + 4);
+         if(jit_branch_type(opcode) != 0)
+         {
+            type = 0;
+            break;
+         }
+         jit_opcode(m, mem_read(s, 4, pc), pc, 0, count);
+         jit_opcode(m, opcode, pc + 4, 1, count + 1);
+         count += 2;
+         pc += 4;
+         break;
+      }
+      jit_opcode(m, opcode, pc, 0, count);
+   }
+   if(count == 0)
+   {
+      m->jitPtr = (unsigned char*)func;
+      b->count = -1;
+      return;
+   }
+   if(type > 0)
+   {
+      //pc = pc_next; pc_next += 4
+      emit_load(m, EAX, NEXT_OFF);
+      emit_store(m, PC_OFF, EAX);
+      emit_bytes(m, "\x83\xc0\x04", 3);                     //add eax,4
+      emit_store(m, NEXT_OFF, EAX);
+      emit_mov_imm(m, EAX, count);
+      emit_bytes(m, "\x5b\xc3", 2);         //pc is the delay slot
+   }
+   else
+   {
+      emit_exit(m, pc, 1, count);
+      pc -= 4;
+   }
+   b->end = pc;
+   b->func = func;
+   m->jitPage[b->pc >> 12] = 1;
+   m->jitPage[b->end >> 12] = 1;
+}
+
+//A store hit a page with translated code
+static void jit_invalidate(Machine *m, unsigned int address)
+{
+   unsigned int pc;
+   JitBlock *b;
+
+   address &= ~3;
+   //A block holds up to JIT_BLOCK_MAX + 1 opcodes with the delay slot
+   for(pc = address; pc + (JIT_BLOCK_MAX + 1) * 4 > address && pc <= address; pc -= 4)
+   {
+      b = &m->jitBlock[JIT_INDEX(pc)];
+      if(b->pc == pc && b->end >= address && (b->func || b->count < 0))
+      {
+         b->func = NULL;
+         b->count = 0;
+      }
+   }
+}
+
+//Execute a translated block if one exists for s->pc, otherwise one 
+//opcode with cycle().  A block isn't used if it contains 'breakpoint'
+//or is on a page with gdb breakpoints or watchpoints.
+//Returns the number of opcodes executed.
+static int jit_cycle(State *s, unsigned int breakpoint)
+{
+   Machine *m = s->m;
+   JitBlock *b;
+   int count;
+
+   if(s->skip || s->pc_next != s->pc + 4 || (s->processId && s->userMode))
+   {
+      cycle(s, 0);
+      return 1;
+   }
+   b = &m->jitBlock[JIT_INDEX(s->pc)];
+   if(b->pc != (unsigned int)s->pc)
+   {
+      b->pc = s->pc;
+      b->func = NULL;
+      b->count = 0;
+   }
+   if(b->func == NULL)
+   {
+      if(b->count >= 0 && ++b->count >= JIT_HOT)
+         jit_translate(s, b);
+      if(b->func == NULL)
+      {
+         cycle(s, 0);
+         return 1;
+      }
+   }
+   if((b->pc < breakpoint && breakpoint <= b->end) || 
+      gdb_page(m, b->pc) || gdb_page(m, b->end))
+      count = 0;
+   else
+      count = b->func(s);
+   if(count == 0)
+   {
+      //First opcode accesses MMIO
+      cycle(s, 0);
+      count = 1;
+   }
+   return count;
+}
+#endif  //ENABLE_JIT
+
+/************* Snapshots *************/
+//A snapshot holds the CPU, MMU, peripheral and model state plus the 
+//4KB pages of RAM that differ from the RAM right after loading the 
+//image, so it must be restored on top of the same image with the same
+//-ram banks.  Pages are tagged with their address.  The file is in 
+//host byte order.
+#define SNAPSHOT_MAGIC    0x504e5350  //"PSNP"
+#define SNAPSHOT_VERSION  4
+#define SNAPSHOT_PAGE     4096
+#define SNAPSHOT_TIMING   1
+#define SNAPSHOT_ICACHE   2
+#define SNAPSHOT_DCACHE   4
+
+//Checksum of the banks after loading (base) or now
+static unsigned int snapshot_checksum(Machine *m, int base)
+{
+   unsigned int sum=0, i;
+   unsigned char *mem;
+   int n;
+
+   for(n = 0; n < m->bankCount; ++n)
+   {
+      mem = base ? m->bank[n].base : m->bank[n].mem;
+      sum = sum * 31 + m->bank[n].address;
+      for(i = 0; mem && i < m->bank[n].size; i += 4)
+         sum = sum * 31 + *(unsigned int*)(mem + i);
+   }
+   return sum;
+}
+
+#ifndef PLASMA_LIBRARY
+static int snapshot_zero(const unsigned char *page)
+{
+   int i;
+   for(i = 0; i < SNAPSHOT_PAGE; i += 4)
+   {
+      if(*(unsigned int*)(page + i))
+         return 0;
+   }
+   return 1;
+}
+
+//Keep a copy of RAM after loading.  Pages that are still zero aren't 
+//copied so the copy is as sparse as RAM.
+static void snapshot_base(Machine *m)
+{
+   MemBank *b;
+   unsigned int offset;
+
+   for(b = m->bank; b < m->bank + m->bankCount; ++b)
+   {
+      if(b->mem == NULL || (b->base = mem_alloc(b->size)) == NULL)
+         continue;
+      for(offset = 0; offset < b->size; offset += SNAPSHOT_PAGE)
+      {
+         if(snapshot_zero(b->mem + offset) == 0)
+            memcpy(b->base + offset, b->mem + offset, SNAPSHOT_PAGE);
+      }
+   }
+}
+#endif
+
+static unsigned int snapshot_ram(Machine *m)
+{
+   unsigned int size=0;
+   int n;
+   for(n = 0; n < m->bankCount; ++n)
+      size += m->bank[n].size;
+   return size;
+}
+
+//Read or write 'size' bytes; returns non-zero on error
+static int snapshot_io(FILE *file, void *data, int size, int write)
+{
+   if(write)
+      return fwrite(data, 1, size, file) != (size_t)size;
+   return fread(data, 1, size, file) != (size_t)size;
+}
+
+static int snapshot_cache(FILE *file, CacheModel *c, int write)
+{
+   int lines = c->sets * c->ways, error;
+   int geometry[3]={c->size, c->lineSize, c->ways};
+
+   error = snapshot_io(file, geometry, sizeof(geometry), write);
+   if(write == 0 && (geometry[0] != c->size || geometry[1] != c->lineSize || 
+      geometry[2] != c->ways))
+   {
+      printf("Snapshot needs the same %s cache configuration\n", c->name);
+      return 1;
+   }
+   error |= snapshot_io(file, c->tag, lines * sizeof(int), write);
+   error |= snapshot_io(file, c->used, lines * sizeof(int), write);
+   error |= snapshot_io(file, &c->time, sizeof(c->time), write);
+   error |= snapshot_io(file, &c->total, sizeof(c->total), write);
+   error |= snapshot_io(file, c->region, sizeof(c->region), write);
+   return error;
+}
+
+//Fields common to save and restore for one CPU
+static int snapshot_state(State *s, FILE *file, int write)
+{
+   int error=0, models;
+
+   models = (s->timing ? SNAPSHOT_TIMING : 0) | (s->icache ? SNAPSHOT_ICACHE : 0) |
+            (s->dcache && s->dcache != s->icache ? SNAPSHOT_DCACHE : 0);
+   error |= snapshot_io(file, s->r, sizeof(s->r), write);
+   error |= snapshot_io(file, &s->pc, sizeof(s->pc), write);
+   error |= snapshot_io(file, &s->pc_next, sizeof(s->pc_next), write);
+   error |= snapshot_io(file, &s->epc, sizeof(s->epc), write);
+   error |= snapshot_io(file, &s->hi, sizeof(s->hi), write);
+   error |= snapshot_io(file, &s->lo, sizeof(s->lo), write);
+   error |= snapshot_io(file, &s->status, sizeof(s->status), write);
+   error |= snapshot_io(file, &s->userMode, sizeof(s->userMode), write);
+   error |= snapshot_io(file, &s->processId, sizeof(s->processId), write);
+   error |= snapshot_io(file, &s->faultAddr, sizeof(s->faultAddr), write);
+   error |= snapshot_io(file, &s->irqStatus, sizeof(s->irqStatus), write);
+   error |= snapshot_io(file, &s->skip, sizeof(s->skip), write);
+   error |= snapshot_io(file, &s->big_endian, sizeof(s->big_endian), write);
+   error |= snapshot_io(file, &s->halted, sizeof(s->halted), write);
+   error |= snapshot_io(file, &s->cpuStack, sizeof(s->cpuStack), write);
+   error |= snapshot_io(file, &s->counter, sizeof(s->counter), write);
+   error |= snapshot_io(file, &s->counterCycles, sizeof(s->counterCycles), write);
+   error |= snapshot_io(file, s->mmuEntry, sizeof(s->mmuEntry), write);
+   error |= snapshot_io(file, s->m->HWMemory, sizeof(s->m->HWMemory), write);
+   error |= snapshot_io(file, &models, sizeof(models), write);
+   if(error || models != ((s->timing ? SNAPSHOT_TIMING : 0) | 
+      (s->icache ? SNAPSHOT_ICACHE : 0) | 
+      (s->dcache && s->dcache != s->icache ? SNAPSHOT_DCACHE : 0)))
+   {
+      printf("Snapshot needs the same -timing and cache options\n");
+      return 1;
+   }
+   if(s->timing)
+      error |= snapshot_io(file, s->timing, sizeof(Timing), write);
+   if(s->icache)
+      error |= snapshot_cache(file, s->icache, write);
+   if(s->dcache && s->dcache != s->icache)
+      error |= snapshot_cache(file, s->dcache, write);
+   return error;
+}
+
+//Returns 0 on success
+static int snapshot_save(State *s, const char *filename)
+{
+   Machine *m = s->m;
+   FILE *file;
+   unsigned int header[5], page, offset;
+   MemBank *b;
+   int error, i;
+
+   file = fopen(filename, "wb");
+   if(file == NULL)
+      return 1;
+   header[0] = SNAPSHOT_MAGIC;
+   header[1] = SNAPSHOT_VERSION;
+   header[2] = snapshot_ram(m);
+   header[3] = snapshot_checksum(m, 1);
+   header[4] = m->cpuCount;
+   error = snapshot_io(file, header, sizeof(header), 1);
+   for(i = 0; i < m->cpuCount; ++i)
+      error |= snapshot_state(m->cpuList[i], file, 1);
+   for(b = m->bank; b < m->bank + m->bankCount; ++b)
+   {
+      for(offset = 0; b->mem && b->base && offset < b->size; offset += SNAPSHOT_PAGE)
+      {
+         if(memcmp(b->mem + offset, b->base + offset, SNAPSHOT_PAGE) == 0)
+            continue;
+         page = b->address + offset;
+         error |= snapshot_io(file, &page, sizeof(page), 1);
+         error |= snapshot_io(file, b->mem + offset, SNAPSHOT_PAGE, 1);
+      }
+   }
+   page = 0xffffffff;
+   error |= snapshot_io(file, &page, sizeof(page), 1);
+   error |= fclose(file) != 0;
+   return error;
+}
+
+#ifndef PLASMA_LIBRARY
+//Restore on top of the freshly loaded image; returns 0 on success
+static int snapshot_restore(State *s, const char *filename)
+{
+   Machine *m = s->m;
+   FILE *file;
+   unsigned int header[5], page;
+   unsigned char *ptr;
+   int error, i;
+
+   file = fopen(filename, "rb");
+   if(file == NULL)
+      return 1;
+   error = snapshot_io(file, header, sizeof(header), 0);
+   if(error || header[0] != SNAPSHOT_MAGIC || header[1] != SNAPSHOT_VERSION || 
+      header[2] != snapshot_ram(m) || header[4] != (unsigned int)m->cpuCount)
+   {
+      fclose(file);
+      return 1;
+   }
+   if(header[3] != snapshot_checksum(m, 0))
+      printf("Warning: %s was saved from a different image\n", filename);
+   error = 0;
+   for(i = 0; i < m->cpuCount; ++i)
+      error |= snapshot_state(m->cpuList[i], file, 0);
+   while(error == 0)
+   {
+      error = snapshot_io(file, &page, sizeof(page), 0);
+      if(error || page == 0xffffffff)
+         break;
+      ptr = s->region[page >> REGION_SHIFT];
+      if(ptr == NULL || (page & (SNAPSHOT_PAGE - 1)))
+         error = 1;
+      else
+         error = snapshot_io(file, ptr + (page & REGION_MASK), SNAPSHOT_PAGE, 0);
+   }
+   fclose(file);
+   for(i = 0; i < m->cpuCount; ++i)
+      m->cpuList[i]->swizzle = s->big_endian ? 3 : 0;
+   return error;
+}
+#endif
+
+/************* Multiple CPUs *************/
+//-cpus n simulates n CPUs sharing memory and peripherals.  CPU 0 starts
+//at reset and the others wait for CPU_START.  The CPUs take turns of 
+//-quantum opcodes (translated blocks may run a little over) in index 
+//order, or in a random order with random turn lengths with -random.  
+//-threads instead runs each CPU in its own host thread.
+
+//Interrupts go to CPU 0 between opcodes but not into a branch delay 
+//slot.  The ISR backs up one opcode from EPC.
+static void irq_check(State *s)
+{
+   if((irq_status(s) & s->m->HWMemory[1]) == 0 || s->skip || s->pc_next != s->pc + 4)
+      return;
+   s->epc = s->pc + 4;
+   s->llAddress = 0;
+   s->pc = 0x3c;
+   s->pc_next = 0x40;
+   s->status = 0;
+   s->userMode = 0;
+}
+
+static void counter_advance(State *s, int count)
+{
+   Machine *m = s->m;
+   unsigned int old = s->counter;
+
+   if(s->timing)
+   {
+      s->counter += (unsigned int)(s->timing->cycles - s->counterCycles);
+      s->counterCycles = s->timing->cycles;
+   }
+   else
+      s->counter += count;
+   //Poll the host about as often as bytes arrive at 57600 baud
+   if(((old ^ s->counter) >> 12) == 0)
+      return;
+   if(m->uart->pending)
+      uart_flush(s);
+   if(m->HWMemory[1] & IRQ_UART_READ_AVAILABLE)
+      uart_receive(s);
+#ifdef ENABLE_ETHERNET
+   if(m->eth)
+      eth_poll(s);
+#endif
+}
+
+//A branch to itself with a NOP in the delay slot can only be left by 
+//an interrupt, so skip ahead to the next counter interrupt
+static void counter_idle(State *s, unsigned int delaySlot)
+{
+   if((s->status & 1) && (s->m->HWMemory[1] & (IRQ_COUNTER18 | IRQ_COUNTER18_NOT)) &&
+      mem_read(s, 4, delaySlot) == 0)
+      counter_skip(s);
+}
+
+//Execute one opcode or translated block; returns opcodes executed
+static int cpu_step(State *s, long long left, unsigned int breakpoint)
+{
+   unsigned int pc=s->pc;
+   int count=1;
+
+   if(s->cpuIndex == 0 && (s->status & 1) && s->m->HWMemory[1])
+      irq_check(s);
+#ifdef ENABLE_JIT
+   if(left > JIT_BLOCK_MAX && s->instrument == 0 && s->m->threads == 0 &&
+      gdb_watching(s->m) == 0)
+      count = jit_cycle(s, breakpoint);
+   else
+#endif
+      cycle(s, 0);
+   (void)left;
+   (void)breakpoint;
+   if(s->cpuIndex)
+      return count;
+   counter_advance(s, count);
+   if(count == 1 && (unsigned int)s->pc_next + 4 == (unsigned int)s->pc)
+      counter_idle(s, s->pc);
+   else if(count == 2 && (unsigned int)s->pc == pc)
+      counter_idle(s, pc + 4);
+   return count;
+}
+
+//Returns the first CPU that stopped or NULL
+static State *cpu_stopped(Machine *m)
+{
+   int i;
+   for(i = 0; i < m->cpuCount; ++i)
+   {
+      if(m->cpuList[i]->wakeup)
+         return m->cpuList[i];
+   }
+   return NULL;
+}
+
+//Give every running CPU one turn.  Stops early at a CPU 0 breakpoint 
+//or when a CPU stops.  Returns the opcodes executed.
+static long long cpu_round(Machine *m, long long left, unsigned int breakpoint)
+{
+   State *s;
+   long long count=0, quantum, n;
+   int i;
+
+   for(i = 0; i < m->cpuCount && count < left; ++i)
+   {
+      s = m->cpuList[i];
+      quantum = m->cpuCount == 1 ? left : m->cpuQuantum;
+      if(m->cpuRandom)
+      {
+         m->cpuSeed = m->cpuSeed * 1103515245 + 12345;
+         s = m->cpuList[(m->cpuSeed >> 16) % m->cpuCount];
+         quantum = 1 + (m->cpuSeed >> 4) % m->cpuQuantum;
+      }
+      for(n = 0; n < quantum && count + n < left && s->halted == 0; )
+      {
+         if(s->wakeup || (s == m->cpuList[0] && breakpoint && s->pc == breakpoint) ||
+            gdb_break(s))
+            return count + n;
+         n += cpu_step(s, left - count - n, breakpoint);
+      }
+      count += n;
+   }
+   return count;
+}
+
+#if defined(ENABLE_THREADS) && !defined(PLASMA_LIBRARY)
+static void *cpu_thread(void *arg)
+{
+   State *s = (State*)arg;
+   long long count=0;
+
+   while(s->m->cpuStop == 0 && s->wakeup == 0)
+   {
+      if(s->halted)
+      {
+         Sleep(1);
+         continue;
+      }
+      if(s->m->cpuMax && count >= s->m->cpuMax)
+         break;
+      //Decoded each time since m->threads turns off the shared predecode
+      //table and translator.  CPU 0 also takes interrupts and runs the 
+      //counter, UART and Ethernet.
+      count += cpu_step(s, 1, 0);
+   }
+   s->m->cpuStop = 1;
+   return NULL;
+}
+
+//Returns 124 if a CPU used up -max
+static int cpu_threads(Machine *m)
+{
+   pthread_t thread[CPU_MAX];
+   int i;
+
+   m->cpuStop = 0;
+   for(i = 0; i < m->cpuCount; ++i)
+      pthread_create(&thread[i], NULL, cpu_thread, m->cpuList[i]);
+   for(i = 0; i < m->cpuCount; ++i)
+      pthread_join(thread[i], NULL);
+   return cpu_stopped(m) ? 0 : 124;
+}
+#endif
+
+#ifndef PLASMA_LIBRARY
+static void show_state(State *s)
+{
+   int i,j;
+   printf("pid=%d userMode=%d, epc=0x%x\n", s->processId, s->userMode, s->epc);
+   for(i = 0; i < 4; ++i) 
+   {
+      printf("%2.2d ", i * 8);
+      for(j = 0; j < 8; ++j) 
+      {
+         printf("%8.8x ", s->r[i*8+j]);
+      }
+      printf("\n");
+   }
+   //printf("%8.8lx %8.8lx %8.8lx %8.8lx\n", s->pc, s->pc_next, s->hi, s->lo);
+   j = s->pc;
+   for(i = -4; i <= 8; ++i) 
+   {
+      printf("%c", i==0 ? '*' : ' ');
+      s->pc = j + i * 4;
+      cycle(s, 10);
+   }
+   s->pc = j;
+}
+
+static void do_debug(State *s)
+{
+   int ch;
+   int i, j=0, watch=0, addr;
+   s->wakeup = 0;
+   show_state(s);
+   ch = ' ';
+   for(;;) 
+   {
+      if(ch != 'n')
+      {
+         if(watch) 
+            printf("0x%8.8x=0x%8.8x\n", watch, mem_read(s, 4, watch));
+         printf("1=Debug 2=Trace 3=Step 4=BreakPt 5=Go 6=Memory ");
+         printf("7=Watch 8=Jump 9=Quit> ");
+      }
+      ch = getch();
+      if(ch != 'n')
+         printf("\n");
+      switch(ch) 
+      {
+      case '1': case 'd': case ' ': 
+         cycle(s, 0); show_state(s); break;
+      case 'n': 
+         cycle(s, 1); break;
+      case '2': case 't': 
+         cycle(s, 0); printf("*"); cycle(s, 10); break;
+      case '3': case 's':
+         printf("Count> ");
+         scanf("%d", &j);
+         for(i = 0; i < j; ++i) 
+            cycle(s, 1);
+         show_state(s);
+         break;
+      case '4': case 'b':
+         printf("Line> ");
+         scanf("%x", &j);
+         printf("break point=0x%x\n", j);
+         break;
+      case '5': case 'g':
+         for(i = 0; i < s->m->cpuCount; ++i)
+            s->m->cpuList[i]->wakeup = 0;
+         cycle(s, 0);
+         while(cpu_stopped(s->m) == NULL) 
+         {
+            if(s->pc == j) 
+               break;
+            cpu_round(s->m, (long long)1 << 62, j);
+         }
+         show_state(s);
+         break;
+      case 'G':
+         s->wakeup = 0;
+         cycle(s, 1);
+         while(s->wakeup == 0) 
+         {
+            if(s->pc == j) 
+               break;
+            cycle(s, 1);
+         }
+         show_state(s);
+         break;
+      case '6': case 'm':
+         printf("Memory> ");
+         scanf("%x", &j);
+         for(i = 0; i < 8; ++i) 
+         {
+            printf("%8.8x ", mem_read(s, 4, j+i*4));
+         }
+         printf("\n");
+         break;
+      case '7': case 'w':
+         printf("Watch> ");
+         scanf("%x", &watch);
+         break;
+      case '8': case 'j':
+         printf("Jump> ");
+         scanf("%x", &addr);
+         s->pc = addr;
+         s->pc_next = addr + 4;
+         show_state(s);
+         break;
+      case '9': case 'q': 
+         return;
+      }
+   }
+}
+#endif
+/************************************************************/
+
+#ifndef PLASMA_LIBRARY
+//Run without the debugger until SIM_EXIT, BREAK, SYNC or 'max' opcodes.
+//Returns the exit code for main().
+static int run_batch(State *s, long long max, int threads)
+{
+   Machine *m = s->m;
+   long long count=0;
+   int i;
+
+   for(i = 0; i < m->cpuCount; ++i)
+      m->cpuList[i]->wakeup = 0;
+#ifdef ENABLE_THREADS
+   if(threads)
+   {
+      m->cpuMax = max;
+      if(cpu_threads(m))
+      {
+         uart_flush(s);
+         return 124;
+      }
+   }
+#endif
+   (void)threads;
+   while(cpu_stopped(m) == NULL)
+   {
+      if(max && count >= max)
+      {
+         uart_flush(s);
+         return 124;                //same as timeout(1)
+      }
+      count += cpu_round(m, max ? max - count : (long long)1 << 62, 0);
+   }
+   uart_flush(s);
+   for(i = 0; i < m->cpuCount; ++i)
+   {
+      if(m->cpuList[i]->exitCode >= 0)
+         return m->cpuList[i]->exitCode;
+   }
+   return 1;                        //SYNC or unknown opcode
+}
+#endif
+
+/************* Loading *************/
+//Map a file copy on write; returns NULL if it can't be read
+static unsigned char *file_map(const char *filename, unsigned int *size)
+{
+#ifndef WIN32
+   struct stat info;
+   void *ptr=MAP_FAILED;
+   int fd;
+
+   fd = open(filename, O_RDONLY);
+   if(fd < 0)
+      return NULL;
+   if(fstat(fd, &info) == 0 && info.st_size > 0 && info.st_size < 0x7fffffff)
+      ptr = mmap(NULL, info.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+   close(fd);
+   if(ptr == MAP_FAILED)
+      return NULL;
+   *size = (unsigned int)info.st_size;
+   return (unsigned char*)ptr;
+#else
+   FILE *in;
+   unsigned char *ptr;
+   long length;
+
+   in = fopen(filename, "rb");
+   if(in == NULL)
+      return NULL;
+   fseek(in, 0, SEEK_END);
+   length = ftell(in);
+   fseek(in, 0, SEEK_SET);
+   ptr = length > 0 ? (unsigned char*)malloc(length) : NULL;
+   if(ptr)
+      length = (long)fread(ptr, 1, length, in);
+   fclose(in);
+   *size = (unsigned int)length;
+   return ptr;
+#endif
+}
+
+#ifndef PLASMA_LIBRARY
+//-flash file; 0 on success
+static int flash_open(Flash *flash, const char *filename)
+{
+   if(flash->mem)
+      mem_release(flash->mem, flash->size);
+   flash->mem = file_map(filename, &flash->size);
+   flash->size &= ~1;
+   flash->command = 0xff;
+   return flash->mem == NULL;
+}
+#endif
+
+//Peripherals after reset and the default RAM banks
+static Machine *machine_create(void)
+{
+   Machine *m;
+
+   m = (Machine*)calloc(1, sizeof(Machine));
+   m->cpuCount = 1;
+   m->cpuQuantum = 1;
+   m->uart = (Uart*)calloc(1, sizeof(Uart));
+   m->uart->fd = -1;
+   m->uart->fifo = 1;
+   m->flash = (Flash*)calloc(1, sizeof(Flash));
+   m->flash->command = 0xff;
+   m->mmioHook = (MmioHook*)calloc(MMIO_HOOKS, sizeof(MmioHook));
+   m->bank = (MemBank*)calloc(BANK_MAX, sizeof(MemBank));
+#ifdef ENABLE_PREDECODE
+   m->decodeTable = (Decode*)calloc(DECODE_SIZE, sizeof(Decode));
+#endif
+#ifdef ENABLE_JIT
+   m->jitBlock = (JitBlock*)calloc(JIT_BLOCKS, sizeof(JitBlock));
+#endif
+   mem_defaults(m);
+   return m;
+}
+
+//Frees the CPUs after cpuList[0], which belongs to the caller
+static void machine_free(Machine *m)
+{
+   int i;
+
+   mem_free(m);
+   for(i = 1; i < m->cpuCount && m->cpuList[i]; ++i)
+      free(m->cpuList[i]);
+#ifdef ENABLE_ETHERNET
+   free(m->eth);
+#endif
+#ifdef ENABLE_JIT
+   if(m->jitCode)
+      munmap(m->jitCode, JIT_CODE_SIZE);
+   free(m->jitBlock);
+#endif
+#ifdef ENABLE_PREDECODE
+   free(m->decodeTable);
+#endif
+   free(m->bank);
+   free(m->mmioHook);
+   free(m->flash);
+   free(m->uart);
+   free(m);
+}
+
+static void state_init(State *s, Machine *m)
+{
+   memset(s, 0, sizeof(State));
+   s->big_endian = 1;
+   s->exitCode = -1;
+   s->uartOut = stdout;
+   s->m = m;
+}
+
+static int image_elf(const unsigned char *image, int bytes)
+{
+   return bytes > 52 && memcmp(image, "\177ELF", 4) == 0 && image[4] == 1;
+}
+
+//Load an ELF file, or a flat binary in s->big_endian order that starts
+//at 0 or at 0x10000000 if it begins by setting $gp for DDR.  Sets the 
+//PC.  Returns the bytes loaded or -1.
+static int image_load(State *s, const unsigned char *image, int bytes)
+{
+   if(image_elf(image, bytes))
+   {
+      bytes = elf_load(s, image, bytes);
+      if(bytes < 0)
+         return -1;
+   }
+   else
+   {
+      //Also in DDR for images linked at 0x10000000
+      region_init(s);
+      mem_load(s, RAM_EXTERNAL, image, bytes);
+      bytes = mem_load(s, RAM_INTERNAL, image, bytes);
+      s->pc = 0x0;
+      if((mem_read(s, 4, 0) & 0xffffff00) == 0x3c1c1000)
+         s->pc = 0x10000000;
+   }
+   s->pc_next = s->pc + 4;
+   return bytes;
+}
+
+//CPU 0 is s; the other CPUs wait for CPU_START
+static void cpu_create(State *s)
+{
+   State *cpu;
+   int index;
+
+   s->m->cpuList[0] = s;
+   for(index = 1; index < s->m->cpuCount; ++index)
+   {
+      //Models, profiles and traces only follow CPU 0
+      cpu = (State*)malloc(sizeof(State));
+      memcpy(cpu, s, sizeof(State));
+      cpu->timing = NULL;
+      cpu->icache = cpu->dcache = NULL;
+      cpu->profile = NULL;
+      cpu->cpuIndex = index;
+      cpu->halted = 1;
+      s->m->cpuList[index] = cpu;
+   }
+}
+
+#ifdef ENABLE_GDB
+/************* GDB remote serial protocol *************/
+//-gdb port waits for "target remote :port" on localhost and -gdb - 
+//talks over stdin/stdout for "target remote | mlite test.axf -gdb -".
+//Each CPU is a gdb thread.  Breakpoints and watchpoints don't patch 
+//memory.  Pages holding them are marked in m->gdbPage and translated
+//blocks keep running on the other pages, though watchpoints turn the 
+//JIT off so a CPU stops right after the access.
+#define GDB_PACKET    4096
+#define GDB_POINTS    64
+#define GDB_REGISTERS 38        //r0-r31 sr lo hi bad cause pc
+#define GDB_ROUND     100000    //opcodes between checks for ^C
+
+typedef struct {
+   int type;                    //Z packet type: 0,1 break 2 write 3 read 4 access
+   unsigned int address;
+   unsigned int length;
+} GdbPoint;
+
+static GdbPoint gdbPoint[GDB_POINTS];
+static int gdbPointCount;
+static int gdbIn, gdbOut, gdbAck=1;
+static int gdbStopType;         //type of the watchpoint that stopped a CPU
+static unsigned int gdbStopAddress;
+static const char gdbHex[] = "0123456789abcdef";
+
+//s->pc is on a page with a breakpoint
+static int gdb_break_check(State *s)
+{
+   int i;
+   for(i = 0; i < gdbPointCount; ++i)
+   {
+      if(gdbPoint[i].type < 2 && gdbPoint[i].address == (unsigned int)s->pc)
+      {
+         s->wakeup = 1;
+         return 1;
+      }
+   }
+   return 0;
+}
+
+//A load or store on a page with a watchpoint; opcode fetches are ignored
+static void gdb_watch_check(State *s, unsigned int address, int size, int write)
 {
-   unsigned int opcode;
-   unsigned int op, rs, rt, rd, re, func, imm, target;
-   int imm_shift, branch=0, lbranch=2, skip2=0;
-   int *r=s->r;
-   unsigned int *u=(unsigned int*)s->r;
-   unsigned int ptr, epc, rSave;
+   GdbPoint *p;
+   int i;
 
-   opcode = mem_read(s, 4, s->pc);
-   op = (opcode >> 26) & 0x3f;
-   rs = (opcode >> 21) & 0x1f;
-   rt = (opcode >> 16) & 0x1f;
-   rd = (opcode >> 11) & 0x1f;
-   re = (opcode >> 6) & 0x1f;
-   func = opcode & 0x3f;
-   imm = opcode & 0xffff;
-   imm_shift = (((int)(short)imm) << 2) - 4;
-   target = (opcode << 6) >> 4;
-   ptr = (short)imm + r[rs];
-   r[0] = 0;
-   if(show_mode) 
+   if(write == 0 && address == (unsigned int)s->pc)
+      return;
+   for(i = 0; i < gdbPointCount; ++i)
    {
-      printf("%8.8x %8.8x ", s->pc, opcode);
-      if(op == 0) 
-         printf("%8s ", special_string[func]);
-      else if(op == 1) 
-         printf("%8s ", regimm_string[rt]);
-      else 
-         printf("%8s ", opcode_string[op]);
-      printf("$%2.2d $%2.2d $%2.2d $%2.2d ", rs, rt, rd, re);
-      printf("%4.4x", imm);
-      if(show_mode == 1)
-         printf(" r[%2.2d]=%8.8x r[%2.2d]=%8.8x", rs, r[rs], rt, r[rt]);
-      printf("\n");
+      p = &gdbPoint[i];
+      if((p->type == 4 || p->type == 3 - write) && 
+         address < p->address + p->length && p->address < address + size)
+      {
+         s->wakeup = 1;
+         gdbStopType = p->type;
+         gdbStopAddress = p->address;
+         return;
+      }
    }
-   if(show_mode > 5) 
-      return;
-   epc = s->pc + 4;
-   if(s->pc_next != s->pc + 4)
-      epc |= 2;  //branch delay slot
-   s->pc = s->pc_next;
-   s->pc_next = s->pc_next + 4;
-   if(s->skip) 
+}
+
+static void gdb_pages(Machine *m)
+{
+   GdbPoint *p;
+   unsigned int page;
+   int i;
+
+   memset(m->gdbPage, 0, sizeof(m->gdbPage));
+   m->gdbWatchCount = 0;
+   for(i = 0; i < gdbPointCount; ++i)
    {
-      s->skip = 0;
-      return;
+      p = &gdbPoint[i];
+      if(p->type < 2)
+      {
+         m->gdbPage[p->address >> 12] |= GDB_BREAK;
+         continue;
+      }
+      ++m->gdbWatchCount;
+      for(page = p->address >> 12; page <= (p->address + p->length - 1) >> 12; ++page)
+         m->gdbPage[page] |= GDB_WATCH;
    }
-   rSave = r[rt];
-   switch(op) 
+}
+
+//Handles Z and z packets
+static int gdb_point(Machine *m, int insert, int type, unsigned int address, 
+                     unsigned int length)
+{
+   int i;
+
+   if(type > 4)
+      return -1;
+   if(type < 2 || length == 0)
+      length = 1;
+   for(i = 0; i < gdbPointCount; ++i)
    {
-      case 0x00:/*SPECIAL*/
-         switch(func) 
-         {
-            case 0x00:/*SLL*/  r[rd]=r[rt]<<re;          break;
-            case 0x02:/*SRL*/  r[rd]=u[rt]>>re;          break;
-            case 0x03:/*SRA*/  r[rd]=r[rt]>>re;          break;
-            case 0x04:/*SLLV*/ r[rd]=r[rt]<<r[rs];       break;
-            case 0x06:/*SRLV*/ r[rd]=u[rt]>>r[rs];       break;
-            case 0x07:/*SRAV*/ r[rd]=r[rt]>>r[rs];       break;
-            case 0x08:/*JR*/   s->pc_next=r[rs];         break;
-            case 0x09:/*JALR*/ r[rd]=s->pc_next; s->pc_next=r[rs]; break;
-            case 0x0a:/*MOVZ*/ if(!r[rt]) r[rd]=r[rs];   break;  /*IV*/
-            case 0x0b:/*MOVN*/ if(r[rt]) r[rd]=r[rs];    break;  /*IV*/
-            case 0x0c:/*SYSCALL*/ epc|=1; s->exceptionId=1; break;
-            case 0x0d:/*BREAK*/   epc|=1; s->exceptionId=1; break;
-            case 0x0f:/*SYNC*/ s->wakeup=1;              break;
-            case 0x10:/*MFHI*/ r[rd]=s->hi;              break;
-            case 0x11:/*FTHI*/ s->hi=r[rs];              break;
-            case 0x12:/*MFLO*/ r[rd]=s->lo;              break;
-            case 0x13:/*MTLO*/ s->lo=r[rs];              break;
-            case 0x18:/*MULT*/ mult_big_signed(r[rs],r[rt],&s->hi,&s->lo); break;
-            case 0x19:/*MULTU*/ mult_big(r[rs],r[rt],&s->hi,&s->lo); break;
-            case 0x1a:/*DIV*/  s->lo=r[rs]/r[rt]; s->hi=r[rs]%r[rt]; break;
-            case 0x1b:/*DIVU*/ s->lo=u[rs]/u[rt]; s->hi=u[rs]%u[rt]; break;
-            case 0x20:/*ADD*/  r[rd]=r[rs]+r[rt];        break;
-            case 0x21:/*ADDU*/ r[rd]=r[rs]+r[rt];        break;
-            case 0x22:/*SUB*/  r[rd]=r[rs]-r[rt];        break;
-            case 0x23:/*SUBU*/ r[rd]=r[rs]-r[rt];        break;
-            case 0x24:/*AND*/  r[rd]=r[rs]&r[rt];        break;
-            case 0x25:/*OR*/   r[rd]=r[rs]|r[rt];        break;
-            case 0x26:/*XOR*/  r[rd]=r[rs]^r[rt];        break;
-            case 0x27:/*NOR*/  r[rd]=~(r[rs]|r[rt]);     break;
-            case 0x2a:/*SLT*/  r[rd]=r[rs]<r[rt];        break;
-            case 0x2b:/*SLTU*/ r[rd]=u[rs]<u[rt];        break;
-            case 0x2d:/*DADDU*/r[rd]=r[rs]+u[rt];        break;
-            case 0x31:/*TGEU*/ break;
-            case 0x32:/*TLT*/  break;
-            case 0x33:/*TLTU*/ break;
-            case 0x34:/*TEQ*/  break;
-            case 0x36:/*TNE*/  break;
-            default: printf("ERROR0(*0x%x~0x%x)\n", s->pc, opcode);
-               s->wakeup=1;
-         }
-         break;
-      case 0x01:/*REGIMM*/
-         switch(rt) {
-            case 0x10:/*BLTZAL*/ r[31]=s->pc_next;
-            case 0x00:/*BLTZ*/   branch=r[rs]<0;    break;
-            case 0x11:/*BGEZAL*/ r[31]=s->pc_next;
-            case 0x01:/*BGEZ*/   branch=r[rs]>=0;   break;
-            case 0x12:/*BLTZALL*/r[31]=s->pc_next;
-            case 0x02:/*BLTZL*/  lbranch=r[rs]<0;   break;
-            case 0x13:/*BGEZALL*/r[31]=s->pc_next;
-            case 0x03:/*BGEZL*/  lbranch=r[rs]>=0;  break;
-            default: printf("ERROR1\n"); s->wakeup=1;
-          }
-         break;
-      case 0x03:/*JAL*/    r[31]=s->pc_next;
-      case 0x02:/*J*/      s->pc_next=(s->pc&0xf0000000)|target; break;
-      case 0x04:/*BEQ*/    branch=r[rs]==r[rt];     break;
-      case 0x05:/*BNE*/    branch=r[rs]!=r[rt];     break;
-      case 0x06:/*BLEZ*/   branch=r[rs]<=0;         break;
-      case 0x07:/*BGTZ*/   branch=r[rs]>0;          break;
-      case 0x08:/*ADDI*/   r[rt]=r[rs]+(short)imm;  break;
-      case 0x09:/*ADDIU*/  u[rt]=u[rs]+(short)imm;  break;
-      case 0x0a:/*SLTI*/   r[rt]=r[rs]<(short)imm;  break;
-      case 0x0b:/*SLTIU*/  u[rt]=u[rs]<(unsigned int)(short)imm; break;
-      case 0x0c:/*ANDI*/   r[rt]=r[rs]&imm;         break;
-      case 0x0d:/*ORI*/    r[rt]=r[rs]|imm;         break;
-      case 0x0e:/*XORI*/   r[rt]=r[rs]^imm;         break;
-      case 0x0f:/*LUI*/    r[rt]=(imm<<16);         break;
-      case 0x10:/*COP0*/
-         if((opcode & (1<<23)) == 0)  //move from CP0
-         {
-            if(rd == 12)
-               r[rt]=s->status;
-            else
-               r[rt]=s->epc;
-         }
-         else                         //move to CP0
-         {
-            s->status=r[rt]&1;
-            if(s->processId && (r[rt]&2))
-            {
-               s->userMode|=r[rt]&2;
-               //printf("CpuStatus=%d %d %d\n", r[rt], s->status, s->userMode);
-               //s->wakeup = 1;
-               //printf("pc=0x%x\n", epc);
-            }
-         }
+      if(gdbPoint[i].type == type && gdbPoint[i].address == address && 
+         gdbPoint[i].length == length)
          break;
-//      case 0x11:/*COP1*/ break;
-//      case 0x12:/*COP2*/ break;
-//      case 0x13:/*COP3*/ break;
-      case 0x14:/*BEQL*/   lbranch=r[rs]==r[rt];    break;
-      case 0x15:/*BNEL*/   lbranch=r[rs]!=r[rt];    break;
-      case 0x16:/*BLEZL*/  lbranch=r[rs]<=0;        break;
-      case 0x17:/*BGTZL*/  lbranch=r[rs]>0;         break;
-//      case 0x1c:/*MAD*/  break;   /*IV*/
-      case 0x20:/*LB*/   r[rt]=(signed char)mem_read(s,1,ptr);  break;
-      case 0x21:/*LH*/   r[rt]=(signed short)mem_read(s,2,ptr); break;
-      case 0x22:/*LWL*/  
-                         //target=8*(ptr&3);
-                         //r[rt]=(r[rt]&~(0xffffffff<<target))|
-                         //      (mem_read(s,4,ptr&~3)<<target); break;
-      case 0x23:/*LW*/   r[rt]=mem_read(s,4,ptr);   break;
-      case 0x24:/*LBU*/  r[rt]=(unsigned char)mem_read(s,1,ptr); break;
-      case 0x25:/*LHU*/  r[rt]=(unsigned short)mem_read(s,2,ptr); break;
-      case 0x26:/*LWR*/  
-                         //target=32-8*(ptr&3);
-                         //r[rt]=(r[rt]&~((unsigned int)0xffffffff>>target))|
-                         //((unsigned int)mem_read(s,4,ptr&~3)>>target); 
-                         break;
-      case 0x28:/*SB*/   mem_write(s,1,ptr,r[rt]);  break;
-      case 0x29:/*SH*/   mem_write(s,2,ptr,r[rt]);  break;
-      case 0x2a:/*SWL*/  
-                         //mem_write(s,1,ptr,r[rt]>>24);  
-                         //mem_write(s,1,ptr+1,r[rt]>>16);
-                         //mem_write(s,1,ptr+2,r[rt]>>8);
-                         //mem_write(s,1,ptr+3,r[rt]); break;
-      case 0x2b:/*SW*/   mem_write(s,4,ptr,r[rt]);  break;
-      case 0x2e:/*SWR*/  break; //fixme
-      case 0x2f:/*CACHE*/break;
-      case 0x30:/*LL*/   r[rt]=mem_read(s,4,ptr);   break;
-//      case 0x31:/*LWC1*/ break;
-//      case 0x32:/*LWC2*/ break;
-//      case 0x33:/*LWC3*/ break;
-//      case 0x35:/*LDC1*/ break;
-//      case 0x36:/*LDC2*/ break;
-//      case 0x37:/*LDC3*/ break;
-//      case 0x38:/*SC*/     *(int*)ptr=r[rt]; r[rt]=1; break;
-      case 0x38:/*SC*/     mem_write(s,4,ptr,r[rt]); r[rt]=1; break;
-//      case 0x39:/*SWC1*/ break;
-//      case 0x3a:/*SWC2*/ break;
-//      case 0x3b:/*SWC3*/ break;
-//      case 0x3d:/*SDC1*/ break;
-//      case 0x3e:/*SDC2*/ break;
-//      case 0x3f:/*SDC3*/ break;
-      default: printf("ERROR2 address=0x%x opcode=0x%x\n", s->pc, opcode); 
-         s->wakeup=1;
    }
-   s->pc_next += (branch || lbranch == 1) ? imm_shift : 0;
-   s->pc_next &= ~3;
-   s->skip = (lbranch == 0) | skip2;
+   if(insert && i == gdbPointCount)
+   {
+      if(gdbPointCount >= GDB_POINTS)
+         return -1;
+      gdbPoint[gdbPointCount].type = type;
+      gdbPoint[gdbPointCount].address = address;
+      gdbPoint[gdbPointCount++].length = length;
+   }
+   else if(insert == 0 && i < gdbPointCount)
+      gdbPoint[i] = gdbPoint[--gdbPointCount];
+   gdb_pages(m);
+   return 0;
+}
 
-   if(s->exceptionId)
+static int gdb_getc(void)
+{
+   unsigned char ch;
+   if(read(gdbIn, &ch, 1) != 1)
+      return -1;
+   return ch;
+}
+
+static void gdb_write(const char *data, int length)
+{
+   int bytes;
+   while(length > 0 && (bytes = write(gdbOut, data, length)) > 0)
    {
-      r[rt] = rSave;
-      s->epc = epc; 
-      s->pc_next = 0x3c;
-      s->skip = 1; 
-      s->exceptionId = 0;
-      s->userMode = 0;
-      //s->wakeup = 1;
-      return;
+      data += bytes;
+      length -= bytes;
+   }
+}
+
+static int gdb_digit(int ch)
+{
+   if('0' <= ch && ch <= '9')
+      return ch - '0';
+   if('a' <= ch && ch <= 'f')
+      return ch - 'a' + 10;
+   if('A' <= ch && ch <= 'F')
+      return ch - 'A' + 10;
+   return -1;
+}
+
+//Parse a hex number and advance past it and one separator
+static unsigned int gdb_number(const char **ptr)
+{
+   unsigned int value=0;
+   while(gdb_digit(**ptr) >= 0)
+      value = (value << 4) | gdb_digit(*(*ptr)++);
+   if(**ptr)
+      ++*ptr;
+   return value;
+}
+
+//Registers and memory are sent in target byte order
+static void gdb_word(char *out, unsigned int value, int big)
+{
+   int i, byte;
+   for(i = 0; i < 4; ++i)
+   {
+      byte = (value >> (big ? 24 - i * 8 : i * 8)) & 0xff;
+      *out++ = gdbHex[byte >> 4];
+      *out++ = gdbHex[byte & 15];
+   }
+   *out = 0;
+}
+
+static unsigned int gdb_parse_word(const char *in, int big)
+{
+   unsigned int value=0;
+   int i;
+   for(i = 0; i < 4; ++i)
+      value |= ((gdb_digit(in[i*2]) << 4) | gdb_digit(in[i*2+1])) << (big ? 24 - i * 8 : i * 8);
+   return value;
+}
+
+//Send "$packet#checksum" and resend until acknowledged
+static void gdb_send(const char *packet)
+{
+   static char buf[GDB_PACKET + 8];
+   unsigned int sum=0;
+   int length;
+
+   for(length = 0; packet[length]; ++length)
+      sum += (unsigned char)packet[length];
+   buf[0] = '$';
+   memcpy(buf + 1, packet, length);
+   sprintf(buf + length + 1, "#%02x", sum & 0xff);
+   do
+   {
+      gdb_write(buf, length + 4);
+   } while(gdbAck && gdb_getc() == '-');
+}
+
+//Returns the next packet's length or -1 when gdb hangs up
+static int gdb_receive(char *packet)
+{
+   int ch, length, sum, check;
+
+   for(;;)
+   {
+      while((ch = gdb_getc()) != '$')
+      {
+         if(ch < 0)
+            return -1;
+      }
+      length = sum = 0;
+      while((ch = gdb_getc()) != '#')
+      {
+         if(ch < 0)
+            return -1;
+         if(length < GDB_PACKET - 1)
+            packet[length++] = (char)ch;
+         sum += ch;
+      }
+      packet[length] = 0;
+      check = gdb_digit(gdb_getc()) << 4;
+      check |= gdb_digit(gdb_getc());
+      if(gdbAck == 0)
+         return length;
+      if(check == (sum & 0xff))
+      {
+         gdb_write("+", 1);
+         return length;
+      }
+      gdb_write("-", 1);
+   }
+}
+
+//True if gdb sent ^C or hung up while the CPUs were running
+static int gdb_interrupted(void)
+{
+   struct timeval tv;
+   fd_set read_fd;
+
+   tv.tv_sec = 0;
+   tv.tv_usec = 0;
+   FD_ZERO(&read_fd);
+   FD_SET(gdbIn, &read_fd);
+   if(select(gdbIn + 1, &read_fd, NULL, NULL, &tv) <= 0)
+      return 0;
+   return gdb_getc() != '+';
+}
+
+static unsigned int *gdb_register(State *s, int n)
+{
+   static unsigned int cause;
+   cause = 0;
+   switch(n)
+   {
+      case 32: return (unsigned int*)&s->status;
+      case 33: return &s->lo;
+      case 34: return &s->hi;
+      case 35: return (unsigned int*)&s->faultAddr;
+      case 36: return &cause;
+      case 37: return (unsigned int*)&s->pc;
    }
+   return (unsigned int*)&s->r[n];
 }
 
-void show_state(State *s)
+static void gdb_set_register(State *s, int n, unsigned int value)
 {
-   int i,j;
-   printf("pid=%d userMode=%d, epc=0x%x\n", s->processId, s->userMode, s->epc);
-   for(i = 0; i < 4; ++i) 
+   *gdb_register(s, n) = value;
+   if(n == 37)
    {
-      printf("%2.2d ", i * 8);
-      for(j = 0; j < 8; ++j) 
+      s->pc_next = s->pc + 4;
+      s->skip = 0;
+   }
+}
+
+//Host address of a RAM byte or NULL for MMIO, which gdb mustn't touch
+static unsigned char *gdb_memory(State *s, unsigned int address)
+{
+   unsigned char *ptr = s->region[address >> REGION_SHIFT];
+   if(ptr == NULL)
+      return NULL;
+   return (unsigned char*)((size_t)(ptr + (address & REGION_MASK)) ^ s->swizzle);
+}
+
+static void gdb_stop_reply(State *s, int signal)
+{
+   static const char *watch[] = {"watch", "rwatch", "awatch"};
+   char buf[80];
+
+   if(s->exitCode >= 0)
+      sprintf(buf, "W%02x", s->exitCode);
+   else if(gdbStopType)
+      sprintf(buf, "T%02xthread:%x;%s:%x;", signal, s->cpuIndex + 1, 
+         watch[gdbStopType - 2], gdbStopAddress);
+   else
+      sprintf(buf, "T%02xthread:%x;", signal, s->cpuIndex + 1);
+   gdb_send(buf);
+}
+
+//Step s or run all CPUs until one stops.  Returns the CPU to report.
+static State *gdb_resume(State *s, int step, int *signal)
+{
+   State *stopped;
+   int i;
+
+   for(i = 0; i < s->m->cpuCount; ++i)
+      s->m->cpuList[i]->wakeup = 0;
+   gdbStopType = 0;
+   *signal = 5;                    //SIGTRAP
+   if(s->halted == 0)
+      cycle(s, 0);                 //leave a breakpoint at s->pc
+   if(step || s->wakeup)
+      return s;
+   while((stopped = cpu_stopped(s->m)) == NULL)
+   {
+      cpu_round(s->m, GDB_ROUND, 0);
+      if(gdb_interrupted())
       {
-         printf("%8.8x ", s->r[i*8+j]);
+         *signal = 2;              //SIGINT
+         return s;
       }
-      printf("\n");
    }
-   //printf("%8.8lx %8.8lx %8.8lx %8.8lx\n", s->pc, s->pc_next, s->hi, s->lo);
-   j = s->pc;
-   for(i = -4; i <= 8; ++i) 
+   return stopped;
+}
+
+static int gdb_open(const char *port)
+{
+   struct sockaddr_in addr;
+   int listener, one=1;
+
+   if(strcmp(port, "-") == 0)
    {
-      printf("%c", i==0 ? '*' : ' ');
-      s->pc = j + i * 4;
-      cycle(s, 10);
+      gdbIn = 0;
+      gdbOut = 1;
+      return 0;
    }
-   s->pc = j;
+   listener = socket(AF_INET, SOCK_STREAM, 0);
+   memset(&addr, 0, sizeof(addr));
+   addr.sin_family = AF_INET;
+   addr.sin_port = htons(atoi(port));
+   addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+   setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+   if(listener < 0 || bind(listener, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+      listen(listener, 1) < 0)
+   {
+      printf("Can't listen on port %s\n", port);
+      return -1;
+   }
+   printf("Waiting for gdb on port %s\n", port);
+   fflush(stdout);
+   gdbIn = gdbOut = accept(listener, NULL, NULL);
+   close(listener);
+   if(gdbIn < 0)
+      return -1;
+   setsockopt(gdbIn, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+   return 0;
 }
 
-void do_debug(State *s)
+//Serve gdb until it kills or detaches or the image exits.  Returns the
+//exit code for main().
+static int gdb_serve(State *s, const char *port)
 {
-   int ch;
-   int i, j=0, watch=0, addr;
-   s->pc_next = s->pc + 4;
-   s->skip = 0;
-   s->wakeup = 0;
-   show_state(s);
-   ch = ' ';
-   for(;;) 
+   static char packet[GDB_PACKET], reply[GDB_PACKET];
+   State *cpu=s;
+   const char *ptr;
+   unsigned char *byte;
+   unsigned int address, length, i;
+   int signal=5, type, big=s->big_endian;
+
+   if(gdb_open(port))
+      return 1;
+   for(;;)
    {
-      if(ch != 'n')
-      {
-         if(watch) 
-            printf("0x%8.8x=0x%8.8x\n", watch, mem_read(s, 4, watch));
-         printf("1=Debug 2=Trace 3=Step 4=BreakPt 5=Go 6=Memory ");
-         printf("7=Watch 8=Jump 9=Quit> ");
-      }
-      ch = getch();
-      if(ch != 'n')
-         printf("\n");
-      switch(ch) 
+      if(gdb_receive(packet) < 0)
+         return 0;
+      ptr = packet + 1;
+      reply[0] = 0;
+      switch(packet[0])
       {
-      case '1': case 'd': case ' ': 
-         cycle(s, 0); show_state(s); break;
-      case 'n': 
-         cycle(s, 1); break;
-      case '2': case 't': 
-         cycle(s, 0); printf("*"); cycle(s, 10); break;
-      case '3': case 's':
-         printf("Count> ");
-         scanf("%d", &j);
-         for(i = 0; i < j; ++i) 
-            cycle(s, 1);
-         show_state(s);
+      case '?':
+         gdb_stop_reply(cpu, signal);
+         continue;
+      case 'g':
+         for(i = 0; i < GDB_REGISTERS; ++i)
+            gdb_word(reply + i * 8, *gdb_register(cpu, i), big);
          break;
-      case '4': case 'b':
-         printf("Line> ");
-         scanf("%x", &j);
-         printf("break point=0x%x\n", j);
+      case 'G':
+         for(i = 0; i < GDB_REGISTERS && strlen(ptr) >= (i + 1) * 8; ++i)
+            gdb_set_register(cpu, i, gdb_parse_word(ptr + i * 8, big));
+         strcpy(reply, "OK");
          break;
-      case '5': case 'g':
-         s->wakeup = 0;
-         cycle(s, 0);
-         while(s->wakeup == 0) 
+      case 'p':
+         i = gdb_number(&ptr);
+         if(i < GDB_REGISTERS)
+            gdb_word(reply, *gdb_register(cpu, i), big);
+         else
+            strcpy(reply, "xxxxxxxx");    //FPU registers aren't available
+         break;
+      case 'P':
+         i = gdb_number(&ptr);
+         if(i < GDB_REGISTERS && strlen(ptr) >= 8)
+            gdb_set_register(cpu, i, gdb_parse_word(ptr, big));
+         strcpy(reply, "OK");
+         break;
+      case 'm':
+         address = gdb_number(&ptr);
+         length = gdb_number(&ptr);
+         for(i = 0; i < length && i < GDB_PACKET / 2 - 1; ++i)
          {
-            if(s->pc == j) 
+            if((byte = gdb_memory(cpu, address + i)) == NULL)
                break;
-            cycle(s, 0);
+            reply[i * 2] = gdbHex[*byte >> 4];
+            reply[i * 2 + 1] = gdbHex[*byte & 15];
          }
-         show_state(s);
+         reply[i * 2] = 0;
+         if(i == 0 && length)
+            strcpy(reply, "E01");
          break;
-      case 'G':
-         s->wakeup = 0;
-         cycle(s, 1);
-         while(s->wakeup == 0) 
+      case 'M':
+         address = gdb_number(&ptr);
+         length = gdb_number(&ptr);
+         strcpy(reply, "OK");
+         for(i = 0; i < length && ptr[i * 2] && ptr[i * 2 + 1]; ++i)
          {
-            if(s->pc == j) 
+            if((byte = gdb_memory(cpu, address + i)) == NULL)
+            {
+               strcpy(reply, "E01");
                break;
-            cycle(s, 1);
+            }
+            *byte = (unsigned char)((gdb_digit(ptr[i * 2]) << 4) | gdb_digit(ptr[i * 2 + 1]));
+            decode_invalidate(cpu->m, address + i);
+            jit_check(cpu->m, address + i);
          }
-         show_state(s);
          break;
-      case '6': case 'm':
-         printf("Memory> ");
-         scanf("%x", &j);
-         for(i = 0; i < 8; ++i) 
+      case 'c':
+      case 's':
+         if(*ptr)
+            gdb_set_register(cpu, 37, gdb_number(&ptr));
+         cpu = gdb_resume(cpu, packet[0] == 's', &signal);
+         gdb_stop_reply(cpu, signal);
+         if(cpu->exitCode >= 0)
+            return cpu->exitCode;
+         continue;
+      case 'Z':
+      case 'z':
+         type = gdb_number(&ptr);
+         address = gdb_number(&ptr);
+         length = gdb_number(&ptr);
+         strcpy(reply, gdb_point(s->m, packet[0] == 'Z', type, address, length) ? "E01" : "OK");
+         break;
+      case 'H':
+         i = strtol(packet + 2, NULL, 16);
+         if(0 < (int)i && (int)i <= s->m->cpuCount)
+            cpu = s->m->cpuList[i - 1];
+         strcpy(reply, "OK");
+         break;
+      case 'T':
+         i = strtol(ptr, NULL, 16);
+         strcpy(reply, 0 < (int)i && (int)i <= s->m->cpuCount ? "OK" : "E01");
+         break;
+      case 'q':
+         if(strncmp(packet, "qSupported", 10) == 0)
+            sprintf(reply, "PacketSize=%x;QStartNoAckMode+", GDB_PACKET - 1);
+         else if(strcmp(packet, "qAttached") == 0)
+            strcpy(reply, "1");
+         else if(strcmp(packet, "qC") == 0)
+            sprintf(reply, "QC%x", cpu->cpuIndex + 1);
+         else if(strcmp(packet, "qfThreadInfo") == 0)
          {
-            printf("%8.8x ", mem_read(s, 4, j+i*4));
+            strcpy(reply, "m1");
+            for(i = 2; (int)i <= s->m->cpuCount; ++i)
+               sprintf(reply + strlen(reply), ",%x", i);
          }
-         printf("\n");
-         break;
-      case '7': case 'w':
-         printf("Watch> ");
-         scanf("%x", &watch);
+         else if(strcmp(packet, "qsThreadInfo") == 0)
+            strcpy(reply, "l");
          break;
-      case '8': case 'j':
-         printf("Jump> ");
-         scanf("%x", &addr);
-         s->pc = addr;
-         s->pc_next = addr + 4;
-         show_state(s);
+      case 'Q':
+         if(strcmp(packet, "QStartNoAckMode") == 0)
+         {
+            gdb_send("OK");
+            gdbAck = 0;
+            continue;
+         }
          break;
-      case '9': case 'q': 
-         return;
+      case 'D':
+         gdb_send("OK");
+         gdbPointCount = 0;
+         gdb_pages(s->m);
+         return run_batch(s, 0, 0);
+      case 'k':
+         return 0;
       }
+      gdb_send(reply);
    }
 }
-/************************************************************/
+#endif  //ENABLE_GDB
+
+#ifdef PLASMA_LIBRARY
+/************* Library *************/
+//The plasmasim.h calls.  Each PlasmaSim is CPU 0 of its own Machine
+//so separate simulators can run in separate host threads.
+
+//Forget decoded and translated opcodes and peripheral state
+static void library_reset(Machine *m)
+{
+   memset(m->HWMemory, 0, sizeof(m->HWMemory));
+   memset(m->uart, 0, sizeof(Uart));
+   m->uart->fd = -1;
+   m->uart->fifo = 1;
+#ifdef ENABLE_PREDECODE
+   memset(m->decodeTable, 0, DECODE_SIZE * sizeof(Decode));
+#endif
+#ifdef ENABLE_JIT
+   memset(m->jitBlock, 0, JIT_BLOCKS * sizeof(JitBlock));
+   memset(m->jitPage, 0, sizeof(m->jitPage));
+   m->jitPtr = m->jitCode;
+#endif
+   cache_init();
+}
+
+//Regions outside MISC_BASE with callbacks stop being RAM
+static void library_regions(State *s)
+{
+   MmioHook *hook;
+   unsigned int first, last, i;
+
+   for(hook = s->m->mmioHook; hook < s->m->mmioHook + s->m->mmioHookCount; ++hook)
+   {
+      first = hook->address >> REGION_SHIFT;
+      last = (hook->address + hook->length - 1) >> REGION_SHIFT;
+      for(i = first; i <= last; ++i)
+         s->region[i] = NULL;
+   }
+}
+
+PlasmaSim *plasma_create(void)
+{
+   State *s;
+
+   s = (State*)malloc(sizeof(State));
+   if(s == NULL)
+      return NULL;
+   state_init(s, machine_create());
+   s->batch = 1;
+   region_init(s);
+   cpu_create(s);
+   return s;
+}
+
+void plasma_destroy(PlasmaSim *s)
+{
+   int i;
+
+   for(i = 0; i < s->symbolCount; ++i)
+      free(s->symbol[i].name);
+   free(s->symbol);
+   machine_free(s->m);
+   free(s);
+}
+
+int plasma_load(PlasmaSim *s, const void *image, int length)
+{
+   int bytes;
+
+   library_reset(s->m);
+   if(image_elf((const unsigned char*)image, length))
+      symbol_load_elf(s, (const unsigned char*)image, length);
+   bytes = image_load(s, (const unsigned char*)image, length);
+   library_regions(s);
+   return bytes;
+}
+
+int plasma_load_file(PlasmaSim *s, const char *filename)
+{
+   unsigned char *image;
+   unsigned int size;
+   int length;
+
+   image = file_map(filename, &size);
+   if(image == NULL)
+      return -1;
+   length = plasma_load(s, image, (int)size);
+   mem_release(image, size);
+   return length;
+}
+
+void plasma_uart(PlasmaSim *s, FILE *in, FILE *out)
+{
+   s->uartIn = in;
+   s->uartOut = out ? out : stdout;
+}
+
+long long plasma_run(PlasmaSim *s, long long count)
+{
+   long long done=0;
+
+   while(done < count && cpu_stopped(s->m) == NULL)
+      done += cpu_round(s->m, count - done, 0);
+   if(s->m->uart->pending)
+      uart_flush(s);
+   return done;
+}
+
+int plasma_step(PlasmaSim *s)
+{
+   return (int)plasma_run(s, 1);
+}
+
+int plasma_exit_code(PlasmaSim *s)
+{
+   return s->exitCode;
+}
+
+unsigned int plasma_register(PlasmaSim *s, int index)
+{
+   switch(index)
+   {
+      case PLASMA_SR:    return s->status;
+      case PLASMA_LO:    return s->lo;
+      case PLASMA_HI:    return s->hi;
+      case PLASMA_BAD:   return s->faultAddr;
+      case PLASMA_CAUSE: return 0;
+      case PLASMA_PC:    return s->pc;
+   }
+   return index >= 0 && index < 32 ? (unsigned int)s->r[index] : 0;
+}
+
+void plasma_set_register(PlasmaSim *s, int index, unsigned int value)
+{
+   switch(index)
+   {
+      case PLASMA_SR:    s->status = value; return;
+      case PLASMA_LO:    s->lo = value; return;
+      case PLASMA_HI:    s->hi = value; return;
+      case PLASMA_BAD:   s->faultAddr = value; return;
+      case PLASMA_PC:
+         s->pc = value;
+         s->pc_next = value + 4;
+         s->skip = 0;
+         return;
+   }
+   if(index > 0 && index < 32)
+      s->r[index] = value;
+}
+
+int plasma_read_memory(PlasmaSim *s, unsigned int address, void *buffer, int length)
+{
+   int i;
+
+   for(i = 0; i < length && s->region[(address + i) >> REGION_SHIFT]; ++i)
+      ((unsigned char*)buffer)[i] = (unsigned char)mem_read(s, 1, address + i);
+   return i;
+}
+
+int plasma_write_memory(PlasmaSim *s, unsigned int address, const void *buffer, int length)
+{
+   int i;
+
+   for(i = 0; i < length && s->region[(address + i) >> REGION_SHIFT]; ++i)
+      mem_write(s, 1, address + i, ((const unsigned char*)buffer)[i]);
+   return i;
+}
+
+int plasma_mmio(PlasmaSim *s, unsigned int address, unsigned int length,
+                PlasmaMmioRead read, PlasmaMmioWrite write, void *arg)
+{
+   MmioHook *hook;
+
+   if(s->m->mmioHookCount == MMIO_HOOKS || length == 0 || address + length - 1 < address)
+      return -1;
+   hook = &s->m->mmioHook[s->m->mmioHookCount++];
+   hook->address = address;
+   hook->length = length;
+   hook->read = read;
+   hook->write = write;
+   hook->arg = arg;
+   library_regions(s);
+   return 0;
+}
+
+#else  //PLASMA_LIBRARY
 
 int main(int argc,char *argv[])
 {
    State state, *s=&state;
+   Timing timing;
    FILE *in;
-   int bytes, index;
-   printf("Plasma emulator\n");
-   memset(s, 0, sizeof(State));
-   s->big_endian = 1;
-   s->mem = (unsigned char*)malloc(MEM_SIZE);
-   memset(s->mem, 0, MEM_SIZE);
+   unsigned char *image;
+   unsigned int size;
+   int bytes, index, threads=0, elf;
+   long long max=0;
+   const char *mode="", *map=NULL, *trace=NULL, *restore=NULL, *gdb=NULL;
+   const char *ethSpec=NULL, *serial=NULL;
+
+   state_init(s, machine_create());
+   memset(&timing, 0, sizeof(timing));
+   timing.stages = 2;
+   if(argc >= 3 && argv[2][0] != '-')
+      mode = argv[2];
+   for(index = 2; index < argc; ++index)
+   {
+      if(strcmp(argv[index], "-batch") == 0)
+         s->batch = 1;
+      else if(strcmp(argv[index], "-break") == 0)
+         s->breakExit = 1;
+      else if(strcmp(argv[index], "-timing") == 0)
+         s->timing = &timing;
+      else if(strcmp(argv[index], "-stages") == 0 && index + 1 < argc)
+         timing.stages = atoi(argv[++index]);
+      else if(strcmp(argv[index], "-cache") == 0)
+         timing.useCache = 1;
+      else if(strcmp(argv[index], "-icache") == 0 && index + 1 < argc)
+         s->icache = cache_model_create("I", argv[++index]);
+      else if(strcmp(argv[index], "-dcache") == 0 && index + 1 < argc)
+         s->dcache = cache_model_create("D", argv[++index]);
+      else if(strcmp(argv[index], "-ucache") == 0 && index + 1 < argc)
+         s->icache = s->dcache = cache_model_create("Unified", argv[++index]);
+      else if(strcmp(argv[index], "-profile") == 0 && index + 1 < argc)
+      {
+         if(s->profile == NULL)
+            s->profile = profile_create();
+         s->profile->filename = argv[++index];
+      }
+      else if(strcmp(argv[index], "-folded") == 0 && index + 1 < argc)
+      {
+         if(s->profile == NULL)
+            s->profile = profile_create();
+         s->profile->folded = argv[++index];
+      }
+      else if(strcmp(argv[index], "-trace") == 0 && index + 1 < argc)
+         trace = argv[++index];
+      else if(strcmp(argv[index], "-save") == 0 && index + 1 < argc)
+         s->snapshotFile = argv[++index];
+      else if(strcmp(argv[index], "-restore") == 0 && index + 1 < argc)
+         restore = argv[++index];
+      else if(strcmp(argv[index], "-map") == 0 && index + 1 < argc)
+         map = argv[++index];
+      else if(strcmp(argv[index], "-cpus") == 0 && index + 1 < argc)
+      {
+         s->m->cpuCount = atoi(argv[++index]);
+         if(s->m->cpuCount < 1 || s->m->cpuCount > CPU_MAX)
+            argc = 0;
+      }
+      else if(strcmp(argv[index], "-quantum") == 0 && index + 1 < argc)
+         s->m->cpuQuantum = atoi(argv[++index]) > 0 ? atoi(argv[index]) : 1;
+      else if(strcmp(argv[index], "-random") == 0 && index + 1 < argc)
+      {
+         s->m->cpuRandom = 1;
+         s->m->cpuSeed = strtoul(argv[++index], NULL, 0);
+      }
+#ifdef ENABLE_THREADS
+      else if(strcmp(argv[index], "-threads") == 0)
+         threads = 1;
+#endif
+#ifdef ENABLE_GDB
+      else if(strcmp(argv[index], "-gdb") == 0 && index + 1 < argc)
+         gdb = argv[++index];
+#endif
+#ifdef ENABLE_ETHERNET
+      else if(strcmp(argv[index], "-eth") == 0 && index + 1 < argc)
+         ethSpec = argv[++index];
+#endif
+#ifdef ENABLE_SERIAL
+      else if(strcmp(argv[index], "-serial") == 0 && index + 1 < argc)
+         serial = argv[++index];
+#endif
+      else if(strcmp(argv[index], "-baud") == 0 && index + 1 < argc)
+      {
+         //25MHz clock and 10 bits per byte as in uart.vhd
+         s->m->uart->cycles = atoi(argv[++index]) > 0 ? 250000000 / atoi(argv[index]) : 0;
+      }
+      else if(strcmp(argv[index], "-fifo") == 0 && index + 1 < argc)
+      {
+         s->m->uart->fifo = atoi(argv[++index]);
+         if(s->m->uart->fifo < 1 || s->m->uart->fifo > UART_FIFO_MAX)
+            argc = 0;
+      }
+      else if(strcmp(argv[index], "-ram") == 0 && index + 2 < argc)
+      {
+         if(mem_bank_add(s->m, mem_size(argv[index + 1]), mem_size(argv[index + 2])))
+         {
+            printf("Bad -ram %s %s\n", argv[index + 1], argv[index + 2]);
+            return 1;
+         }
+         index += 2;
+      }
+      else if(strcmp(argv[index], "-flash") == 0 && index + 1 < argc)
+      {
+         if(flash_open(s->m->flash, argv[++index]))
+         {
+            printf("Can't open flash %s\n", argv[index]);
+            return 1;
+         }
+      }
+      else if(strcmp(argv[index], "-max") == 0 && index + 1 < argc)
+         max = strtoll(argv[++index], NULL, 0);
+      else if(strcmp(argv[index], "-uart") == 0 && index + 1 < argc)
+         s->uartOut = fopen(argv[++index], "wb");
+      else if(strcmp(argv[index], "-input") == 0 && index + 1 < argc)
+         s->uartIn = fopen(argv[++index], "rb");
+      else if(argv[index][0] == '-')
+         argc = 0;
+   }
+   if(s->uartOut == NULL)
+   {
+      printf("Can't open UART output file\n");
+      return 1;
+   }
+   if(gdb && strcmp(gdb, "-") == 0)
+   {
+      //stdin and stdout carry the protocol
+      s->batch = 1;
+      if(s->uartOut == stdout)
+         s->uartOut = stderr;
+   }
+   if(s->batch == 0)
+      printf("Plasma emulator\n");
    if(argc <= 1) 
    {
       printf("   Usage:  mlite file.exe\n");
+      printf("           mlite test.axf     {ELF: segments, BSS, $gp and symbols}\n");
       printf("           mlite file.exe B   {for big_endian}\n");
       printf("           mlite file.exe L   {for little_endian}\n");
       printf("           mlite file.exe BD  {disassemble big_endian}\n");
       printf("           mlite file.exe LD  {disassemble little_endian}\n");
+      printf("   Batch options (run without the debugger):\n");
+      printf("           -batch             {exit code is the value written to SIM_EXIT}\n");
+      printf("           -break             {BREAK n stops with exit code n}\n");
+      printf("           -max count         {stop after count opcodes, exit 124}\n");
+      printf("           -uart file         {write UART output to file}\n");
+      printf("           -input file        {read UART input from file}\n");
+      printf("           -save file         {snapshot on SIM_SNAPSHOT or -max}\n");
+      printf("   Multiple CPUs (see CPU_START in plasma.h):\n");
+      printf("           -cpus n            {simulate up to %d CPUs}\n", CPU_MAX);
+      printf("           -quantum n         {opcodes per CPU turn}\n");
+      printf("           -random seed       {random CPU order and turn length}\n");
+      printf("           -threads           {one host thread per CPU, -max per CPU}\n");
+      printf("           -restore file      {resume from a snapshot of this image}\n");
+      printf("   Memory (default 1M at 0 and 64M of DDR at 0x10000000):\n");
+      printf("           -ram address size  {RAM bank, replaces banks it overlaps}\n");
+      printf("           -flash file        {16-bit flash image at 0x30000000}\n");
+      printf("   UART (see uart.vhd):\n");
+      printf("           -baud rate         {pace the UART, default is instant}\n");
+      printf("           -fifo depth        {receive and transmit FIFO bytes}\n");
+#ifdef ENABLE_SERIAL
+      printf("           -serial pty        {pseudo-terminal, name is printed}\n");
+      printf("           -serial unix:path  {SOCK_STREAM peer at path}\n");
+      printf("           -serial fd:n       {inherited descriptor}\n");
+#endif
+#ifdef ENABLE_ETHERNET
+      printf("   Ethernet (see eth_dma.vhd):\n");
+      printf("           -eth tap:name      {Linux TAP device}\n");
+      printf("           -eth unix:path     {SOCK_SEQPACKET peer at path}\n");
+      printf("           -eth fd:n          {inherited socket}\n");
+      printf("           -eth pcap:in[,out] {replay in.pcap, record to out.pcap}\n");
+#endif
+#ifdef ENABLE_GDB
+      printf("   Debugging:\n");
+      printf("           -gdb port          {gdb remote protocol on localhost:port}\n");
+      printf("           -gdb -             {gdb remote protocol on stdin/stdout}\n");
+#endif
+      printf("   Timing options:\n");
+      printf("           -timing            {estimate FPGA clock cycles}\n");
+      printf("           -stages n          {2 or 3 pipeline stages}\n");
+      printf("           -cache             {model the 4KB DDR cache}\n");
+      printf("   Cache statistics (size,line,ways[,lru|random][,wb|wt]):\n");
+      printf("           -icache config     {instruction cache}\n");
+      printf("           -dcache config     {data cache}\n");
+      printf("           -ucache config     {unified cache}\n");
+      printf("           -map file          {symbols from test.map or an ELF file}\n");
+      printf("   Profiling:\n");
+      printf("           -profile file      {flat profile and call graph}\n");
+      printf("           -folded file       {stacks for flamegraph.pl}\n");
+      printf("           -trace file        {binary trace, see tracebin.h}\n");
 
       return 0;
    }
-   in = fopen(argv[1], "rb");
-   if(in == NULL) 
+   image = file_map(argv[1], &size);
+   if(image == NULL) 
    { 
       printf("Can't open file %s!\n",argv[1]); 
+      if(s->batch)
+         return 1;
       getch(); 
       return(0); 
    }
-   bytes = fread(s->mem, 1, MEM_SIZE, in);
-   fclose(in);
-   memcpy(s->mem + 1024*1024, s->mem, 1024*1024);  //internal 8KB SRAM
-   printf("Read %d bytes.\n", bytes);
-   cache_init();
-   if(argc == 3 && argv[2][0] == 'B') 
-   {
-      printf("Big Endian\n");
-      s->big_endian = 1;
-   }
-   if(argc == 3 && argv[2][0] == 'L') 
-   {
-      printf("Big Endian\n");
-      s->big_endian = 0;
-   }
-   s->processId = 0;
-   if(argc == 3 && argv[2][0] == 'S') 
+   bytes = (int)size;
+   elf = image_elf(image, bytes);
+   if(elf)
+      mode = "";
+   if(mode[0] == 'S') 
    {  /*make big endian*/
       printf("Big Endian\n");
-      for(index = 0; index < bytes+3; index += 4) 
+      for(index = 0; index + 4 <= bytes; index += 4) 
       {
-         *(unsigned int*)&s->mem[index] = htonl(*(unsigned int*)&s->mem[index]);
+         *(unsigned int*)&image[index] = htonl(*(unsigned int*)&image[index]);
       }
       in = fopen("big.exe", "wb");
-      fwrite(s->mem, bytes, 1, in);
+      fwrite(image, bytes, 1, in);
       fclose(in);
       return(0);
    }
-   if(argc == 3 && argv[2][1] == 'D') 
+   if(mode[0] == 'L') 
+      s->big_endian = 0;
+   if(elf && map == NULL)
+      symbol_load_elf(s, image, bytes);
+   bytes = image_load(s, image, bytes);
+   mem_release(image, size);
+   if(bytes < 0)
+   {
+      printf("Can't load ELF file %s\n", argv[1]);
+      return 1;
+   }
+   if(s->batch == 0)
+      printf("Read %d bytes.\n", bytes);
+   if(mode[0] == 'B' || mode[0] == 'L') 
+      printf("Big Endian\n");
+   cache_init();
+   if(mode[0] && mode[1] == 'D') 
    {  /*dump image*/
       for(index = 0; index < bytes; index += 4) {
          s->pc = index;
          cycle(s, 10);
       }
-      free(s->mem);
+      machine_free(s->m);
       return(0);
    }
-   s->pc = 0x0;
-   index = mem_read(s, 4, 0);
-   if((index & 0xffffff00) == 0x3c1c1000)
-      s->pc = 0x10000000;
+   if(s->timing)
+      timing_init(s->timing, timing.stages, timing.useCache);
+#ifdef ENABLE_SERIAL
+   if(serial && uart_open(s->m->uart, serial))
+   {
+      printf("Can't open serial %s\n", serial);
+      return 1;
+   }
+#endif
+#ifdef ENABLE_ETHERNET
+   if(ethSpec && eth_open(s, ethSpec))
+   {
+      printf("Can't open Ethernet %s\n", ethSpec);
+      return 1;
+   }
+#endif
+   cpu_create(s);
+   if(s->snapshotFile)
+      snapshot_base(s->m);
+   if(restore && snapshot_restore(s, restore))
+   {
+      printf("Can't restore %s\n", restore);
+      return 1;
+   }
+   if(map && symbol_load(s, map) < 0)
+      printf("Can't open %s\n", map);
+   if(trace && (s->trace = trace_create(s, trace)) == NULL)
+      printf("Can't open %s\n", trace);
+   s->instrument = s->timing || s->icache || s->dcache || s->profile || s->trace;
+   //Threads can't share the predecode and JIT tables
+   s->m->threads = threads;
+   for(index = 0; index < s->m->cpuCount && threads; ++index)
+      s->m->cpuList[index]->fence = s->m->cpuCount > 1;
+#ifdef ENABLE_GDB
+   if(gdb)
+   {
+      index = gdb_serve(s, gdb);
+      instrument_report(s);
+      machine_free(s->m);
+      return index;
+   }
+#endif
+   if(s->batch)
+   {
+      index = run_batch(s, max, threads);
+      if(index == 124 && s->snapshotFile && snapshot_save(s, s->snapshotFile))
+         printf("Can't save %s\n", s->snapshotFile);
+      instrument_report(s);
+      machine_free(s->m);
+      return index;
+   }
    do_debug(s);
-   free(s->mem);
+   instrument_report(s);
+   machine_free(s->m);
    return(0);
 }
-
+#endif  //PLASMA_LIBRARY
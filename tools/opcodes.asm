@@ -682,6 +682,23 @@ BreakTest:
    sb    $23,0($20)
    sb    $21,0($20)
 
+   #r: MTC0 in a branch delay slot (loop long enough for mlite's JIT)
+   ori   $2,$0,'r'
+   sb    $2,0($20)
+   ori   $5,$0,100
+   ori   $3,$0,0
+$R1:
+   addiu $3,$3,1
+   addiu $5,$5,-1
+   bnez  $5,$R1
+   mtc0  $0,$12
+   xori  $3,$3,100
+   ori   $2,$0,'A'
+   add   $2,$2,$3
+   sb    $2,0($20)
+   sb    $23,0($20)
+   sb    $21,0($20)
+
 
    ######################################
    #Load, Store, and Memory Control Instructions
@@ -781,9 +798,9 @@ LoadTest:
    li    $3,'A'
    sw    $3,16($2)
    ori   $3,$0,0
-   lwl   $2,16($2)
-   lwr   $2,16($2)
-   sb    $2,0($20)
+   lwl   $3,16($2)
+   lwr   $3,19($2)
+   sb    $3,0($20)
    sb    $23,0($20)
    sb    $21,0($20)
 
@@ -831,7 +848,7 @@ LoadTest:
    or    $2,$0,$24
    li    $3,0x41424344
    swl   $3,16($2)
-   swr   $3,16($2)
+   swr   $3,19($2)
    lb    $4,16($2)
    sb    $4,0($20)
    lb    $4,17($2)
@@ -26,6 +26,11 @@
 #define GPIOA_IN          0x20000050
 #define COUNTER_REG       0x20000060
 #define ETHERNET_REG      0x20000070
+#define SIM_EXIT          0x200000f0 //mlite.exe only: exit with value
+#define SIM_SNAPSHOT      0x200000f4 //mlite.exe only: save snapshot
+#define CPU_INDEX         0x200000d0 //mlite.exe -cpus only: this CPU's index
+#define CPU_STACK         0x200000d4 //mlite.exe -cpus only: $sp for CPU_START
+#define CPU_START         0x200000d8 //mlite.exe -cpus only: start next CPU at PC
 #define FLASH_BASE        0x30000000
 
 /*********** GPIO out bits ***************/
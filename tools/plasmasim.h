@@ -0,0 +1,116 @@
+/*--------------------------------------------------------------------
+ * TITLE: Plasma Simulator Library
+ * DATE CREATED: 10/16/26
+ * FILENAME: plasmasim.h
+ * PROJECT: Plasma CPU core
+ * COPYRIGHT: Software placed into the public domain by the author.
+ *    Software 'as is' without warranty.  Author liable for nothing.
+ * DESCRIPTION:
+ *    Calls for linking the mlite simulator into test harnesses and
+ *    fuzzers.  Build libplasmasim.a with "make libplasmasim.a", which
+ *    compiles mlite.c with -DPLASMA_LIBRARY so it has no main() and
+ *    no -gdb, -eth or -serial backends.  Link with -lpthread.
+ *
+ *    Each PlasmaSim owns its memory, peripherals, decode table and
+ *    translated code, so a process may create several and run them
+ *    from different threads (see regress.c).  Only one thread at a
+ *    time may call into any one PlasmaSim.
+ *
+ *       PlasmaSim *sim = plasma_create();
+ *       plasma_load_file(sim, "test.axf");
+ *       plasma_run(sim, 1000000);
+ *       code = plasma_exit_code(sim);
+ *       plasma_destroy(sim);
+ *--------------------------------------------------------------------*/
+#ifndef __PLASMASIM_H__
+#define __PLASMASIM_H__
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct PlasmaSim_s PlasmaSim;
+
+//Register numbers after r0-r31; the same order as gdb uses
+#define PLASMA_SR     32
+#define PLASMA_LO     33
+#define PLASMA_HI     34
+#define PLASMA_BAD    35
+#define PLASMA_CAUSE  36
+#define PLASMA_PC     37
+
+//MMIO callbacks see the address and access size in bytes.  Values are
+//in CPU order: a byte store passes the byte in bits 7:0.
+typedef unsigned int (*PlasmaMmioRead)(void *arg, unsigned int address, int size);
+typedef void (*PlasmaMmioWrite)(void *arg, unsigned int address, int size,
+                                unsigned int value);
+
+PlasmaSim *plasma_create(void);
+void plasma_destroy(PlasmaSim *sim);
+
+//Load an ELF file or a flat big endian binary linked at 0 or 0x10000000.
+//Returns the bytes loaded or -1.
+int plasma_load(PlasmaSim *sim, const void *image, int length);
+int plasma_load_file(PlasmaSim *sim, const char *filename);
+
+//UART input and output files; output defaults to stdout
+void plasma_uart(PlasmaSim *sim, FILE *in, FILE *out);
+
+//Execute up to count opcodes.  Returns the opcodes executed, which is
+//less than count once the image writes SIM_EXIT or stops.
+long long plasma_run(PlasmaSim *sim, long long count);
+int plasma_step(PlasmaSim *sim);
+
+//Value written to SIM_EXIT, or -1 while running
+int plasma_exit_code(PlasmaSim *sim);
+
+unsigned int plasma_register(PlasmaSim *sim, int index);
+void plasma_set_register(PlasmaSim *sim, int index, unsigned int value);
+
+//Copy bytes to or from RAM.  Returns the bytes copied, which is less
+//than length at the first address that isn't RAM.
+int plasma_read_memory(PlasmaSim *sim, unsigned int address, void *buffer, int length);
+int plasma_write_memory(PlasmaSim *sim, unsigned int address, const void *buffer, int length);
+
+//Route loads and stores to [address, address+length) to callbacks
+//before the built-in peripherals.  Outside 0x20000000-0x2fffffff the
+//1MB regions covered stop being RAM.  Returns 0 or -1 if full.
+int plasma_mmio(PlasmaSim *sim, unsigned int address, unsigned int length,
+                PlasmaMmioRead read, PlasmaMmioWrite write, void *arg);
+
+#ifdef __cplusplus
+}
+
+namespace plasma {
+//Owns a PlasmaSim; check valid() since plasma_create() can fail
+class Sim {
+public:
+   Sim() : sim_(plasma_create()) {}
+   ~Sim() { if(sim_) plasma_destroy(sim_); }
+   bool valid() const { return sim_ != NULL; }
+   int load(const void *image, int length) { return plasma_load(sim_, image, length); }
+   int load(const char *filename) { return plasma_load_file(sim_, filename); }
+   void uart(FILE *in, FILE *out) { plasma_uart(sim_, in, out); }
+   long long run(long long count) { return plasma_run(sim_, count); }
+   int step() { return plasma_step(sim_); }
+   int exitCode() { return plasma_exit_code(sim_); }
+   unsigned int reg(int index) { return plasma_register(sim_, index); }
+   void setReg(int index, unsigned int value) { plasma_set_register(sim_, index, value); }
+   int read(unsigned int address, void *buffer, int length)
+      { return plasma_read_memory(sim_, address, buffer, length); }
+   int write(unsigned int address, const void *buffer, int length)
+      { return plasma_write_memory(sim_, address, buffer, length); }
+   int mmio(unsigned int address, unsigned int length,
+            PlasmaMmioRead read, PlasmaMmioWrite write, void *arg)
+      { return plasma_mmio(sim_, address, length, read, write, arg); }
+   PlasmaSim *get() { return sim_; }
+private:
+   Sim(const Sim&);
+   Sim &operator=(const Sim&);
+   PlasmaSim *sim_;
+};
+}
+#endif
+
+#endif //__PLASMASIM_H__
@@ -0,0 +1,330 @@
+/*--------------------------------------------------------------------
+ * TITLE: Plasma Regression Runner
+ * DATE CREATED: 10/16/26
+ * FILENAME: regress.c
+ * PROJECT: Plasma CPU core
+ * COPYRIGHT: Software placed into the public domain by the author.
+ *    Software 'as is' without warranty.  Author liable for nothing.
+ * DESCRIPTION:
+ *    Runs the firmware images listed in a manifest on libplasmasim.a,
+ *    one simulator per host thread, and compares the UART output of
+ *    each against the expected output.
+ *
+ *    Each manifest line is "name image input expected [-max count]".
+ *    input is "-" for no UART input.  expected is "-" to only require
+ *    exit code 0.  Paths are relative to the manifest.  '#' starts a
+ *    comment.  For example:
+ *       count   test.axf   -        count.txt   -max 50000000
+ *       rtos    rtos.axf   keys.txt rtos.txt
+ *
+ *    Every test gets its own PlasmaSim so images never share the
+ *    decode table, JIT code or peripheral state (see plasmasim.h).
+ *--------------------------------------------------------------------*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "plasmasim.h"
+
+#define LINE_SIZE 1024
+#define PATH_SIZE (LINE_SIZE + 256)
+#define RUN_SLICE 10000000   //opcodes between checks of -max
+
+typedef struct {
+   char line[LINE_SIZE];
+   char *name, *image, *input, *expected;
+   long long max;           //opcodes before a timeout, 0 for no limit
+   char output[64];         //UART output file
+   int status;              //TEST_* or the exit code
+} Test;
+
+#define TEST_NO_IMAGE  -1
+#define TEST_NO_FILE   -2
+#define TEST_TIMEOUT   -3
+#define TEST_STOPPED   -4
+
+static Test *test;
+static int testCount;
+static int testNext;
+static int passed;
+static int keep;
+static const char *directory = ".";
+static pthread_mutex_t testLock = PTHREAD_MUTEX_INITIALIZER;
+
+static int manifest_load(const char *name)
+{
+   FILE *in;
+   char line[LINE_SIZE], *ptr;
+   Test *t;
+   int size=0;
+
+   in = fopen(name, "r");
+   if(in == NULL)
+      return -1;
+   while(fgets(line, sizeof(line), in))
+   {
+      ptr = strchr(line, '#');
+      if(ptr)
+         *ptr = 0;
+      if(strspn(line, " \t\r\n") == strlen(line))
+         continue;
+      if(testCount == size)
+      {
+         size = size ? size * 2 : 64;
+         test = (Test*)realloc(test, size * sizeof(Test));
+      }
+      t = &test[testCount];
+      memset(t, 0, sizeof(Test));
+      strcpy(t->line, line);
+      t->name = strtok(t->line, " \t\r\n");
+      t->image = strtok(NULL, " \t\r\n");
+      t->input = strtok(NULL, " \t\r\n");
+      t->expected = strtok(NULL, " \t\r\n");
+      while((ptr = strtok(NULL, " \t\r\n")) != NULL)
+      {
+         if(strcmp(ptr, "-max") == 0 && (ptr = strtok(NULL, " \t\r\n")))
+            t->max = atoll(ptr);
+         else
+            break;
+      }
+      if(t->expected == NULL || ptr)
+      {
+         printf("%s: bad line %s\n", name, line);
+         fclose(in);
+         return -1;
+      }
+      ++testCount;
+   }
+   fclose(in);
+   return 0;
+}
+
+//Manifest paths are relative to the manifest's directory
+static void path_get(char *path, const char *name)
+{
+   if(name[0] == '/')
+      strcpy(path, name);
+   else
+      sprintf(path, "%s/%s", directory, name);
+}
+
+static void test_run(Test *t)
+{
+   char path[PATH_SIZE];
+   PlasmaSim *sim;
+   FILE *in=NULL, *out;
+   long long count, ran, done=0;
+   int fd;
+
+   strcpy(t->output, "/tmp/regress.XXXXXX");
+   fd = mkstemp(t->output);
+   if(fd < 0 || (out = fdopen(fd, "wb")) == NULL)
+   {
+      t->status = TEST_NO_FILE;
+      return;
+   }
+   if(strcmp(t->input, "-"))
+   {
+      path_get(path, t->input);
+      in = fopen(path, "rb");
+      if(in == NULL)
+      {
+         fclose(out);
+         t->status = TEST_NO_FILE;
+         return;
+      }
+   }
+   sim = plasma_create();
+   path_get(path, t->image);
+   if(sim == NULL || plasma_load_file(sim, path) < 0)
+      t->status = TEST_NO_IMAGE;
+   else
+   {
+      plasma_uart(sim, in, out);
+      for(;;)
+      {
+         count = RUN_SLICE;
+         if(t->max && t->max - done < count)
+            count = t->max - done;
+         ran = plasma_run(sim, count);
+         done += ran;
+         t->status = plasma_exit_code(sim);
+         if(t->status >= 0)
+            break;
+         if(ran < count)
+         {
+            //Stopped at a BREAK or SYNC without writing SIM_EXIT
+            t->status = TEST_STOPPED;
+            break;
+         }
+         if(t->max && done >= t->max)
+         {
+            t->status = TEST_TIMEOUT;
+            break;
+         }
+      }
+   }
+   if(sim)
+      plasma_destroy(sim);
+   if(in)
+      fclose(in);
+   fclose(out);
+}
+
+//Offset of the first difference or -1 if the files match
+static long file_compare(const char *name1, const char *name2)
+{
+   FILE *in1, *in2;
+   long offset=0;
+   int ch1, ch2;
+
+   in1 = fopen(name1, "rb");
+   in2 = fopen(name2, "rb");
+   if(in1 == NULL || in2 == NULL)
+   {
+      if(in1)
+         fclose(in1);
+      if(in2)
+         fclose(in2);
+      return 0;
+   }
+   for(;;)
+   {
+      ch1 = getc(in1);
+      ch2 = getc(in2);
+      if(ch1 != ch2)
+         break;
+      if(ch1 == EOF)
+      {
+         offset = -1;
+         break;
+      }
+      ++offset;
+   }
+   fclose(in1);
+   fclose(in2);
+   return offset;
+}
+
+//Returns 1 if the test passed
+static int test_check(Test *t)
+{
+   char expected[PATH_SIZE];
+   int code = t->status;
+   long offset=-1;
+
+   if(code < 0)
+      offset = 0;
+   else if(strcmp(t->expected, "-"))
+   {
+      path_get(expected, t->expected);
+      offset = file_compare(t->output, expected);
+   }
+   else if(code)
+      offset = 0;
+   if(code == TEST_NO_IMAGE)
+      printf("FAIL %-20s can't load %s\n", t->name, t->image);
+   else if(code == TEST_NO_FILE)
+      printf("FAIL %-20s can't open %s or a temporary file\n", t->name, t->input);
+   else if(code == TEST_TIMEOUT)
+      printf("FAIL %-20s timeout (-max)\n", t->name);
+   else if(code == TEST_STOPPED)
+      printf("FAIL %-20s stopped without an exit code\n", t->name);
+   else if(offset >= 0)
+      printf("FAIL %-20s exit %d, output differs at byte %ld\n",
+         t->name, code, offset);
+   else
+      printf("PASS %-20s exit %d\n", t->name, code);
+   if(offset >= 0 && keep && t->output[0])
+      printf("     output kept in %s\n", t->output);
+   else if(t->output[0])
+      unlink(t->output);
+   fflush(stdout);
+   return offset < 0;
+}
+
+//Each worker takes the next test until the manifest is done
+static void *test_thread(void *arg)
+{
+   Test *t;
+   (void)arg;
+
+   for(;;)
+   {
+      pthread_mutex_lock(&testLock);
+      t = testNext < testCount ? &test[testNext++] : NULL;
+      pthread_mutex_unlock(&testLock);
+      if(t == NULL)
+         break;
+      test_run(t);
+      pthread_mutex_lock(&testLock);
+      passed += test_check(t);
+      pthread_mutex_unlock(&testLock);
+   }
+   return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+   static char path[LINE_SIZE];
+   int index, jobs, i;
+   const char *manifest=NULL;
+   pthread_t *thread;
+   char *ptr;
+   time_t start;
+
+   jobs = (int)sysconf(_SC_NPROCESSORS_ONLN);
+   for(index = 1; index < argc; ++index)
+   {
+      if(strcmp(argv[index], "-j") == 0 && index + 1 < argc)
+         jobs = atoi(argv[++index]);
+      else if(strcmp(argv[index], "-k") == 0)
+         keep = 1;
+      else if(argv[index][0] != '-' && manifest == NULL)
+         manifest = argv[index];
+      else
+         manifest = NULL, index = argc;
+   }
+   if(manifest == NULL)
+   {
+      printf("Usage: regress [-j jobs] [-k] manifest\n");
+      printf("   -j jobs      {simulators at once, default is one per core}\n");
+      printf("   -k           {keep the UART output of failed tests}\n");
+      return 2;
+   }
+   if(jobs < 1)
+      jobs = 1;
+   if(manifest_load(manifest))
+   {
+      printf("Can't read %s\n", manifest);
+      return 2;
+   }
+   if(jobs > testCount)
+      jobs = testCount ? testCount : 1;
+   strncpy(path, manifest, sizeof(path) - 1);
+   ptr = strrchr(path, '/');
+   if(ptr)
+   {
+      *ptr = 0;
+      directory = path[0] ? path : "/";
+   }
+
+   start = time(NULL);
+   thread = (pthread_t*)malloc(jobs * sizeof(pthread_t));
+   for(i = 0; i < jobs; ++i)
+   {
+      if(pthread_create(&thread[i], NULL, test_thread, NULL))
+      {
+         printf("Can't start a thread\n");
+         return 2;
+      }
+   }
+   for(i = 0; i < jobs; ++i)
+      pthread_join(thread[i], NULL);
+   free(thread);
+   printf("%d passed, %d failed, %d jobs, %d seconds\n",
+      passed, testCount - passed, jobs, (int)(time(NULL) - start));
+   return passed != testCount;
+}
@@ -0,0 +1,235 @@
+/*--------------------------------------------------------------------
+ * TITLE: Plasma Binary Trace Reader
+ * DATE CREATED: 10/16/26
+ * FILENAME: tracebin.c
+ * PROJECT: Plasma CPU core
+ * COPYRIGHT: Software placed into the public domain by the author.
+ *    Software 'as is' without warranty.  Author liable for nothing.
+ * DESCRIPTION:
+ *    Prints and filters the binary traces written by
+ *    "mlite test.bin -trace trace.bin".  The format is in tracebin.h.
+ *--------------------------------------------------------------------*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "tracebin.h"
+
+static char *opcode_string[]={
+   "SPECIAL","REGIMM","J","JAL","BEQ","BNE","BLEZ","BGTZ",
+   "ADDI","ADDIU","SLTI","SLTIU","ANDI","ORI","XORI","LUI",
+   "COP0","COP1","COP2","COP3","BEQL","BNEL","BLEZL","BGTZL",
+   "?","?","?","?","?","?","?","?",
+   "LB","LH","LWL","LW","LBU","LHU","LWR","?",
+   "SB","SH","SWL","SW","?","?","SWR","CACHE",
+   "LL","LWC1","LWC2","LWC3","?","LDC1","LDC2","LDC3",
+   "SC","SWC1","SWC2","SWC3","?","SDC1","SDC2","SDC3"
+};
+
+static char *special_string[]={
+   "SLL","?","SRL","SRA","SLLV","?","SRLV","SRAV",
+   "JR","JALR","MOVZ","MOVN","SYSCALL","BREAK","?","SYNC",
+   "MFHI","MTHI","MFLO","MTLO","?","?","?","?",
+   "MULT","MULTU","DIV","DIVU","?","?","?","?",
+   "ADD","ADDU","SUB","SUBU","AND","OR","XOR","NOR",
+   "?","?","SLT","SLTU","?","DADDU","?","?",
+   "TGE","TGEU","TLT","TLTU","TEQ","?","TNE","?",
+   "?","?","?","?","?","?","?","?"
+};
+
+static char *regimm_string[]={
+   "BLTZ","BGEZ","BLTZL","BGEZL","?","?","?","?",
+   "TGEI","TGEIU","TLTI","TLTIU","TEQI","?","TNEI","?",
+   "BLTZAL","BEQZAL","BLTZALL","BGEZALL","?","?","?","?",
+   "?","?","?","?","?","?","?","?"
+};
+
+typedef struct {
+   int tag;
+   unsigned int pc, opcode, address, value;
+   int regCount;
+   unsigned char reg[TRACE_REGISTERS];
+   unsigned int regValue[TRACE_REGISTERS];
+} Record;
+
+static unsigned int get_varint(FILE *in)
+{
+   unsigned int value=0;
+   int shift=0, ch;
+   do
+   {
+      ch = getc(in);
+      if(ch == EOF)
+         return 0;
+      value |= (ch & 0x7f) << shift;
+      shift += 7;
+   } while(ch & 0x80);
+   return value;
+}
+
+static unsigned int get_word(FILE *in)
+{
+   unsigned int value;
+   value = getc(in);
+   value |= getc(in) << 8;
+   value |= getc(in) << 16;
+   value |= (unsigned int)getc(in) << 24;
+   return value;
+}
+
+static const char *opcode_name(unsigned int opcode)
+{
+   unsigned int op = opcode >> 26;
+   if(op == 0)
+      return special_string[opcode & 0x3f];
+   if(op == 1)
+      return regimm_string[(opcode >> 16) & 0x1f];
+   return opcode_string[op];
+}
+
+int main(int argc, char *argv[])
+{
+   FILE *in;
+   unsigned char header[TRACE_HEADER_SIZE];
+   static unsigned int opcodeValue[TRACE_OPCODE_CACHE];
+   Record r;
+   unsigned int lastPc, lastAddress=0, delta, start=0, end=0xffffffff, address=0;
+   long long index, first=0, count=-1, printed=0;
+   long long skipped=0, loads=0, stores=0, regWrites=0, bytes;
+   int i, tag, reg=-1, useAddress=0, stats=0, match;
+
+   if(argc < 2)
+   {
+      printf("Usage: tracebin trace.bin [options]\n");
+      printf("   -start pc -end pc   {only opcodes in this address range}\n");
+      printf("   -first n            {skip the first n opcodes}\n");
+      printf("   -count n            {print at most n opcodes}\n");
+      printf("   -reg n              {only opcodes changing r[n] (32=HI 33=LO)}\n");
+      printf("   -addr address       {only loads and stores to this word}\n");
+      printf("   -stats              {summary only}\n");
+      return 0;
+   }
+   for(i = 2; i < argc; ++i)
+   {
+      if(strcmp(argv[i], "-start") == 0 && i + 1 < argc)
+         start = strtoul(argv[++i], NULL, 16);
+      else if(strcmp(argv[i], "-end") == 0 && i + 1 < argc)
+         end = strtoul(argv[++i], NULL, 16);
+      else if(strcmp(argv[i], "-first") == 0 && i + 1 < argc)
+         first = strtoll(argv[++i], NULL, 0);
+      else if(strcmp(argv[i], "-count") == 0 && i + 1 < argc)
+         count = strtoll(argv[++i], NULL, 0);
+      else if(strcmp(argv[i], "-reg") == 0 && i + 1 < argc)
+         reg = atoi(argv[++i]);
+      else if(strcmp(argv[i], "-addr") == 0 && i + 1 < argc)
+      {
+         address = strtoul(argv[++i], NULL, 16) & ~3;
+         useAddress = 1;
+      }
+      else if(strcmp(argv[i], "-stats") == 0)
+         stats = 1;
+   }
+
+   in = fopen(argv[1], "rb");
+   if(in == NULL)
+   {
+      printf("Can't open %s\n", argv[1]);
+      return -1;
+   }
+   if(fread(header, 1, TRACE_HEADER_SIZE, in) != TRACE_HEADER_SIZE ||
+      memcmp(header, TRACE_MAGIC, 4) || header[4] != TRACE_VERSION)
+   {
+      printf("%s isn't a version %d trace\n", argv[1], TRACE_VERSION);
+      return -1;
+   }
+   lastPc = header[8] | (header[9] << 8) | (header[10] << 16) |
+      ((unsigned int)header[11] << 24);
+   lastPc -= 4;
+
+   for(index = 0; ; ++index)
+   {
+      tag = getc(in);
+      if(tag == EOF || tag == TRACE_END)
+         break;
+      memset(&r, 0, sizeof(r));
+      r.tag = tag;
+      r.pc = lastPc + 4;
+      if(tag & TRACE_PC)
+      {
+         delta = get_varint(in);
+         r.pc += TRACE_UNZIGZAG(delta) << 2;
+      }
+      if(tag & TRACE_OPCODE)
+         opcodeValue[TRACE_OPCODE_INDEX(r.pc)] = get_word(in);
+      r.opcode = opcodeValue[TRACE_OPCODE_INDEX(r.pc)];
+      if(tag & TRACE_REG)
+      {
+         r.regCount = getc(in);
+         for(i = 0; i < r.regCount && i < TRACE_REGISTERS; ++i)
+         {
+            r.reg[i] = (unsigned char)getc(in);
+            r.regValue[i] = get_varint(in);
+         }
+      }
+      if(tag & TRACE_MEM)
+      {
+         delta = get_varint(in);
+         r.address = lastAddress + TRACE_UNZIGZAG(delta);
+         lastAddress = r.address;
+      }
+      if(tag & TRACE_STORE)
+         r.value = get_varint(in);
+      lastPc = r.pc;
+
+      skipped += (tag & TRACE_SKIP) != 0;
+      stores += (tag & TRACE_STORE) != 0;
+      loads += (tag & (TRACE_MEM | TRACE_STORE)) == TRACE_MEM;
+      regWrites += r.regCount;
+
+      //Filters
+      if(stats || index < first || r.pc < start || r.pc >= end)
+         continue;
+      match = reg < 0;
+      for(i = 0; i < r.regCount; ++i)
+         match |= r.reg[i] == reg;
+      if(match == 0)
+         continue;
+      if(useAddress && ((tag & TRACE_MEM) == 0 || (r.address & ~3) != address))
+         continue;
+      if(count >= 0 && printed >= count)
+         continue;
+      ++printed;
+
+      if(tag & TRACE_SKIP)
+      {
+         printf("%10lld %8.8x skipped\n", index, r.pc);
+         continue;
+      }
+      printf("%10lld %8.8x %8.8x %-7s", index, r.pc, r.opcode,
+         opcode_name(r.opcode));
+      for(i = 0; i < r.regCount; ++i)
+      {
+         if(r.reg[i] < 32)
+            printf(" r[%2.2d]=%8.8x", r.reg[i], r.regValue[i]);
+         else
+            printf(" %s=%8.8x", r.reg[i] == 32 ? "hi" : "lo", r.regValue[i]);
+      }
+      if(tag & TRACE_STORE)
+         printf(" [%8.8x]<=%8.8x", r.address, r.value);
+      else if(tag & TRACE_MEM)
+         printf(" [%8.8x]", r.address);
+      printf("\n");
+   }
+   bytes = ftell(in);
+   fclose(in);
+   if(stats)
+   {
+      printf("opcodes   %lld\n", index);
+      printf("skipped   %lld\n", skipped);
+      printf("loads     %lld\n", loads);
+      printf("stores    %lld\n", stores);
+      printf("registers %lld\n", regWrites);
+      printf("bytes     %lld (%.2f per opcode)\n", bytes,
+         index ? (double)bytes / index : 0.0);
+   }
+   return 0;
+}
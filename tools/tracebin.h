@@ -0,0 +1,51 @@
+/*--------------------------------------------------------------------
+ * TITLE: Plasma Binary Trace Format
+ * DATE CREATED: 10/16/26
+ * FILENAME: tracebin.h
+ * PROJECT: Plasma CPU core
+ * COPYRIGHT: Software placed into the public domain by the author.
+ *    Software 'as is' without warranty.  Author liable for nothing.
+ * DESCRIPTION:
+ *    Instruction trace written by "mlite -trace" and read by tracebin.
+ *
+ *    Header: "PTRC", version, flags, 2 reserved bytes, first PC (4 bytes
+ *    little endian).  Then one record per executed opcode starting with
+ *    a tag byte of TRACE_ bits followed by the fields in bit order:
+ *       TRACE_PC       zigzag varint of (pc - (previous pc + 4)) / 4
+ *       TRACE_OPCODE   opcode, 4 bytes little endian.  Only present when
+ *                      the opcode at this PC differs from the opcode
+ *                      in the TRACE_OPCODE_CACHE slot for the PC.
+ *       TRACE_REG      count byte then count * (register, varint value)
+ *                      for each changed register (32=HI 33=LO)
+ *       TRACE_MEM      zigzag varint of (address - previous address)
+ *       TRACE_STORE    varint of the value stored
+ *    TRACE_SKIP marks an opcode that was not executed (branch likely
+ *    delay slot or the opcode after an exception).  A tag of TRACE_END
+ *    ends the trace.
+ *    Varints are 7 bits per byte, least significant first, bit 7 set
+ *    when more bytes follow.
+ *--------------------------------------------------------------------*/
+#ifndef __TRACEBIN_H__
+#define __TRACEBIN_H__
+
+#define TRACE_MAGIC          "PTRC"
+#define TRACE_VERSION        1
+#define TRACE_HEADER_SIZE    12
+#define TRACE_BIG_ENDIAN     1        //header flags
+
+#define TRACE_PC             0x01
+#define TRACE_OPCODE         0x02
+#define TRACE_REG            0x04
+#define TRACE_MEM            0x08
+#define TRACE_STORE          0x10
+#define TRACE_SKIP           0x20
+#define TRACE_END            0x80
+
+#define TRACE_REGISTERS      34       //r[0..31], HI, LO
+#define TRACE_OPCODE_CACHE   4096
+#define TRACE_OPCODE_INDEX(PC) (((PC) >> 2) & (TRACE_OPCODE_CACHE - 1))
+
+#define TRACE_ZIGZAG(V)      (((unsigned int)(V) << 1) ^ (unsigned int)((int)(V) >> 31))
+#define TRACE_UNZIGZAG(V)    ((int)((V) >> 1) ^ -(int)((V) & 1))
+
+#endif //__TRACEBIN_H__
@@ -70,13 +70,16 @@ library ieee;
 use work.mlite_pack.all;
 use ieee.std_logic_1164.all;
 use ieee.std_logic_unsigned.all;
+use ieee.std_logic_textio.all;
+use std.textio.all;
 
 entity mlite_cpu is
    generic(memory_type     : string  := "XILINX_16X"; --ALTERA_LPM, or DUAL_PORT_
            mult_type       : string  := "DEFAULT"; --AREA_OPTIMIZED
            shifter_type    : string  := "DEFAULT"; --AREA_OPTIMIZED
            alu_type        : string  := "DEFAULT"; --AREA_OPTIMIZED
-           pipeline_stages : natural := 2); --2 or 3
+           pipeline_stages : natural := 2; --2 or 3
+           trace_file      : string  := "UNUSED"); --simulation only
    port(clk          : in std_logic;
         reset_in     : in std_logic;
         intr_in      : in std_logic;
@@ -142,6 +145,9 @@ architecture logic of mlite_cpu is
    signal exception_sig  : std_logic;
    signal reset_reg      : std_logic_vector(3 downto 0);
    signal reset          : std_logic;
+   signal address_sig    : std_logic_vector(31 downto 2);
+   signal byte_we_sig    : std_logic_vector(3 downto 0);
+   signal data_w_sig     : std_logic_vector(31 downto 0);
 begin  --architecture
 
    pause_any <= (mem_pause or pause_ctrl) or (pause_mult or pause_pipeline);
@@ -152,6 +158,9 @@ begin  --architecture
                           else '0';
    c_bus <= c_alu or c_shift or c_mult;
    reset <= '1' when reset_in = '1' or reset_reg /= "1111" else '0';
+   address <= address_sig;
+   byte_we <= byte_we_sig;
+   data_w <= data_w_sig;
 
    --synchronize reset and interrupt pins
    intr_proc: process(clk, reset_in, reset_reg, intr_in, intr_enable, 
@@ -209,9 +218,9 @@ begin  --architecture
         address_next => address_next,
         byte_we_next => byte_we_next,
 
-        address      => address,
-        byte_we      => byte_we,
-        data_w       => data_w,
+        address      => address_sig,
+        byte_we      => byte_we_sig,
+        data_w       => data_w_sig,
         data_r       => data_r);
 
    u3_control: control PORT MAP (
@@ -339,4 +348,46 @@ begin  --architecture
 
    end generate; --pipeline3
 
+-- synthesis_off
+   --One line per register write and per memory write for tools/cosim.c:
+   --   "cycle R pc register value" or "cycle W pc address byte_we data"
+   --pc is the opcode in stage #2, so a register write with the three 
+   --stage pipeline shows the following opcode.
+   cpu_tracer:
+   if trace_file /= "UNUSED" generate
+      trace_proc: process(clk)
+         file store_file : text open write_mode is trace_file;
+         variable trace_line : line;
+         variable cycle : natural := 0;
+      begin
+         if rising_edge(clk) and reset = '0' then
+            cycle := cycle + 1;
+            if pause_bank = '0' and rd_indexD(5) = '0' and 
+                  rd_indexD /= "000000" then
+               write(trace_line, cycle);
+               write(trace_line, string'(" R "));
+               hwrite(trace_line, pc_current & "00");
+               write(trace_line, ' ');
+               hwrite(trace_line, "00" & rd_indexD);
+               write(trace_line, ' ');
+               hwrite(trace_line, reg_destD);
+               writeline(store_file, trace_line);
+            end if;
+            if mem_pause = '0' and byte_we_sig /= "0000" then
+               write(trace_line, cycle);
+               write(trace_line, string'(" W "));
+               hwrite(trace_line, pc_current & "00");
+               write(trace_line, ' ');
+               hwrite(trace_line, address_sig & "00");
+               write(trace_line, ' ');
+               hwrite(trace_line, byte_we_sig);
+               write(trace_line, ' ');
+               hwrite(trace_line, data_w_sig);
+               writeline(store_file, trace_line);
+            end if;
+         end if; --rising_edge(clk)
+      end process; --trace_proc
+   end generate; --cpu_tracer
+-- synthesis_on
+
 end; --architecture logic
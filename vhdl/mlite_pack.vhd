@@ -331,7 +331,8 @@ package mlite_pack is
               mult_type       : string := "DEFAULT";
               shifter_type    : string := "DEFAULT";
               alu_type        : string := "DEFAULT";
-              pipeline_stages : natural := 2); --2 or 3
+              pipeline_stages : natural := 2; --2 or 3
+              trace_file      : string := "UNUSED");
       port(clk         : in std_logic;
            reset_in    : in std_logic;
            intr_in     : in std_logic;
@@ -415,6 +416,7 @@ package mlite_pack is
    component plasma
       generic(memory_type : string := "XILINX_X16"; --"DUAL_PORT_" "ALTERA_LPM";
               log_file    : string := "UNUSED";
+              trace_file  : string := "UNUSED";
               ethernet    : std_logic := '0';
               use_cache   : std_logic := '0');
       port(clk          : in std_logic;
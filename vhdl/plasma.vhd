@@ -39,6 +39,7 @@ use work.mlite_pack.all;
 entity plasma is
    generic(memory_type : string := "XILINX_16X"; --"DUAL_PORT_" "ALTERA_LPM";
            log_file    : string := "UNUSED";
+           trace_file  : string := "UNUSED";   --see mlite_cpu.vhd
            ethernet    : std_logic := '0';
            use_cache   : std_logic := '0');
    port(clk          : in std_logic;
@@ -124,7 +125,8 @@ begin  --architecture
    cpu_address(1 downto 0) <= "00";
 
    u1_cpu: mlite_cpu 
-      generic map (memory_type => memory_type)
+      generic map (memory_type => memory_type,
+                   trace_file  => trace_file)
       PORT MAP (
          clk          => clk,
          reset_in     => reset,
@@ -28,6 +28,11 @@ architecture logic of tbench is
 --   "UNUSED";
    "output.txt";
 
+   --Register and memory writes for "make cosim"
+   constant trace_file : string := 
+   "UNUSED";
+--   "rtl_trace.txt";
+
    signal clk         : std_logic := '1';
    signal reset       : std_logic := '1';
    signal interrupt   : std_logic := '0';
@@ -61,7 +66,8 @@ begin  --architecture
       generic map (memory_type => memory_type,
                    ethernet    => '1',
                    use_cache   => '1',
-                   log_file    => log_file)
+                   log_file    => log_file,
+                   trace_file  => trace_file)
       PORT MAP (
          clk               => clk,
          reset             => reset,